@@ -0,0 +1,128 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Host-side aggregation helpers shared by app.c, group_app.c and cpu_app.c
+ *
+ * An aggregation is a comma separated list over 1-based columns of the joined row,
+ * or of the grouped table in group_app.c:
+ *   "count,sum(col3),min(col5),max(col2)"
+ * Grouped aggregations keep one result row per join key, the key first,
+ * otherwise the result is a single row.
+ */
+
+static const char *agg_names[] = {"count", "sum", "min", "max"};
+
+// Parses an aggregation string, returns 0 on success and -1 on a malformed aggregation
+int parse_aggregate(const char *str, int total_col, agg_args_t *agg)
+{
+    const char *p = str;
+    char *end;
+
+    agg->func_num = 0;
+
+    while (*p)
+    {
+        if (agg->func_num == MAX_AGG_FUNCS)
+        {
+            fprintf(stderr, "Aggregation \"%s\": more than %d functions\n", str, MAX_AGG_FUNCS);
+            return -1;
+        }
+
+        int func = -1;
+        for (int f = AGG_COUNT; f <= AGG_MAX; f++)
+        {
+            if (strncmp(p, agg_names[f], strlen(agg_names[f])) == 0)
+            {
+                func = f;
+                p += strlen(agg_names[f]);
+                break;
+            }
+        }
+        if (func < 0)
+            goto malformed;
+
+        agg->funcs[agg->func_num] = func;
+        agg->cols[agg->func_num] = 0;
+
+        // count takes no column, the others take exactly one
+        if (func != AGG_COUNT)
+        {
+            if (strncmp(p, "(col", 4) != 0)
+                goto malformed;
+            int col = (int)strtol(p + 4, &end, 10) - 1;
+            if (end == p + 4 || *end != ')')
+                goto malformed;
+            if (col < 0 || col >= total_col)
+            {
+                fprintf(stderr, "Aggregation \"%s\": unknown column\n", str);
+                return -1;
+            }
+            agg->cols[agg->func_num] = col;
+            p = end + 1;
+        }
+        agg->func_num++;
+
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            goto malformed;
+    }
+
+    if (agg->func_num == 0)
+        goto malformed;
+
+    return 0;
+
+malformed:
+    fprintf(stderr, "Aggregation \"%s\": malformed near \"%s\"\n", str, p);
+    return -1;
+}
+
+// Aggregates joined rows sorted by key_col and returns the number of result rows
+// A grouped result row is the key followed by the aggregates
+int aggregate_rows(const agg_args_t *agg, const T *rows, int row_num, int total_col, int key_col, T *out)
+{
+    int out_col = agg->func_num + (agg->group_by_key ? 1 : 0);
+    int out_rows = 0;
+
+    for (int i = 0; i < row_num; i++)
+    {
+        const T *row = rows + (uint64_t)i * total_col;
+        bool new_row = i == 0 || (agg->group_by_key && row[key_col] != rows[(uint64_t)(i - 1) * total_col + key_col]);
+        if (new_row)
+            out_rows++;
+
+        T *acc = out + (out_rows - 1) * out_col;
+        if (agg->group_by_key)
+            *acc++ = row[key_col];
+
+        for (int f = 0; f < agg->func_num; f++)
+        {
+            T val = agg->funcs[f] == AGG_COUNT ? 1 : row[agg->cols[f]];
+            acc[f] = new_row ? val : agg_fold(agg->funcs[f], acc[f], val);
+        }
+    }
+
+    return out_rows;
+}
+
+// Writes the header line of an aggregation result, a grouped result starts with the key_num key columns
+void write_agg_header(FILE *file, const agg_args_t *agg, const int *key_cols, int key_num)
+{
+    for (int c = 0; c < key_num && agg->group_by_key; c++)
+    {
+        fprintf(file, c < key_num - 1 || agg->func_num > 0 ? "col%d," : "col%d\n", key_cols[c] + 1);
+    }
+
+    for (int f = 0; f < agg->func_num; f++)
+    {
+        if (agg->funcs[f] == AGG_COUNT)
+            fprintf(file, "count");
+        else
+            fprintf(file, "%s(col%d)", agg_names[agg->funcs[f]], agg->cols[f] + 1);
+        fprintf(file, f < agg->func_num - 1 ? "," : "\n");
+    }
+}
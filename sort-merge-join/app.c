@@ -1,23 +1,22 @@
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <dpu.h>
 #include <dpu_log.h>
+#include <math.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "timer.h"
 #include "common.h"
 #include "user.h"
-
-#ifndef DPU_BINARY_SELECT
-#define DPU_BINARY_SELECT "./select"
-#endif
-
-#ifndef DPU_BINARY_SORT_DPU
-#define DPU_BINARY_SORT_DPU "./sort_dpu"
-#endif
-
-#ifndef DPU_BINARY_MERGE_DPU
-#define DPU_BINARY_MERGE_DPU "./merge_dpu"
-#endif
+#include "predicate.h"
+#include "zone_map.h"
+#include "schema.h"
+#include "dictionary.h"
+#include "join_key.h"
+#include "aggregate.h"
+#include "trace.h"
+#include "executor.h"
 
 #ifndef DPU_BINARY_JOIN
 #define DPU_BINARY_JOIN "./join"
@@ -25,99 +24,261 @@
 
 dpu_result_t dpu_result[NR_DPUS];
 
-void set_csv_size(const char *filename, int *col_num, int *row_num)
+// First row in [left, right) whose key is not less than target
+int lower_bound(const T *arr, int col_num, int key_col, int left, int right, T target)
 {
-    FILE *file = fopen(filename, "r");
-    if (!file)
+    while (left < right)
     {
-        perror("Failed to open file");
-        exit(EXIT_FAILURE);
+        int mid = (left + right) / 2;
+        if (arr[mid * col_num + key_col] < target)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+
+    return left;
+}
+
+// First row in [left, right) whose key is greater than target
+int upper_bound(const T *arr, int col_num, int key_col, int left, int right, T target)
+{
+    while (left < right)
+    {
+        int mid = (left + right) / 2;
+        if (arr[mid * col_num + key_col] <= target)
+            left = mid + 1;
+        else
+            right = mid;
     }
 
-    char line[1024];
-    int is_first_line = 1;
+    return left;
+}
 
-    while (fgets(line, sizeof(line), file))
+// First row in [left, right) of a sorted run whose key is greater than target (upper)
+// or not less than target (!upper)
+// The sparse index narrows the search to one stride of rows before any row is touched
+int run_search(const dpu_result_t *run, int key_col, int left, int right, T target, bool upper)
+{
+    if (run->index != NULL && right - left > INDEX_STRIDE)
     {
-        if (is_first_line)
+        // Index keys of the rows inside [left, right), the first passing one bounds the answer from above
+        // and the one before it, a failing row, from below
+        int first = (left + INDEX_STRIDE - 1) / INDEX_STRIDE;
+        int last = (right + INDEX_STRIDE - 1) / INDEX_STRIDE;
+        int lo = first;
+        int hi = last;
+        while (lo < hi)
         {
-            is_first_line = 0;
-            char *token = strtok(line, ",");
-            while (token)
-            {
-                (*col_num)++;
-                token = strtok(NULL, ",");
-            }
+            int mid = (lo + hi) / 2;
+            if (upper ? run->index[mid] > target : run->index[mid] >= target)
+                hi = mid;
+            else
+                lo = mid + 1;
         }
-        (*row_num)++;
+
+        if (lo > first)
+            left = (lo - 1) * INDEX_STRIDE + 1;
+        if (lo < last)
+            right = lo * INDEX_STRIDE;
     }
 
-    (*row_num)--;
-    fclose(file);
+    if (upper)
+        return upper_bound(run->arr, run->col_num, key_col, left, right, target);
+    return lower_bound(run->arr, run->col_num, key_col, left, right, target);
 }
 
-void load_csv(const char *filename, int col_num, int row_num, T **test_array)
+// Key of row k of the merged order of sorted runs
+// Each step ranks the middle row of the widest open range, the rows of every run that come first
+// end up in [0, lo[r]) and row k is the smallest head left
+T run_row_key(const dpu_result_t *runs, int run_num, int key_col, uint64_t k)
 {
-    // Allocate memory for the array
-    *test_array = (T *)malloc(col_num * row_num * sizeof(T));
-
-    FILE *file = fopen(filename, "r");
-    if (!file)
+    int lo[run_num];
+    int hi[run_num];
+    for (int r = 0; r < run_num; r++)
     {
-        perror("Failed to open file");
-        exit(EXIT_FAILURE);
+        lo[r] = 0;
+        hi[r] = runs[r].row_num;
     }
 
-    char line[1024];
-    int row = 0;
+    while (true)
+    {
+        int m = -1;
+        for (int r = 0; r < run_num; r++)
+        {
+            if (hi[r] > lo[r] && (m < 0 || hi[r] - lo[r] > hi[m] - lo[m]))
+                m = r;
+        }
+        if (m < 0)
+            break;
 
-    // Skip header line
-    fgets(line, sizeof(line), file);
+        int mid = (lo[m] + hi[m]) / 2;
+        T pivot = runs[m].arr[mid * runs[m].col_num + key_col];
+
+        // Equal keys come in run order
+        int below[run_num];
+        uint64_t rank = 0;
+        for (int r = 0; r < run_num; r++)
+        {
+            if (r == m)
+                below[r] = mid;
+            else if (r < m)
+                below[r] = run_search(&runs[r], key_col, lo[r], hi[r], pivot, true);
+            else
+                below[r] = run_search(&runs[r], key_col, lo[r], hi[r], pivot, false);
+            rank += below[r];
+        }
 
-    // Read each row from the file
-    while (fgets(line, sizeof(line), file))
+        for (int r = 0; r < run_num; r++)
+        {
+            if (rank < k)
+                lo[r] = below[r] + (r == m ? 1 : 0);
+            else
+                hi[r] = below[r];
+        }
+    }
+
+    T key = 0;
+    bool found = false;
+    for (int r = 0; r < run_num; r++)
     {
-        char *token = strtok(line, ",");
-        int col = 0;
-        while (token)
+        if (lo[r] < runs[r].row_num && (!found || runs[r].arr[lo[r] * runs[r].col_num + key_col] < key))
         {
-            (*test_array)[row * col_num + col] = atoi(token);
-            token = strtok(NULL, ",");
-            col++;
+            key = runs[r].arr[lo[r] * runs[r].col_num + key_col];
+            found = true;
         }
-        row++;
     }
 
-    fclose(file);
+    return key;
 }
 
-int binary_search(dpu_result_t *table, int key_col, T target)
+// Smallest key of rows [idx[r], end[r]) over the runs, returns false once every run is done
+bool runs_min_key(const dpu_result_t *runs, int run_num, int key_col, const int *idx, const int *end, T *key)
 {
-    int left = 0;
-    int right = table->row_num - 1;
-    int idx = -1;
+    bool found = false;
+    for (int r = 0; r < run_num; r++)
+    {
+        if (idx[r] < end[r] && (!found || runs[r].arr[idx[r] * runs[r].col_num + key_col] < *key))
+        {
+            *key = runs[r].arr[idx[r] * runs[r].col_num + key_col];
+            found = true;
+        }
+    }
+
+    return found;
+}
 
-    while (left <= right)
+// Largest key of rows [idx[r], end[r]) over the runs, returns false when every run is empty
+bool runs_max_key(const dpu_result_t *runs, int run_num, int key_col, const int *idx, const int *end, T *key)
+{
+    bool found = false;
+    for (int r = 0; r < run_num; r++)
     {
-        int mid = (left + right) / 2;
-        T *mid_row = &table->arr[mid * table->col_num];
+        if (idx[r] < end[r] && (!found || runs[r].arr[(end[r] - 1) * runs[r].col_num + key_col] > *key))
+        {
+            *key = runs[r].arr[(end[r] - 1) * runs[r].col_num + key_col];
+            found = true;
+        }
+    }
+
+    return found;
+}
 
-        if (mid_row[key_col] == target)
+// Number of rows of the N:M join of two tables given as rows [start[r], end[r]) of sorted runs,
+// every key adds the product of its row counts over the runs of both tables
+// group_num is set to the number of distinct joined keys
+uint64_t count_join_rows(const dpu_result_t *runs1, int run_num1, const int *start1, const int *end1, int key1,
+                         const dpu_result_t *runs2, int run_num2, const int *start2, const int *end2, int key2, int *group_num)
+{
+    uint64_t count = 0;
+    *group_num = 0;
+    int idx1[run_num1];
+    int idx2[run_num2];
+    memcpy(idx1, start1, sizeof(idx1));
+    memcpy(idx2, start2, sizeof(idx2));
+
+    T val1, val2;
+    while (runs_min_key(runs1, run_num1, key1, idx1, end1, &val1) && runs_min_key(runs2, run_num2, key2, idx2, end2, &val2))
+    {
+        if (val1 < val2)
         {
-            return mid;
+            for (int r = 0; r < run_num1; r++)
+                idx1[r] = run_search(&runs1[r], key1, idx1[r], end1[r], val2, false);
         }
-        else if (mid_row[key_col] < target)
+        else if (val1 > val2)
         {
-            idx = mid;
-            left = mid + 1;
+            for (int r = 0; r < run_num2; r++)
+                idx2[r] = run_search(&runs2[r], key2, idx2[r], end2[r], val1, false);
         }
         else
         {
-            right = mid - 1;
+            int rows1 = 0;
+            int rows2 = 0;
+            for (int r = 0; r < run_num1; r++)
+            {
+                int run_end = run_search(&runs1[r], key1, idx1[r], end1[r], val1, true);
+                rows1 += run_end - idx1[r];
+                idx1[r] = run_end;
+            }
+            for (int r = 0; r < run_num2; r++)
+            {
+                int run_end = run_search(&runs2[r], key2, idx2[r], end2[r], val2, true);
+                rows2 += run_end - idx2[r];
+                idx2[r] = run_end;
+            }
+            count += (uint64_t)rows1 * rows2;
+            (*group_num)++;
         }
     }
 
-    return idx;
+    return count;
+}
+
+// How the result rows are written
+// str_cols marks the columns holding dictionary codes, key_str the columns of a composite key
+typedef struct
+{
+    const key_codec_t *codec;
+    const dict_t *dict;
+    int key_col;
+    bool grouped;
+    const bool *str_cols;
+    bool key_str[MAX_KEY_COLS];
+} result_format_t;
+
+// Writes a result row as a csv line
+// A composite key is left out of a joined row, which holds its columns already,
+// and is written as its columns in a group row
+void write_result_row(FILE *file, const T *row, int col_num, const result_format_t *fmt)
+{
+    const key_codec_t *codec = fmt->codec;
+    bool first = true;
+
+    for (int j = 0; j < col_num; j++)
+    {
+        bool key = codec->key_num > 1 && j == fmt->key_col;
+        if (key && !fmt->grouped)
+            continue;
+
+        if (!first)
+            fprintf(file, ",");
+        first = false;
+
+        if (key)
+        {
+            T vals[MAX_KEY_COLS];
+            decode_key(codec, row[j], vals);
+            for (int c = 0; c < codec->key_num; c++)
+            {
+                fprintf(file, c == 0 ? "" : ",");
+                write_value(file, fmt->dict, fmt->key_str[c], vals[c]);
+            }
+        }
+        else
+        {
+            write_value(file, fmt->dict, fmt->str_cols[j], row[j]);
+        }
+    }
+    fprintf(file, "\n");
 }
 
 int main(int argc, char *argv[])
@@ -127,36 +288,220 @@ int main(int argc, char *argv[])
     /* ************************** */
 
     // Get file name
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <table1.csv> <table2.csv> [--where1 <predicate>] [--where2 <predicate>] [--key1 <cols> --key2 <cols>] [--bloom] [--run-join] [--agg <functions> [--group]] [--order-by colN [--desc] --limit K] [--trace <trace.json>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
     const char *FILE_NAME1 = argv[1];
     const char *FILE_NAME2 = argv[2];
 
-    // Set timer
-    Timer timer;
-
-    double cpu_dpu_time = 0.0;
-    double dpu_time = 0.0;
-    double dpu_cpu_time = 0.0;
-
     // Set variables
     int col_num1 = 0;
-    int row_num1 = 0;
-    int total_row_num1 = 0;
+    uint64_t row_num1 = 0;
+    uint64_t total_row_num1 = 0;
     int col_num2 = 0;
-    int row_num2 = 0;
-    int total_row_num2 = 0;
+    uint64_t row_num2 = 0;
+    uint64_t total_row_num2 = 0;
 
     T *test_array1 = NULL;
     T *test_array2 = NULL;
     int pivot_id = -1;
 
     // Set col_num, row_num
+    timer_begin("csv size", TIMER_HOST);
     set_csv_size(FILE_NAME1, &col_num1, &row_num1);
     set_csv_size(FILE_NAME2, &col_num2, &row_num2);
-    int row_size = (row_num1 + row_num2) / NR_DPUS;
+    timer_end();
+    uint64_t row_size = (row_num1 + row_num2) / NR_DPUS;
+
+    // Set predicates, SELECT_COL/SELECT_VAL in user.h are the defaults
+    predicate_t pred[2];
+    set_default_predicate(&pred[0], SELECT_COL1, SELECT_VAL1);
+    set_default_predicate(&pred[1], SELECT_COL2, SELECT_VAL2);
+    bool use_bloom = false;
+
+    // The join merges the sorted runs itself instead of waiting for one merged block per table
+    bool run_join = false;
+
+    // Chrome trace-event timeline of the run, none by default
+    const char *trace_file = NULL;
+
+    // Aggregation over the joined rows, none by default
+    agg_args_t agg = {0};
+
+    // ORDER BY ... LIMIT over the joined rows, none by default
+    topk_args_t topk = {0};
+    topk.col = -1;
+
+    // Join key columns of both tables, JOIN_KEY1/JOIN_KEY2 in user.h are the defaults
+    // The aggregation and the order column are parsed once the joined columns are known
+    int key_cols[2][MAX_KEY_COLS] = {{JOIN_KEY1}, {JOIN_KEY2}};
+    int key_num[2] = {1, 1};
+    const char *agg_str = NULL;
+    const char *order_str = NULL;
+
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--where1") == 0 && i + 1 < argc)
+        {
+            if (parse_predicate(argv[++i], col_num1, &pred[0]) != 0)
+                exit(EXIT_FAILURE);
+        }
+        else if (strcmp(argv[i], "--where2") == 0 && i + 1 < argc)
+        {
+            if (parse_predicate(argv[++i], col_num2, &pred[1]) != 0)
+                exit(EXIT_FAILURE);
+        }
+        else if (strcmp(argv[i], "--key1") == 0 && i + 1 < argc)
+        {
+            key_num[0] = parse_key_cols(argv[++i], col_num1, key_cols[0]);
+            if (key_num[0] < 0)
+                exit(EXIT_FAILURE);
+        }
+        else if (strcmp(argv[i], "--key2") == 0 && i + 1 < argc)
+        {
+            key_num[1] = parse_key_cols(argv[++i], col_num2, key_cols[1]);
+            if (key_num[1] < 0)
+                exit(EXIT_FAILURE);
+        }
+        else if (strcmp(argv[i], "--bloom") == 0)
+        {
+            use_bloom = true;
+        }
+        else if (strcmp(argv[i], "--run-join") == 0)
+        {
+            run_join = true;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            trace_file = argv[++i];
+            trace_enable();
+        }
+        else if (strcmp(argv[i], "--agg") == 0 && i + 1 < argc)
+        {
+            agg_str = argv[++i];
+        }
+        else if (strcmp(argv[i], "--group") == 0)
+        {
+            agg.group_by_key = 1;
+        }
+        else if (strcmp(argv[i], "--order-by") == 0 && i + 1 < argc)
+        {
+            order_str = argv[++i];
+        }
+        else if (strcmp(argv[i], "--desc") == 0)
+        {
+            topk.desc = 1;
+        }
+        else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc)
+        {
+            topk.k = atoi(argv[++i]);
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (key_num[0] != key_num[1])
+    {
+        fprintf(stderr, "--key1 and --key2 need the same number of columns\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // A composite key joins on a key column appended to both tables, the joined rows of the kernels
+    // hold it after the columns of table 1 and keep every column of table 2
+    bool composite_key = key_num[0] > 1;
+    int user_col = col_num1 + col_num2 - (composite_key ? 0 : 1);
+
+    if (agg_str != NULL && parse_aggregate(agg_str, user_col, &agg) != 0)
+        exit(EXIT_FAILURE);
+
+    if (order_str != NULL)
+    {
+        topk.col = parse_column(order_str, user_col);
+        if (topk.col < 0)
+        {
+            fprintf(stderr, "Unknown order column %s\n", order_str);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The kernels see the columns of table 2 one further after the appended key
+    agg_args_t join_agg = agg;
+    for (int f = 0; f < join_agg.func_num && composite_key; f++)
+    {
+        if (join_agg.cols[f] >= col_num1)
+            join_agg.cols[f]++;
+    }
+    if (composite_key && topk.col >= col_num1)
+        topk.col++;
+
+    if (agg.group_by_key && agg.func_num == 0)
+    {
+        fprintf(stderr, "--group needs --agg\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((topk.col >= 0 || topk.k != 0) && (topk.col < 0 || topk.k < 1 || topk.k > MAX_TOPK || agg.func_num > 0))
+    {
+        fprintf(stderr, "--order-by needs --limit 1..%d and no --agg\n", MAX_TOPK);
+        exit(EXIT_FAILURE);
+    }
+
+    // The sorted and the joined rows also carry the key appended to both tables for a composite key
+    // Sort and merge keep every row, an aggregation runs in the join
+    agg_args_t keep_rows = {0};
+    int sort_col1 = col_num1 + (composite_key ? 1 : 0);
+    int sort_col2 = col_num2 + (composite_key ? 1 : 0);
+    int join_col = sort_col1 + sort_col2 - 1;
+    check_row_size("Select", col_num1, select_wram_size(col_num1));
+    check_row_size("Select", col_num2, select_wram_size(col_num2));
+    check_row_size("Sort", sort_col1, sort_wram_size(sort_col1, &keep_rows));
+    check_row_size("Sort", sort_col2, sort_wram_size(sort_col2, &keep_rows));
+    check_row_size("Join", join_col, join_wram_size(sort_col1, sort_col2, agg.func_num == 0 ? join_col : 1 + agg.func_num));
 
     // Set test_array
-    load_csv(FILE_NAME1, col_num1, row_num1, &test_array1);
-    load_csv(FILE_NAME2, col_num2, row_num2, &test_array2);
+    // String columns of both tables share one dictionary, codes in string order
+    dict_t dict = {0};
+    bool str_cols1[col_num1];
+    bool str_cols2[col_num2];
+    timer_begin("load csv", TIMER_HOST);
+    load_csv(FILE_NAME1, col_num1, row_num1, &test_array1, &dict, str_cols1);
+    load_csv(FILE_NAME2, col_num2, row_num2, &test_array2, &dict, str_cols2);
+    timer_end();
+
+    timer_begin("dictionary", TIMER_HOST);
+    int *remap = dict_sort(&dict);
+    dict_remap(remap, test_array1, row_num1, col_num1, str_cols1);
+    dict_remap(remap, test_array2, row_num2, col_num2, str_cols2);
+    free(remap);
+    timer_end();
+
+    // String columns of the joined rows as the user numbers them
+    bool user_str[user_col];
+    memcpy(user_str, str_cols1, col_num1 * sizeof(bool));
+    for (int c = 0, u = col_num1; c < col_num2; c++)
+    {
+        if (composite_key || c != key_cols[1][0])
+            user_str[u++] = str_cols2[c];
+    }
+
+    // Columns are sent to the select kernel in the narrowest width holding their values
+    timer_begin("schema", TIMER_HOST);
+    schema_t schema[2];
+    infer_schema(test_array1, row_num1, col_num1, &schema[0]);
+    infer_schema(test_array2, row_num2, col_num2, &schema[1]);
+    timer_end();
+
+#ifdef DEBUG
+    for (int t = 0; t < 2; t++)
+    {
+        printf("Table %d : rows of %d bytes packed in %d bytes\n", t, schema[t].col_num * (int)sizeof(T), schema[t].row_size);
+    }
+#endif
 
     int using_dpus;
     if (row_size == 0)
@@ -169,16 +514,11 @@ int main(int argc, char *argv[])
         using_dpus = NR_DPUS;
     }
 
-    // Allocate DPUs
-    struct dpu_set_t set, dpu;
-    uint32_t dpu_id;
-    DPU_ASSERT(dpu_alloc(using_dpus, "backend=simulator", &set));
-    DPU_ASSERT(dpu_load(set, DPU_BINARY_SELECT, NULL));
-
     // Set input arguments
     dpu_block_t input_args[using_dpus * 2];
-    int temp_first_row = row_num1;
-    int temp_second_row = row_num2;
+    T *input_rows[using_dpus];
+    uint64_t temp_first_row = row_num1;
+    uint64_t temp_second_row = row_num2;
     for (int i = 0; i < using_dpus - 1; i++)
     {
         if (temp_first_row > 0)
@@ -217,164 +557,122 @@ int main(int argc, char *argv[])
     input_args[using_dpus - 1].col_num = col_num2;
     input_args[using_dpus - 1].row_num = temp_second_row;
 
-    // Transfer input arguments and test_array to DPUs
-    start(&timer, 0, 0);
-    DPU_FOREACH(set, dpu, dpu_id)
-    {
-        DPU_ASSERT(dpu_prepare_xfer(dpu, &input_args[dpu_id]));
-    }
-    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "bl", 0, sizeof(input_args[0]), DPU_XFER_DEFAULT));
-
-    DPU_FOREACH(set, dpu, dpu_id)
+    // The last DPU takes the remainder of table 2, every other block is at most row_size rows of one table
+    // The Bloom filter of a semi-join reduction is built on the join key of the smaller table
+    for (int i = 0; i < using_dpus; i++)
     {
-        int transfer_size = input_args[dpu_id].row_num * input_args[dpu_id].col_num * sizeof(T);
-        if (input_args[dpu_id].table_num == 0)
-        {
-            int offset = dpu_id * row_size * col_num1;
-            DPU_ASSERT(dpu_prepare_xfer(dpu, test_array1 + offset));
-            DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, 0, transfer_size, DPU_XFER_DEFAULT));
-        }
+        input_args[i].key_col = key_cols[input_args[i].table_num][0];
+        if (input_args[i].table_num == 0)
+            input_rows[i] = test_array1 + i * row_size * col_num1;
         else
-        {
-            int offset = (dpu_id - pivot_id) * row_size * col_num2;
-            DPU_ASSERT(dpu_prepare_xfer(dpu, test_array2 + offset));
-            DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, 0, transfer_size, DPU_XFER_DEFAULT));
-        }
+            input_rows[i] = test_array2 + (uint64_t)(i - pivot_id) * row_size * col_num2;
     }
-    stop(&timer, 0);
 
-    start(&timer, 1, 0);
-    DPU_ASSERT(dpu_launch(set, DPU_SYNCHRONOUS));
-    stop(&timer, 1);
+    int build_table = use_bloom ? (row_num1 <= row_num2 ? 0 : 1) : -1;
+    uint64_t dropped_rows = 0;
+    select_blocks(input_args, input_rows, dpu_result, using_dpus, schema, pred, NULL, build_table, &dropped_rows);
 
-    // Retrieve dpu_result from DPUs
-    start(&timer, 2, 0);
-    DPU_FOREACH(set, dpu, dpu_id)
-    {
-        DPU_ASSERT(dpu_prepare_xfer(dpu, &input_args[dpu_id]));
-        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "bl", 0, sizeof(input_args[0]), DPU_XFER_DEFAULT));
-        dpu_result[dpu_id].table_num = input_args[dpu_id].table_num;
-        dpu_result[dpu_id].dpu_id = dpu_id;
-        dpu_result[dpu_id].col_num = input_args[dpu_id].col_num;
-        dpu_result[dpu_id].row_num = input_args[dpu_id].row_num;
-        if (dpu_result[dpu_id].table_num == 0)
-            total_row_num1 += dpu_result[dpu_id].row_num;
+    uint64_t probe_rows = dropped_rows;
+    for (int i = 0; i < using_dpus; i++)
+    {
+        if (input_args[i].table_num == 0)
+            total_row_num1 += input_args[i].row_num;
         else
-            total_row_num2 += dpu_result[dpu_id].row_num;
-
-        int transfer_size = dpu_result[dpu_id].row_num * dpu_result[dpu_id].col_num * sizeof(T);
-        dpu_result[dpu_id].arr = (T *)malloc(transfer_size);
-        DPU_ASSERT(dpu_prepare_xfer(dpu, dpu_result[dpu_id].arr));
-        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, DPU_MRAM_HEAP_POINTER_NAME, 0, transfer_size, DPU_XFER_DEFAULT));
+            total_row_num2 += input_args[i].row_num;
+        if (input_args[i].table_num != build_table)
+            probe_rows += input_args[i].row_num;
     }
-    stop(&timer, 2);
 
-    T *select_array1 = (T *)malloc(col_num1 * total_row_num1 * sizeof(T));
-    int offset = 0;
+    timer_begin("gather", TIMER_HOST);
+    T *select_array1 = (T *)malloc(col_num1 * total_row_num1 * sizeof(T) + sizeof(T));
+    uint64_t offset = 0;
     for (int i = 0; i < pivot_id; i++)
     {
-        int size = dpu_result[i].row_num * dpu_result[i].col_num;
+        uint64_t size = (uint64_t)dpu_result[i].row_num * dpu_result[i].col_num;
         memcpy(select_array1 + offset, dpu_result[i].arr, size * sizeof(T));
         offset += size;
     }
 
-    T *select_array2 = (T *)malloc(col_num2 * total_row_num2 * sizeof(T));
+    T *select_array2 = (T *)malloc(col_num2 * total_row_num2 * sizeof(T) + sizeof(T));
     offset = 0;
     for (int i = pivot_id; i < using_dpus; i++)
     {
-        int size = dpu_result[i].row_num * dpu_result[i].col_num;
+        uint64_t size = (uint64_t)dpu_result[i].row_num * dpu_result[i].col_num;
         memcpy(select_array2 + offset, dpu_result[i].arr, size * sizeof(T));
         offset += size;
     }
+    timer_end();
 
-    cpu_dpu_time += (timer.time[0] / 1000);
-    dpu_time += (timer.time[1] / 1000);
-    dpu_cpu_time += (timer.time[2] / 1000);
-
-#ifdef DEBUG
-    printf("==================\n");
-    printf("#    select.c    #\n");
-    printf("==================\n");
-
-    DPU_FOREACH(set, dpu)
+    // A composite key is encoded once over the selected rows of both tables and appended to them
+    key_codec_t codec = {0};
+    int join_key[2] = {key_cols[0][0], key_cols[1][0]};
+    if (composite_key)
     {
-        DPU_ASSERT(dpu_log_read(dpu, stdout));
-    }
+        timer_begin("composite key", TIMER_HOST);
+        T *rows[2] = {select_array1, select_array2};
+        uint64_t rows_num[2] = {total_row_num1, total_row_num2};
+        int cols_num[2] = {col_num1, col_num2};
+        build_key_codec(&codec, key_num[0], rows, rows_num, cols_num, key_cols);
+
+        T *keyed_array1 = append_key(&codec, select_array1, total_row_num1, col_num1, key_cols[0]);
+        T *keyed_array2 = append_key(&codec, select_array2, total_row_num2, col_num2, key_cols[1]);
+        free(select_array1);
+        free(select_array2);
+        select_array1 = keyed_array1;
+        select_array2 = keyed_array2;
+        join_key[0] = col_num1++;
+        join_key[1] = col_num2++;
+        timer_end();
 
-    printf("####################\n\n");
+#ifdef DEBUG
+        printf("Composite key : %s over %d columns\n", codec.packed ? "bit fields" : "ranks", codec.key_num);
 #endif
+    }
 
-    DPU_ASSERT(dpu_free(set));
+    if (use_bloom)
+        printf("Bloom filter : dropped %lu of %lu selected probe rows (%.2f%%)\n",
+               (unsigned long)dropped_rows, (unsigned long)probe_rows, probe_rows > 0 ? 100.0 * dropped_rows / probe_rows : 0.0);
 
     /* ************************ */
     /*     sort in each DPU     */
     /* ************************ */
 
-    // Allocate DPUs
-    struct dpu_set_t set1, dpu1;
-    DPU_ASSERT(dpu_alloc(using_dpus, "backend=simulator", &set1));
-    DPU_ASSERT(dpu_load(set1, DPU_BINARY_SORT_DPU, NULL));
-
     // Set input arguments
+    T *sort_rows[using_dpus];
+
+    // The last block of a table takes its remainder, the largest block of the table
     row_size = total_row_num1 / pivot_id;
+    uint64_t last_rows1 = total_row_num1 - (pivot_id - 1) * row_size;
+    check_mram_size("Sort", pivot_id - 1, last_rows1, sort_mram_size(last_rows1, col_num1, &keep_rows));
     for (int i = 0; i < pivot_id - 1; i++)
     {
         input_args[i].col_num = col_num1;
         input_args[i].row_num = row_size;
-        dpu_result[i].row_num = row_size;
     }
     input_args[pivot_id - 1].col_num = col_num1;
-    input_args[pivot_id - 1].row_num = total_row_num1 - (pivot_id - 1) * row_size;
-    dpu_result[pivot_id - 1].row_num = total_row_num1 - (pivot_id - 1) * row_size;
+    input_args[pivot_id - 1].row_num = last_rows1;
 
-    int temp_row_size = total_row_num2 / (using_dpus - pivot_id);
+    uint64_t temp_row_size = total_row_num2 / (using_dpus - pivot_id);
+    uint64_t last_rows2 = total_row_num2 - (using_dpus - pivot_id - 1) * temp_row_size;
+    check_mram_size("Sort", using_dpus - 1, last_rows2, sort_mram_size(last_rows2, col_num2, &keep_rows));
     for (int i = pivot_id; i < using_dpus - 1; i++)
     {
         input_args[i].col_num = col_num2;
         input_args[i].row_num = temp_row_size;
-        dpu_result[i].row_num = temp_row_size;
     }
     input_args[using_dpus - 1].col_num = col_num2;
-    input_args[using_dpus - 1].row_num = total_row_num2 - (using_dpus - pivot_id - 1) * temp_row_size;
-    dpu_result[using_dpus - 1].row_num = total_row_num2 - (using_dpus - pivot_id - 1) * temp_row_size;
-
-    // Transfer input arguments and test_array to DPUs
-    start(&timer, 0, 0);
-    DPU_FOREACH(set1, dpu1, dpu_id)
-    {
-        DPU_ASSERT(dpu_prepare_xfer(dpu1, &input_args[dpu_id]));
-    }
-    DPU_ASSERT(dpu_push_xfer(set1, DPU_XFER_TO_DPU, "bl", 0, sizeof(input_args[0]), DPU_XFER_DEFAULT));
+    input_args[using_dpus - 1].row_num = last_rows2;
 
-    DPU_FOREACH(set1, dpu1, dpu_id)
+    for (int i = 0; i < using_dpus; i++)
     {
-        int transfer_size = input_args[dpu_id].row_num * input_args[dpu_id].col_num * sizeof(T);
-        dpu_result[dpu_id].arr = (T *)malloc(transfer_size);
-        if (input_args[dpu_id].table_num == 0)
-            DPU_ASSERT(dpu_prepare_xfer(dpu1, select_array1 + dpu_id * row_size * col_num1));
+        input_args[i].key_col = join_key[input_args[i].table_num];
+        if (input_args[i].table_num == 0)
+            sort_rows[i] = select_array1 + i * row_size * col_num1;
         else
-            DPU_ASSERT(dpu_prepare_xfer(dpu1, select_array2 + (dpu_id - pivot_id) * temp_row_size * col_num2));
-        DPU_ASSERT(dpu_push_xfer(set1, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, 0, transfer_size, DPU_XFER_DEFAULT));
-    }
-    stop(&timer, 0);
-
-    start(&timer, 1, 0);
-    DPU_ASSERT(dpu_launch(set1, DPU_SYNCHRONOUS));
-    stop(&timer, 1);
-
-    // Retrieve dpu_result from DPUs
-    start(&timer, 2, 0);
-    DPU_FOREACH(set1, dpu1, dpu_id)
-    {
-        int transfer_size = input_args[dpu_id].row_num * input_args[dpu_id].col_num * sizeof(T);
-        DPU_ASSERT(dpu_prepare_xfer(dpu1, dpu_result[dpu_id].arr));
-        DPU_ASSERT(dpu_push_xfer(set1, DPU_XFER_FROM_DPU, DPU_MRAM_HEAP_POINTER_NAME, 0, transfer_size, DPU_XFER_DEFAULT));
+            sort_rows[i] = select_array2 + (uint64_t)(i - pivot_id) * temp_row_size * col_num2;
     }
-    stop(&timer, 2);
 
-    cpu_dpu_time += (timer.time[0] / 1000);
-    dpu_time += (timer.time[1] / 1000);
-    dpu_cpu_time += (timer.time[2] / 1000);
+    sort_blocks(input_args, sort_rows, dpu_result, using_dpus, &keep_rows);
 
 #ifdef DEBUG
     printf("==================\n");
@@ -395,11 +693,10 @@ int main(int argc, char *argv[])
         // printf("---------------\n");
     }
 
-    printf("total_row_num: %d %d\n", total_row_num1, total_row_num2);
+    printf("total_row_num: %lu %lu\n", (unsigned long)total_row_num1, (unsigned long)total_row_num2);
     printf("####################\n\n");
 #endif
 
-    DPU_ASSERT(dpu_free(set1));
     free(test_array1);
     free(test_array2);
     free(select_array1);
@@ -409,149 +706,25 @@ int main(int argc, char *argv[])
     /*     add & sort DPU results     */
     /* ****************************** */
 
-    // merge each dpu results
-    struct dpu_set_t set2, dpu2;
-    int cnt = 0;
-    int cur_dpus = pivot_id;
-    int cur_dpus2 = using_dpus - pivot_id;
-    bool check[2] = {false}; // completion check for two tables
-
-    while (!check[0] || !check[1])
+    // Merge the sorted blocks of each table into dpu_result[0] and dpu_result[pivot_id],
+    // a run join only merges a table sorted into more runs than a join DPU has tiles for
+    int max_runs = 1;
+    if (run_join)
     {
-        int next = (cur_dpus + 1) / 2 + (cur_dpus2 + 1) / 2;
-        DPU_ASSERT(dpu_alloc(next, "backend=simulator", &set2));
-        DPU_ASSERT(dpu_load(set2, DPU_BINARY_MERGE_DPU, NULL));
-
-        // Transfer input arguments and test_array to DPUs
-        start(&timer, 0, 0);
-        DPU_FOREACH(set2, dpu2, dpu_id)
-        {
-            int table_num, pair_index, temp_cur;
-            if (dpu_id < (cur_dpus + 1) / 2)
-            {
-                table_num = 0;
-                pair_index = dpu_id * 2;
-                temp_cur = cur_dpus;
-            }
-            else
-            {
-                table_num = 1;
-                pair_index = pivot_id + (dpu_id - (cur_dpus + 1) / 2) * 2;
-                temp_cur = pivot_id + cur_dpus2;
-            }
-            bool is_checked = check[table_num];
-
-            if (pair_index + 1 < temp_cur && !is_checked)
-            {
-                DPU_ASSERT(dpu_prepare_xfer(dpu2, &input_args[pair_index]));
-                DPU_ASSERT(dpu_push_xfer(set2, DPU_XFER_TO_DPU, "bl1", 0, sizeof(dpu_block_t), DPU_XFER_DEFAULT));
-                DPU_ASSERT(dpu_prepare_xfer(dpu2, &input_args[pair_index + 1]));
-                DPU_ASSERT(dpu_push_xfer(set2, DPU_XFER_TO_DPU, "bl2", 0, sizeof(dpu_block_t), DPU_XFER_DEFAULT));
-
-                uint32_t first_size = input_args[pair_index].row_num * input_args[pair_index].col_num * sizeof(T);
-                uint32_t second_size = input_args[pair_index + 1].row_num * input_args[pair_index + 1].col_num * sizeof(T);
-                DPU_ASSERT(dpu_prepare_xfer(dpu2, dpu_result[pair_index].arr));
-                DPU_ASSERT(dpu_push_xfer(set2, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, 0, first_size, DPU_XFER_DEFAULT));
-                DPU_ASSERT(dpu_prepare_xfer(dpu2, dpu_result[pair_index + 1].arr));
-                DPU_ASSERT(dpu_push_xfer(set2, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, first_size + second_size, second_size, DPU_XFER_DEFAULT));
-
-                free(dpu_result[pair_index].arr);
-                free(dpu_result[pair_index + 1].arr);
-            }
-        }
-        stop(&timer, 0);
-
-        start(&timer, 1, 0);
-        DPU_ASSERT(dpu_launch(set2, DPU_SYNCHRONOUS));
-        stop(&timer, 1);
-
-        // Retrieve dpu_result from DPUs
-        start(&timer, 2, 0);
-        DPU_FOREACH(set2, dpu2, dpu_id)
-        {
-            int table_num, pair_index, temp_cur, temp_dpu_id;
-            if (dpu_id < (cur_dpus + 1) / 2)
-            {
-                table_num = 0;
-                pair_index = dpu_id * 2;
-                temp_cur = cur_dpus;
-                temp_dpu_id = dpu_id;
-            }
-            else
-            {
-                table_num = 1;
-                pair_index = pivot_id + (dpu_id - (cur_dpus + 1) / 2) * 2;
-                temp_cur = pivot_id + cur_dpus2;
-                temp_dpu_id = pivot_id + dpu_id - (cur_dpus + 1) / 2;
-            }
-            bool is_checked = check[table_num];
-
-            if (pair_index + 1 < temp_cur && !is_checked)
-            {
-                int transfer_size = (input_args[pair_index].row_num + input_args[pair_index + 1].row_num) * input_args[pair_index].col_num * sizeof(T);
-
-                dpu_result[temp_dpu_id].arr = (T *)malloc(transfer_size);
-                dpu_result[temp_dpu_id].row_num = input_args[pair_index].row_num + input_args[pair_index + 1].row_num;
-                input_args[temp_dpu_id].row_num = input_args[pair_index].row_num + input_args[pair_index + 1].row_num;
-
-                DPU_ASSERT(dpu_prepare_xfer(dpu2, dpu_result[temp_dpu_id].arr));
-                DPU_ASSERT(dpu_push_xfer(set2, DPU_XFER_FROM_DPU, DPU_MRAM_HEAP_POINTER_NAME, 0, transfer_size, DPU_XFER_DEFAULT));
-            }
-        }
-        stop(&timer, 2);
-
-        DPU_ASSERT(dpu_free(set2));
-
-        if (cur_dpus % 2 == 1)
-        {
-            int target_dpu = cur_dpus / 2;
-
-            input_args[target_dpu] = input_args[cur_dpus - 1];
-            dpu_result[target_dpu] = dpu_result[cur_dpus - 1];
-            dpu_result[target_dpu].dpu_id = target_dpu;
-        }
-        if (cur_dpus2 % 2 == 1)
-        {
-            int target_dpu = cur_dpus2 / 2 + pivot_id;
-
-            input_args[target_dpu] = input_args[cur_dpus2 - 1 + pivot_id];
-            dpu_result[target_dpu] = dpu_result[cur_dpus2 - 1 + pivot_id];
-            dpu_result[target_dpu].dpu_id = target_dpu;
-        }
-
-        if (!check[0])
-        {
-            cur_dpus = (cur_dpus + 1) / 2;
-        }
-        if (!check[1])
-        {
-            cur_dpus2 = (cur_dpus2 + 1) / 2;
-        }
-
-        if (cur_dpus <= 1)
-        {
-            cur_dpus = 0;
-            check[0] = true;
-        }
-        if (cur_dpus2 <= 1)
-        {
-            cur_dpus2 = 0;
-            check[1] = true;
-        }
-
-        cnt++;
-
-        cpu_dpu_time += (timer.time[0] / 1000);
-        dpu_time += (timer.time[1] / 1000);
-        dpu_cpu_time += (timer.time[2] / 1000);
+        max_runs = RUN_TILE_SIZE / ((col_num1 > col_num2 ? col_num1 : col_num2) * sizeof(T));
+        max_runs = max_runs < 1 ? 1 : (max_runs > MAX_JOIN_RUNS ? MAX_JOIN_RUNS : max_runs);
     }
 
+    int first_block[2] = {0, pivot_id};
+    int block_count[2] = {pivot_id, using_dpus - pivot_id};
+    merge_rounds(input_args, dpu_result, 2, first_block, block_count, max_runs, &keep_rows);
+
 #ifdef DEBUG
     printf("==================\n");
     printf("#     merge.c    #\n");
     printf("==================\n");
 
-    printf("Table 0 %d rows\n", dpu_result[0].row_num);
+    printf("Table 0 %d runs, run 0 %d rows\n", block_count[0], dpu_result[0].row_num);
     // for (int i = 0; i < dpu_result[0].row_num; i++)
     // {
     //     for (int j = 0; j < dpu_result[0].col_num; j++)
@@ -561,7 +734,7 @@ int main(int argc, char *argv[])
     //     printf("\n");
     // }
 
-    printf("Table 1 %d rows\n", dpu_result[pivot_id].row_num);
+    printf("Table 1 %d runs, run 0 %d rows\n", block_count[1], dpu_result[pivot_id].row_num);
     // for (int i = 0; i < dpu_result[pivot_id].row_num; i++)
     // {
     //     for (int j = 0; j < dpu_result[pivot_id].col_num; j++)
@@ -572,131 +745,311 @@ int main(int argc, char *argv[])
     // }
     // printf("---------------\n");
 
-    printf("total row num: %d %d\n", total_row_num1, total_row_num2);
+    printf("total row num: %lu %lu\n", (unsigned long)total_row_num1, (unsigned long)total_row_num2);
     printf("####################\n\n");
 #endif
 
-    /* ************************** */
-    /*     join dpu_result[0]     */
-    /*             &              */
-    /*    dpu_result[pivot_id]    */
-    /* ************************** */
-
-    int used_idx[pivot_id];
-    int cur_idx_t2 = 0;
+    /* ********************************** */
+    /*     join the runs of both tables     */
+    /* ********************************** */
 
     // Set input arguments
+    // Table 1 is split evenly, a slice ends on the key of its last row in the merged order of the runs
+    // and takes the rest of that key, every run of both tables gives its rows up to that key,
+    // so equal keys never straddle two DPUs. The key range of both tables then trims the rows that cannot join
+    timer_begin("join", TIMER_STAGE);
+    timer_begin("join partition", TIMER_HOST);
+    dpu_result_t *runs1 = dpu_result;
+    dpu_result_t *runs2 = dpu_result + pivot_id;
+    int run_num[2] = {block_count[0], block_count[1]};
+    int (*join_start)[2][MAX_JOIN_RUNS] = malloc(pivot_id * sizeof(*join_start));
+    int (*join_rows)[2][MAX_JOIN_RUNS] = malloc(pivot_id * sizeof(*join_rows));
+    int expected_row[pivot_id];
+    int cur_idx_t1[MAX_JOIN_RUNS] = {0};
+    int cur_idx_t2[MAX_JOIN_RUNS] = {0};
+    uint64_t taken_rows1 = 0;
+    int pruned_dpus = 0;
+    uint64_t max_expected_row = 0;
+    uint64_t max_input_size = 0;
     row_size = total_row_num1 / pivot_id;
 
-    for (int i = 0; i < pivot_id - 1; i++)
+    for (int i = 0; i < pivot_id; i++)
     {
-        input_args[i].col_num = col_num1;
-        input_args[i].row_num = row_size;
-        dpu_result[i].row_num = row_size;
+        int start1[MAX_JOIN_RUNS], end1[MAX_JOIN_RUNS];
+        int start2[MAX_JOIN_RUNS], end2[MAX_JOIN_RUNS];
+        int rows1 = 0;
+        int rows2 = 0;
+
+        // A slice already covered by the key run of the previous one stays empty
+        bool last = i == pivot_id - 1;
+        bool take = last || (i + 1) * row_size > taken_rows1;
+        T bound = take && !last ? run_row_key(runs1, run_num[0], join_key[0], (i + 1) * row_size - 1) : 0;
+        for (int r = 0; r < run_num[0]; r++)
+        {
+            start1[r] = cur_idx_t1[r];
+            end1[r] = !take ? start1[r] : (last ? runs1[r].row_num : run_search(&runs1[r], join_key[0], start1[r], runs1[r].row_num, bound, true));
+            cur_idx_t1[r] = end1[r];
+            rows1 += end1[r] - start1[r];
+        }
+        for (int r = 0; r < run_num[1]; r++)
+        {
+            start2[r] = cur_idx_t2[r];
+            end2[r] = !take ? start2[r] : (last ? runs2[r].row_num : run_search(&runs2[r], join_key[1], start2[r], runs2[r].row_num, bound, true));
+            cur_idx_t2[r] = end2[r];
+            rows2 += end2[r] - start2[r];
+        }
+        taken_rows1 += rows1;
 
-        if (i)
+        // Zone map of the slice: keep only the rows inside the overlap of both key ranges
+        if (rows1 > 0 && rows2 > 0)
         {
-            dpu_result[i].arr = malloc(col_num1 * row_size * sizeof(T));
-            memcpy(dpu_result[i].arr, dpu_result[0].arr + (col_num1 * row_size) * i, col_num1 * row_size * sizeof(T));
+            T lo, hi, min2, max2;
+            runs_min_key(runs1, run_num[0], join_key[0], start1, end1, &lo);
+            runs_max_key(runs1, run_num[0], join_key[0], start1, end1, &hi);
+            runs_min_key(runs2, run_num[1], join_key[1], start2, end2, &min2);
+            runs_max_key(runs2, run_num[1], join_key[1], start2, end2, &max2);
+            lo = lo > min2 ? lo : min2;
+            hi = hi < max2 ? hi : max2;
+
+            rows1 = rows2 = 0;
+            for (int r = 0; r < run_num[0]; r++)
+            {
+                start1[r] = run_search(&runs1[r], join_key[0], start1[r], end1[r], lo, false);
+                end1[r] = run_search(&runs1[r], join_key[0], start1[r], end1[r], hi, true);
+                rows1 += end1[r] - start1[r];
+            }
+            for (int r = 0; r < run_num[1]; r++)
+            {
+                start2[r] = run_search(&runs2[r], join_key[1], start2[r], end2[r], lo, false);
+                end2[r] = run_search(&runs2[r], join_key[1], start2[r], end2[r], hi, true);
+                rows2 += end2[r] - start2[r];
+            }
         }
 
-        used_idx[i] = binary_search(&dpu_result[pivot_id], JOIN_KEY2, dpu_result[i].arr[(row_size - 1) * col_num1 + JOIN_KEY1]);
+        // The slice cannot produce a row, the DPU gets no input
+        if (rows1 == 0 || rows2 == 0)
+        {
+            memcpy(end1, start1, sizeof(end1));
+            memcpy(end2, start2, sizeof(end2));
+            rows1 = rows2 = 0;
+            pruned_dpus++;
+        }
 
-        if (i)
+        for (int r = 0; r < run_num[0]; r++)
         {
-            input_args[pivot_id + i].col_num = col_num2;
-            input_args[pivot_id + i].row_num = used_idx[i] - cur_idx_t2 + 1;
-            dpu_result[pivot_id + i].row_num = used_idx[i] - cur_idx_t2 + 1;
-            dpu_result[pivot_id + i].arr = malloc(dpu_result[pivot_id + i].row_num * col_num2 * sizeof(T));
-            memcpy(dpu_result[pivot_id + i].arr, dpu_result[pivot_id].arr + cur_idx_t2 * col_num2, dpu_result[pivot_id + i].row_num * col_num2 * sizeof(T));
+            join_start[i][0][r] = start1[r];
+            join_rows[i][0][r] = end1[r] - start1[r];
+        }
+        for (int r = 0; r < run_num[1]; r++)
+        {
+            join_start[i][1][r] = start2[r];
+            join_rows[i][1][r] = end2[r] - start2[r];
         }
 
-        cur_idx_t2 = used_idx[i] + 1;
+        input_args[i].key_col = join_key[0];
+        input_args[i].col_num = col_num1;
+        input_args[i].row_num = rows1;
+        input_args[pivot_id + i].key_col = join_key[1];
+        input_args[pivot_id + i].col_num = col_num2;
+        input_args[pivot_id + i].row_num = rows2;
+
+        // Reserve the exact result size
+        // An aggregation returns one row per joined key, or a single row for the whole DPU
+        // The count is checked against the MRAM below before the DPU gets it as an int
+        int group_num;
+        uint64_t joined_rows = count_join_rows(runs1, run_num[0], start1, end1, join_key[0], runs2, run_num[1], start2, end2, join_key[1], &group_num);
+        if (agg.func_num > 0)
+            joined_rows = agg.group_by_key ? group_num : (group_num > 0 ? 1 : 0);
+        expected_row[i] = (int)joined_rows;
+        if (joined_rows > max_expected_row)
+            max_expected_row = joined_rows;
+
+        uint64_t input_size = ((uint64_t)rows1 * col_num1 + (uint64_t)rows2 * col_num2) * sizeof(T);
+        if (input_size > max_input_size)
+            max_input_size = input_size;
     }
 
-    input_args[pivot_id - 1].col_num = col_num1;
-    input_args[pivot_id - 1].row_num = total_row_num1 - (pivot_id - 1) * row_size;
-    dpu_result[pivot_id - 1].row_num = total_row_num1 - (pivot_id - 1) * row_size;
+    timer_end();
 
-    dpu_result[pivot_id - 1].arr = malloc(col_num1 * (total_row_num1 - (pivot_id - 1) * row_size) * sizeof(T));
-    memcpy(dpu_result[pivot_id - 1].arr, dpu_result[0].arr + col_num1 * row_size * (pivot_id - 1), col_num1 * (total_row_num1 - (pivot_id - 1) * row_size) * sizeof(T));
+    // A join DPU merges several runs after its input
+    if (run_num[0] > 1 || run_num[1] > 1)
+        max_input_size *= 2;
 
-    input_args[2 * pivot_id - 1].col_num = col_num2;
-    input_args[2 * pivot_id - 1].row_num = total_row_num2 - cur_idx_t2 + 1;
-    dpu_result[2 * pivot_id - 1].row_num = total_row_num2 - cur_idx_t2 + 1;
-
-    dpu_result[2 * pivot_id - 1].arr = malloc(dpu_result[2 * pivot_id - 1].row_num * col_num2 * sizeof(T));
-    memcpy(dpu_result[2 * pivot_id - 1].arr, dpu_result[pivot_id].arr + cur_idx_t2 * col_num2, dpu_result[2 * pivot_id - 1].row_num * col_num2 * sizeof(T));
+    // Every DPU writes its result after the largest input of the set,
+    // so the results of all DPUs are gathered with one transfer padded to the largest result
+    int total_col = col_num1 + col_num2 - 1;
+    int out_col = agg.func_num == 0 ? total_col : (agg.group_by_key ? 1 : 0) + agg.func_num;
+    if (agg.func_num > 0 && !agg.group_by_key)
+        max_expected_row = 0;
+    // Every tasklet joins into a private region past the result slab that holds up to the rows of the DPU,
+    // a top-K then ranks the joined rows on the DPU and leaves its k first rows over those regions
+    uint64_t result_slab = (uint64_t)max_expected_row * out_col * sizeof(T);
+    uint64_t region_size = NR_TASKLETS * result_slab;
+    uint64_t topk_size = (uint64_t)topk.k * out_col * sizeof(T);
+    if (topk_size > region_size)
+        region_size = topk_size;
 
-    input_args[pivot_id].col_num = col_num2;
-    input_args[pivot_id].row_num = used_idx[0] + 1;
-    dpu_result[pivot_id].row_num = used_idx[0] + 1;
+#ifdef DEBUG
+    printf("Zone map : skip %d of %d DPUs in join\n", pruned_dpus, pivot_id);
+#endif
 
     // Transfer input arguments and test_array to DPUs
     struct dpu_set_t set3, dpu3;
+    uint32_t dpu_id;
 
-    DPU_ASSERT(dpu_alloc(pivot_id, "backend=simulator", &set3));
-    DPU_ASSERT(dpu_load(set3, DPU_BINARY_JOIN, NULL));
+    alloc_dpus(pivot_id, DPU_BINARY_JOIN, &set3);
 
-    start(&timer, 3, 0);
+    // The input, the result slab and the private regions or the top rows have to fit in the heap of the join program
+    if (max_input_size + result_slab + region_size > mram_heap_size)
+    {
+        fprintf(stderr, "Join needs %lu bytes of MRAM per DPU for %lu result rows\n", (unsigned long)(max_input_size + result_slab + region_size), (unsigned long)max_expected_row);
+        exit(EXIT_FAILURE);
+    }
+    uint32_t result_offset = (uint32_t)max_input_size;
+    topk.out_offset = (uint32_t)(max_input_size + result_slab);
+
+    timer_begin("broadcast args", TIMER_CPU_DPU);
+    DPU_ASSERT(dpu_broadcast_to(set3, "result_offset", 0, &result_offset, sizeof(uint32_t), DPU_XFER_DEFAULT));
+    DPU_ASSERT(dpu_broadcast_to(set3, "agg", 0, &join_agg, sizeof(agg_args_t), DPU_XFER_DEFAULT));
+    DPU_ASSERT(dpu_broadcast_to(set3, "topk", 0, &topk, sizeof(topk_args_t), DPU_XFER_DEFAULT));
+    DPU_ASSERT(dpu_broadcast_to(set3, "run_num", 0, run_num, sizeof(run_num), DPU_XFER_DEFAULT));
+    timer_bytes((uint64_t)pivot_id * (sizeof(uint32_t) + sizeof(agg_args_t) + sizeof(topk_args_t) + sizeof(run_num)));
+    timer_end();
+
+    timer_begin("push rows", TIMER_CPU_DPU);
+    uint64_t bytes = 0;
     DPU_FOREACH(set3, dpu3, dpu_id)
     {
         DPU_ASSERT(dpu_prepare_xfer(dpu3, &input_args[dpu_id]));
         DPU_ASSERT(dpu_push_xfer(set3, DPU_XFER_TO_DPU, "bl1", 0, sizeof(dpu_block_t), DPU_XFER_DEFAULT));
         DPU_ASSERT(dpu_prepare_xfer(dpu3, &input_args[pivot_id + dpu_id]));
         DPU_ASSERT(dpu_push_xfer(set3, DPU_XFER_TO_DPU, "bl2", 0, sizeof(dpu_block_t), DPU_XFER_DEFAULT));
+        DPU_ASSERT(dpu_prepare_xfer(dpu3, &expected_row[dpu_id]));
+        DPU_ASSERT(dpu_push_xfer(set3, DPU_XFER_TO_DPU, "max_joined_row", 0, sizeof(int), DPU_XFER_DEFAULT));
 
-        uint32_t first_size = input_args[dpu_id].row_num * input_args[dpu_id].col_num * sizeof(T);
-        uint32_t second_size = input_args[pivot_id + dpu_id].row_num * input_args[pivot_id + dpu_id].col_num * sizeof(T);
-        DPU_ASSERT(dpu_prepare_xfer(dpu3, dpu_result[dpu_id].arr));
-        DPU_ASSERT(dpu_push_xfer(set3, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, 0, first_size, DPU_XFER_DEFAULT));
-        DPU_ASSERT(dpu_prepare_xfer(dpu3, dpu_result[pivot_id + dpu_id].arr));
-        DPU_ASSERT(dpu_push_xfer(set3, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, first_size, second_size, DPU_XFER_DEFAULT));
+        DPU_ASSERT(dpu_prepare_xfer(dpu3, join_rows[dpu_id]));
+        DPU_ASSERT(dpu_push_xfer(set3, DPU_XFER_TO_DPU, "run_rows", 0, sizeof(join_rows[0]), DPU_XFER_DEFAULT));
 
-        free(dpu_result[dpu_id].arr);
-        free(dpu_result[pivot_id + dpu_id].arr);
+        // The slices of every run of table 1 come first, those of table 2 follow
+        uint32_t offset = 0;
+        for (int t = 0; t < 2; t++)
+        {
+            dpu_result_t *runs = t == 0 ? runs1 : runs2;
+            for (int r = 0; r < run_num[t]; r++)
+            {
+                uint32_t slice_size = join_rows[dpu_id][t][r] * runs[r].col_num * sizeof(T);
+                if (slice_size == 0)
+                    continue;
+
+                DPU_ASSERT(dpu_prepare_xfer(dpu3, runs[r].arr + (uint64_t)join_start[dpu_id][t][r] * runs[r].col_num));
+                DPU_ASSERT(dpu_push_xfer(set3, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, offset, slice_size, DPU_XFER_DEFAULT));
+                offset += slice_size;
+            }
+        }
+        bytes += 2 * sizeof(dpu_block_t) + sizeof(int) + sizeof(join_rows[0]) + offset;
+    }
+    timer_bytes(bytes);
+    timer_end();
+
+    for (int t = 0; t < 2; t++)
+    {
+        for (int r = 0; r < run_num[t]; r++)
+        {
+            free((t == 0 ? runs1 : runs2)[r].arr);
+        }
     }
-    stop(&timer, 3);
+    free(join_start);
+    free(join_rows);
 
-    start(&timer, 1, 0);
-    DPU_ASSERT(dpu_launch(set3, DPU_SYNCHRONOUS));
-    stop(&timer, 1);
+    launch_kernel(set3, KERNEL_JOIN);
+    stats_collect(set3, KERNEL_JOIN);
 
     // Retrieve dpu_result from DPUs
-    T *result[using_dpus];
-    int cur_idx = 0;
+    // All counts come back in one parallel transfer, then every result slab in another
+    uint64_t cur_idx = 0;
     int joined_row[using_dpus];
 
-    start(&timer, 2, 0);
+    timer_begin("pull counts", TIMER_DPU_CPU);
     DPU_FOREACH(set3, dpu3, dpu_id)
     {
-        uint32_t first_size = input_args[dpu_id].row_num * col_num1 * sizeof(T);
-        uint32_t second_size = input_args[pivot_id + dpu_id].row_num * col_num2 * sizeof(T);
-
         DPU_ASSERT(dpu_prepare_xfer(dpu3, &joined_row[dpu_id]));
-        DPU_ASSERT(dpu_push_xfer(set3, DPU_XFER_FROM_DPU, "joined_row", 0, sizeof(int), DPU_XFER_DEFAULT));
-
-        result[dpu_id] = (T *)malloc(joined_row[dpu_id] * (col_num1 + col_num2 - 1) * sizeof(T));
+    }
+    DPU_ASSERT(dpu_push_xfer(set3, DPU_XFER_FROM_DPU, "joined_row", 0, sizeof(int), DPU_XFER_DEFAULT));
+    timer_bytes((uint64_t)pivot_id * sizeof(int));
+    timer_end();
 
-        uint64_t size = joined_row[dpu_id] * (col_num1 + col_num2 - 1) * sizeof(T);
+    for (int d = 0; d < pivot_id; d++)
+    {
+        if (joined_row[d] != expected_row[d])
+        {
+            fprintf(stderr, "Join DPU %d returned %d rows, expected %d\n", d, joined_row[d], expected_row[d]);
+            exit(EXIT_FAILURE);
+        }
+        cur_idx += joined_row[d];
+    }
 
-        DPU_ASSERT(dpu_prepare_xfer(dpu3, result[dpu_id]));
-        DPU_ASSERT(dpu_push_xfer(set3, DPU_XFER_FROM_DPU, DPU_MRAM_HEAP_POINTER_NAME, first_size + second_size, size, DPU_XFER_DEFAULT));
+    // A top-K only brings back the k first rows of every DPU and keeps the k first of them
+    dpu_result_t topk_lists[pivot_id];
+    T *topk_result = (T *)malloc(topk_size + sizeof(T));
+    int topk_rows = 0;
+    if (topk.k > 0)
+    {
+        pull_topk(set3, &topk, out_col, topk_lists);
+        timer_begin("merge topk", TIMER_HOST);
+        topk_rows = merge_topk(&topk, topk_lists, pivot_id, out_col, topk_result);
+        timer_end();
+        for (int d = 0; d < pivot_id; d++)
+        {
+            free(topk_lists[d].arr);
+        }
+    }
 
-        cur_idx += joined_row[dpu_id];
+    // DPU d owns rows [d * max_expected_row, d * max_expected_row + joined_row[d]) of the host buffer
+    T *result = (T *)malloc(result_slab * pivot_id + sizeof(T));
+    if (result_slab > 0 && topk.k == 0)
+    {
+        timer_begin("pull rows", TIMER_DPU_CPU);
+        DPU_FOREACH(set3, dpu3, dpu_id)
+        {
+            DPU_ASSERT(dpu_prepare_xfer(dpu3, result + (uint64_t)dpu_id * max_expected_row * out_col));
+        }
+        DPU_ASSERT(dpu_push_xfer(set3, DPU_XFER_FROM_DPU, DPU_MRAM_HEAP_POINTER_NAME, result_offset, result_slab, DPU_XFER_DEFAULT));
+        timer_bytes(result_slab * pivot_id);
+        timer_end();
     }
-    stop(&timer, 2);
 
-    cpu_dpu_time += (timer.time[3] / 1000);
-    dpu_time += (timer.time[1] / 1000);
-    dpu_cpu_time += (timer.time[2] / 1000);
+    // A global aggregation only brings back one partial row per DPU, combined here
+    T agg_partials[pivot_id][MAX_AGG_FUNCS];
+    T agg_total[MAX_AGG_FUNCS];
+    int agg_rows = 0;
+    if (agg.func_num > 0 && !agg.group_by_key)
+    {
+        timer_begin("pull agg", TIMER_DPU_CPU);
+        DPU_FOREACH(set3, dpu3, dpu_id)
+        {
+            DPU_ASSERT(dpu_prepare_xfer(dpu3, agg_partials[dpu_id]));
+        }
+        DPU_ASSERT(dpu_push_xfer(set3, DPU_XFER_FROM_DPU, "agg_result", 0, sizeof(agg_partials[0]), DPU_XFER_DEFAULT));
+        timer_bytes(sizeof(agg_partials));
+        timer_end();
+
+        for (int d = 0; d < pivot_id; d++)
+        {
+            if (joined_row[d] == 0)
+                continue;
+
+            for (int f = 0; f < agg.func_num; f++)
+                agg_total[f] = agg_rows == 0 ? agg_partials[d][f] : agg_fold(agg.funcs[f], agg_total[f], agg_partials[d][f]);
+            agg_rows++;
+        }
+    }
 
 #ifdef DEBUG
     printf("==================\n");
     printf("#     join.c     #\n");
     printf("==================\n");
 
-    printf("Rows: %u\n", cur_idx);
+    printf("Rows: %lu\n", (unsigned long)cur_idx);
     printf("COL NUM 1: %d / COL NUM 2: %d\n", col_num1, col_num2);
 
     for (int d = 0; d < pivot_id; d++)
@@ -704,9 +1057,9 @@ int main(int argc, char *argv[])
         printf("DPU %d results: %d rows\n", dpu_result[d].dpu_id, joined_row[d]);
         // for (int i = 0; i < joined_row[d]; i++)
         // {
-        //     for (int j = 0; j < col_num1 + col_num2 - 1; j++)
+        //     for (int j = 0; j < total_col; j++)
         //     {
-        //         printf("%ld ", result[d][i * (col_num1 + col_num2 - 1) + j]);
+        //         printf("%ld ", result[((uint64_t)d * max_expected_row + i) * out_col + j]);
         //     }
         //     printf("\n");
         // }
@@ -717,6 +1070,7 @@ int main(int argc, char *argv[])
 #endif
 
     // save result as csv file
+    timer_begin("write result", TIMER_HOST);
     FILE *file = fopen("./data/result.csv", "w");
     if (!file)
     {
@@ -724,52 +1078,101 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    int total_col = col_num1 + col_num2 - 1;
+    if (agg.func_num > 0)
+    {
+        write_agg_header(file, &agg, key_cols[0], key_num[0]);
+    }
+    else
+    {
+        for (int i = 1; i <= user_col; i++)
+        {
+            fprintf(file, "col%d", i);
+            if (i < user_col)
+            {
+                fprintf(file, ",");
+            }
+        }
+        fprintf(file, "\n");
+    }
 
-    for (int i = 1; i <= total_col; i++)
+    // The result columns holding codes: the key and the minimum or maximum of a string column
+    // in an aggregation, the columns of both tables in a joined row
+    bool agg_is_str[MAX_AGG_FUNCS];
+    for (int f = 0; f < agg.func_num; f++)
     {
-        fprintf(file, "col%d", i);
-        if (i < total_col)
+        agg_is_str[f] = (agg.funcs[f] == AGG_MIN || agg.funcs[f] == AGG_MAX) && user_str[agg.cols[f]];
+    }
+
+    result_format_t format = {&codec, &dict, agg.group_by_key ? 0 : join_key[0], agg.group_by_key != 0, NULL, {false}};
+    bool out_str[out_col];
+    for (int j = 0; j < out_col; j++)
+    {
+        if (agg.group_by_key)
+            out_str[j] = j == 0 ? str_cols1[key_cols[0][0]] : agg_is_str[j - 1];
+        else if (agg.func_num > 0)
+            out_str[j] = agg_is_str[j];
+        else
+            out_str[j] = composite_key && j >= join_key[0] ? j > join_key[0] && user_str[j - 1] : user_str[j];
+    }
+    for (int c = 0; c < key_num[0]; c++)
+    {
+        format.key_str[c] = str_cols1[key_cols[0][c]];
+    }
+    format.str_cols = out_str;
+
+    // A global aggregation over no rows counts 0 and has no minimum or maximum
+    if (agg.func_num > 0 && !agg.group_by_key)
+    {
+        for (int f = 0; f < agg.func_num; f++)
         {
-            fprintf(file, ",");
+            if (agg_rows > 0)
+                write_value(file, &dict, agg_is_str[f], agg_total[f]);
+            else if (agg.funcs[f] == AGG_COUNT || agg.funcs[f] == AGG_SUM)
+                fprintf(file, "0");
+            fprintf(file, f < agg.func_num - 1 ? "," : "\n");
         }
     }
-    fprintf(file, "\n");
 
-    for (int d = 0; d < pivot_id; d++)
+    for (int i = 0; i < topk_rows; i++)
     {
+        write_result_row(file, topk_result + i * out_col, out_col, &format);
+    }
+
+    for (int d = 0; d < pivot_id && result_slab > 0 && topk.k == 0; d++)
+    {
+        T *slab = result + (uint64_t)d * max_expected_row * out_col;
         for (int i = 0; i < joined_row[d]; i++)
         {
-            for (int j = 0; j < total_col; j++)
-            {
-                fprintf(file, "%ld", result[d][i * (col_num1 + col_num2 - 1) + j]);
-                if (j < total_col - 1)
-                {
-                    fprintf(file, ",");
-                }
-            }
-            fprintf(file, "\n");
+            write_result_row(file, slab + (uint64_t)i * out_col, out_col, &format);
         }
     }
 
     fclose(file);
+    timer_end();
 
-    for (int d = 0; d < pivot_id; d++)
-    {
-        free(result[d]);
-    }
-    DPU_ASSERT(dpu_free(set3));
+    free(result);
+    free(topk_result);
+    free(codec.dict);
+    dict_free(&dict);
+    free_dpus(set3);
+    timer_end();
 
     printf("\n");
     printf("######### PIM #########\n");
     printf("### SORT-MERGE-JOIN ###\n");
     printf("         EXEC TIME     \n");
-    printf("CPU-DPU  %f\n", cpu_dpu_time);
-    printf("DPU      %f\n", dpu_time);
-    printf("DPU-CPU  %f\n", dpu_cpu_time);
+    printf("CPU-DPU  %f\n", timer_class_total(TIMER_CPU_DPU));
+    printf("DPU      %f\n", timer_class_total(TIMER_DPU));
+    printf("DPU-CPU  %f\n", timer_class_total(TIMER_DPU_CPU));
     printf("-----------------------\n");
-    printf("TOTAL %f\n", cpu_dpu_time + dpu_time + dpu_cpu_time);
+    printf("TOTAL %f\n", timer_class_total(TIMER_CPU_DPU) + timer_class_total(TIMER_DPU) + timer_class_total(TIMER_DPU_CPU));
     printf("#######################\n\n");
 
+    stats_print();
+    timer_print();
+
+    if (trace_file != NULL)
+        trace_write(trace_file);
+
     return 0;
 }
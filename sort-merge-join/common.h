@@ -2,21 +2,252 @@
 
 #ifdef UINT64
 #define T uint64_t
+#define T_SIGNED 0
 #elif defined(INT64)
 #define T int64_t
+#define T_SIGNED 1
 #elif defined(DOUBLE)
 #define T double
+#define T_SIGNED 1
 #endif
 
-#define CACHE_SIZE 256
+#define CACHE_SIZE 1024
+#define MRAM_SIZE (64 * 1024 * 1024)
+
+// Largest MRAM transfer of one DMA, the kernels move every row whole so a row is at most this size
+#define MAX_DMA_SIZE 2048
+
+// Rows summarized by one zone map entry, a zone entry is col_num minimums followed by col_num maximums
+#define ZONE_ROWS 256
+
+#define BLOOM_MAX_WORDS (1 << 20)
+#define BLOOM_MIN_WORDS 64
+#define BLOOM_BITS_PER_KEY 10
+
+#define MAX_PRED_TERMS 8
+#define MAX_PRED_VALS 32
+
+#define MAX_AGG_FUNCS 8
+
+#define MAX_TOPK 32
+
+// Sorted blocks merged by one merge_dpu launch, sorted runs of a table the join merges itself,
+// and the WRAM bytes a tasklet splits among their tiles, at least one row each
+#define MAX_MERGE_WAYS 8
+#define MAX_JOIN_RUNS 16
+#define MERGE_TILE_SIZE CACHE_SIZE
+#define RUN_TILE_SIZE (CACHE_SIZE / 2)
+
+// WRAM heap bytes of one tasklet, what the stacks and the globals leave of the WRAM split among the tasklets
+// The kernels cut their tiles down toward one row to fit in it, the host rejects rows that do not fit even then
+#define TASKLET_HEAP_SIZE (40 * 1024 / NR_TASKLETS)
+
+// Bytes of the cache of the SDK sequential reader, the forward scans read rows up to this size through it
+#define SEQREAD_CACHE_SIZE 256
+
+// WRAM buffers of the sort kernel: the group rows and the sparse index keys on their way to MRAM
+// and the tile the key words are sorted in
+#define GROUP_SIZE 256
+#define INDEX_SIZE 256
+#define WORD_TILE_SIZE 256
+
+// Rows between two keys of the sparse index that follows a sorted block in MRAM
+#define INDEX_STRIDE 64
+
+// Role of a DPU in the semi-join reduction of a select launch
+typedef enum
+{
+    BLOOM_NONE,
+    BLOOM_BUILD,
+    BLOOM_PROBE,
+    BLOOM_SKIP
+} bloom_mode_t;
+
+// Blocked Bloom filter over the join key, all bits of a key fall in one 64-bit word
+// The filter sits at byte filter_offset of the MRAM heap, past the select area of every DPU
+typedef struct
+{
+    int mode;
+    int key_col;
+    uint32_t filter_offset;
+    uint32_t word_num;
+    uint32_t word_bits;
+    uint32_t hash_num;
+    uint32_t dropped;
+} bloom_args_t;
+
+// Comparison operators of a predicate term
+typedef enum
+{
+    OP_EQ,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_BETWEEN,
+    OP_IN
+} pred_op_t;
+
+// One comparison on a column
+// BETWEEN uses [lo, hi] and IN uses vals[val_start, val_start + val_num)
+typedef struct
+{
+    int col;
+    int op;
+    int clause;
+    int val_start;
+    int val_num;
+    T lo;
+    T hi;
+} pred_term_t;
+
+// Predicate in conjunctive normal form
+// Terms of the same clause are ORed and clauses are ANDed, terms are ordered by clause
+typedef struct
+{
+    int term_num;
+    int clause_num;
+    pred_term_t terms[MAX_PRED_TERMS];
+    T vals[MAX_PRED_VALS];
+} predicate_t;
+
+// Aggregate functions over the joined rows
+typedef enum
+{
+    AGG_COUNT,
+    AGG_SUM,
+    AGG_MIN,
+    AGG_MAX
+} agg_func_t;
+
+// Aggregation pushed down into the join, func_num == 0 keeps the joined rows
+// cols are columns of the joined row, group_by_key keeps one result row per join key
+// The group-by pipeline uses the same spec over the columns of its table, grouped by key_col
+typedef struct
+{
+    int func_num;
+    int group_by_key;
+    int funcs[MAX_AGG_FUNCS];
+    int cols[MAX_AGG_FUNCS];
+} agg_args_t;
+
+// ORDER BY col LIMIT k, k == 0 keeps every row
+// A kernel writes its row_num first rows in order at byte out_offset of the MRAM heap
+typedef struct
+{
+    int k;
+    int col;
+    int desc;
+    int row_num;
+    uint32_t out_offset;
+} topk_args_t;
+
+// Number of keys in the sparse index of a block of row_num rows
+int index_num(int row_num)
+{
+    return (row_num + INDEX_STRIDE - 1) / INDEX_STRIDE;
+}
+
+// Folds a partial aggregate into an accumulator, a count folds like a sum
+T agg_fold(int func, T acc, T val)
+{
+    switch (func)
+    {
+    case AGG_MIN:
+        return val < acc ? val : acc;
+    case AGG_MAX:
+        return val > acc ? val : acc;
+    default:
+        return acc + val;
+    }
+}
+
+// WRAM bytes a tasklet of each kernel needs once every tile is down to one row
+
+// A forward scan reads rows through the sequential reader cache, or through one row and its key when wider
+int scan_wram_size(int col_num)
+{
+    int row_size = col_num * sizeof(T);
+    return row_size <= SEQREAD_CACHE_SIZE ? 2 * SEQREAD_CACHE_SIZE : row_size + sizeof(T);
+}
+
+// The input scan and the staging buffer, the minimums and the maximums of a zone and the filter word
+int select_wram_size(int col_num)
+{
+    return scan_wram_size(col_num) + (3 * col_num + 1) * sizeof(T);
+}
+
+// The four rows the tasklets merge through, the key word tile and the index buffer,
+// and with a grouped agg the scan of the sorted rows, the group buffer and the group row
+int sort_wram_size(int col_num, const agg_args_t *agg)
+{
+    int size = 4 * col_num * sizeof(T) + WORD_TILE_SIZE + INDEX_SIZE;
+    if (agg->group_by_key)
+        size += scan_wram_size(col_num) + GROUP_SIZE + (1 + agg->func_num) * sizeof(T);
+    return size;
+}
+
+// The tile of every way, the output buffer and the group row, then the tile keys and the merge state,
+// which take at most five words per way
+int merge_wram_size(int col_num, int way_num)
+{
+    return (way_num + 2) * col_num * sizeof(T) + 5 * MAX_MERGE_WAYS * sizeof(T);
+}
+
+// A window over each table and its key, the output buffer and the aggregates of a key run
+int join_wram_size(int col_num1, int col_num2, int out_col)
+{
+    return (col_num1 + col_num2 + out_col + 2 + MAX_AGG_FUNCS) * sizeof(T);
+}
+
+// Storage layout of the columns of a table, the kernels still compute on T
+// Column c of a packed row takes width[c] bytes (1, 2, 4 or 8) at byte offset[c], wider columns first
+// so every column is aligned, and the row is padded to 8 bytes so that every row starts on a DMA boundary.
+// row_size == col_num * sizeof(T) is the plain layout of T rows.
+#define MAX_SCHEMA_COLS 16
 
+typedef struct
+{
+    int col_num;
+    int row_size;
+    uint8_t width[MAX_SCHEMA_COLS];
+    uint8_t offset[MAX_SCHEMA_COLS];
+} schema_t;
+
+// Returns 1 when the rows are stored narrower than T rows
+int schema_packed(const schema_t *schema)
+{
+    return schema->row_size < schema->col_num * (int)sizeof(T);
+}
+
+// Phases a kernel charges its cycles to, per tasklet
+typedef enum
+{
+    PHASE_LOAD,
+    PHASE_COMPUTE,
+    PHASE_BARRIER,
+    PHASE_WRITE,
+    PHASE_NUM
+} phase_t;
+
+// Rows of one table held by a DPU, sorted on key_col by the sort and merge kernels
 typedef struct
 {
     int table_num;
+    int key_col;
     int col_num;
     int row_num;
 } dpu_block_t;
 
+// Join key range of a block, set by the host before the sort
+// When narrow is set every key minus base fits in 32 bits, and the sort kernel orders single
+// (key - base) << 32 | row words instead of moving whole rows on every comparison
+typedef struct
+{
+    T base;
+    int narrow;
+} key_range_t;
+
 typedef struct
 {
     int table_num;
@@ -24,6 +255,8 @@ typedef struct
     int col_num;
     int row_num;
     T *arr;
+    // Keys of rows 0, INDEX_STRIDE, 2 * INDEX_STRIDE, ... stored in arr after the rows, NULL without an index
+    T *index;
 } dpu_result_t;
 
 typedef struct
@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200809L
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,6 +6,8 @@
 #include "timer.h"
 #include "common.h"
 #include "user.h"
+#include "predicate.h"
+#include "aggregate.h"
 
 #define STACK_SIZE 250
 
@@ -78,14 +81,14 @@ void load_csv(const char *filename, int col_num, int row_num, T **test_array)
     fclose(file);
 }
 
-void select_in_cpu(int col_num, int *row_num, T **test_array, T select_col, T select_val)
+void select_in_cpu(int col_num, int *row_num, T **test_array, const predicate_t *pred)
 {
     int cnt = 0;
     T *original_array = *test_array;
 
     for (int i = 0; i < *row_num; i++)
     {
-        if (original_array[i * col_num + select_col] > select_val)
+        if (match_predicate(pred, original_array + i * col_num))
         {
             cnt++;
         }
@@ -95,7 +98,7 @@ void select_in_cpu(int col_num, int *row_num, T **test_array, T select_col, T se
 
     for (int i = 0, j = 0; i < *row_num; i++)
     {
-        if (original_array[i * col_num + select_col] > select_val)
+        if (match_predicate(pred, original_array + i * col_num))
         {
             for (int k = 0; k < col_num; k++)
             {
@@ -204,65 +207,75 @@ void insertion_sort_in_cpu(int col_num, int row_num, int key, T **test_array)
 void join_in_cpu(int col_num_1, int row_num_1, T *test_array_1, int col_num_2, int row_num_2, T *test_array_2, int key1, int key2)
 {
     int total_col = col_num_1 + col_num_2 - 1;
-    int cnt = 0;
     int cur_index1 = 0;
     int cur_index2 = 0;
 
+    // Duplicate keys make the result size unknown up front, the buffer grows as runs are emitted
+    int max_rows = row_num_1 < row_num_2 ? row_num_1 : row_num_2;
+    if (max_rows == 0)
+        max_rows = 1;
+    result = (T *)malloc(max_rows * total_col * sizeof(T));
+    result_col_num = total_col;
+
+    int result_index = 0;
     while (cur_index1 < row_num_1 && cur_index2 < row_num_2)
     {
-        if (test_array_1[cur_index1 * col_num_1 + key1] == test_array_2[cur_index2 * col_num_2 + key2])
-        {
-            cnt++;
-            cur_index1++;
-            cur_index2++;
-        }
-        else if (test_array_1[cur_index1 * col_num_1 + key1] < test_array_2[cur_index2 * col_num_2 + key2])
+        T val1 = test_array_1[cur_index1 * col_num_1 + key1];
+        T val2 = test_array_2[cur_index2 * col_num_2 + key2];
+
+        if (val1 < val2)
         {
             cur_index1++;
         }
-        else
+        else if (val1 > val2)
         {
             cur_index2++;
         }
-    }
-
-    result = (T *)malloc(cnt * total_col * sizeof(T));
-    result_row_num = cnt;
-    result_col_num = total_col;
-
-    cur_index1 = 0;
-    cur_index2 = 0;
-    int result_index = 0;
-    while (cur_index1 < row_num_1 && cur_index2 < row_num_2)
-    {
-        if (test_array_1[cur_index1 * col_num_1 + key1] == test_array_2[cur_index2 * col_num_2 + key2])
+        else
         {
-            for (int i = 0; i < col_num_1; i++)
+            // Find the equal-key run on both sides and emit their cross product
+            int end1 = cur_index1 + 1;
+            while (end1 < row_num_1 && test_array_1[end1 * col_num_1 + key1] == val1)
+                end1++;
+            int end2 = cur_index2 + 1;
+            while (end2 < row_num_2 && test_array_2[end2 * col_num_2 + key2] == val2)
+                end2++;
+
+            int run_rows = (end1 - cur_index1) * (end2 - cur_index2);
+            if (result_index + run_rows > max_rows)
             {
-                result[result_index * total_col + i] = test_array_1[cur_index1 * col_num_1 + i];
+                while (result_index + run_rows > max_rows)
+                    max_rows *= 2;
+                result = (T *)realloc(result, max_rows * total_col * sizeof(T));
             }
-            for (int i = 0, j = 0; i < col_num_2; i++)
+
+            for (int r1 = cur_index1; r1 < end1; r1++)
             {
-                if (i != key2)
+                for (int r2 = cur_index2; r2 < end2; r2++)
                 {
-                    result[result_index * total_col + col_num_1 + j] = test_array_2[cur_index2 * col_num_2 + i];
-                    j++;
+                    for (int i = 0; i < col_num_1; i++)
+                    {
+                        result[result_index * total_col + i] = test_array_1[r1 * col_num_1 + i];
+                    }
+                    for (int i = 0, j = 0; i < col_num_2; i++)
+                    {
+                        if (i != key2)
+                        {
+                            result[result_index * total_col + col_num_1 + j] = test_array_2[r2 * col_num_2 + i];
+                            j++;
+                        }
+                    }
+
+                    result_index++;
                 }
             }
 
-            result_index++;
-            cur_index1++;
-            cur_index2++;
-        }
-        else if (test_array_1[cur_index1 * col_num_1 + key1] < test_array_2[cur_index2 * col_num_2 + key2])
-        {
-            cur_index1++;
-        }
-        else
-        {
-            cur_index2++;
+            cur_index1 = end1;
+            cur_index2 = end2;
         }
     }
+
+    result_row_num = result_index;
 }
 
 void save_to_csv(const char *filename, int col_num, int row_num, T *test_array)
@@ -303,12 +316,14 @@ void save_to_csv(const char *filename, int col_num, int row_num, T *test_array)
 int main(int argc, char *argv[])
 {
     // Get file name
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <table1.csv> <table2.csv> [--where1 <predicate>] [--where2 <predicate>] [--agg <functions> [--group]]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
     const char *FILE_NAME_1 = argv[1];
     const char *FILE_NAME_2 = argv[2];
 
-    // Set timer
-    Timer timer;
-
     // Set variables
     int col_num_1 = 0;
     int row_num_1 = 0;
@@ -321,30 +336,91 @@ int main(int argc, char *argv[])
     T *test_array_2 = NULL;
 
     // Set col_num, row_num
+    timer_begin("csv size", TIMER_HOST);
     set_csv_size(FILE_NAME_1, &col_num_1, &row_num_1);
     set_csv_size(FILE_NAME_2, &col_num_2, &row_num_2);
+    timer_end();
     int row_size = (row_num_1 + row_num_2) / NR_DPUS;
 
-    // Start timer
-    start(&timer, 0, 0);
+    // Set predicates, SELECT_COL/SELECT_VAL in user.h are the defaults
+    predicate_t pred[2];
+    set_default_predicate(&pred[0], SELECT_COL1, SELECT_VAL1);
+    set_default_predicate(&pred[1], SELECT_COL2, SELECT_VAL2);
+
+    // Aggregation over the joined rows, none by default
+    agg_args_t agg = {0};
+
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--where1") == 0 && i + 1 < argc)
+        {
+            if (parse_predicate(argv[++i], col_num_1, &pred[0]) != 0)
+                exit(EXIT_FAILURE);
+        }
+        else if (strcmp(argv[i], "--where2") == 0 && i + 1 < argc)
+        {
+            if (parse_predicate(argv[++i], col_num_2, &pred[1]) != 0)
+                exit(EXIT_FAILURE);
+        }
+        else if (strcmp(argv[i], "--agg") == 0 && i + 1 < argc)
+        {
+            if (parse_aggregate(argv[++i], col_num_1 + col_num_2 - 1, &agg) != 0)
+                exit(EXIT_FAILURE);
+        }
+        else if (strcmp(argv[i], "--group") == 0)
+        {
+            agg.group_by_key = 1;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (agg.group_by_key && agg.func_num == 0)
+    {
+        fprintf(stderr, "--group needs --agg\n");
+        exit(EXIT_FAILURE);
+    }
 
     // Set test_array
+    // The scopes carry the names of the PIM stages so both breakdowns line up
+    timer_begin("load csv", TIMER_HOST);
     load_csv(FILE_NAME_1, col_num_1, row_num_1, &test_array_1);
     load_csv(FILE_NAME_2, col_num_2, row_num_2, &test_array_2);
+    timer_end();
 
     // select
-    select_in_cpu(col_num_1, &row_num_1, &test_array_1, SELECT_COL1, SELECT_VAL1);
-    select_in_cpu(col_num_2, &row_num_2, &test_array_2, SELECT_COL2, SELECT_VAL2);
+    timer_begin("select", TIMER_STAGE);
+    select_in_cpu(col_num_1, &row_num_1, &test_array_1, &pred[0]);
+    select_in_cpu(col_num_2, &row_num_2, &test_array_2, &pred[1]);
+    timer_end();
 
     // sort
+    timer_begin("sort", TIMER_STAGE);
     insertion_sort_in_cpu(col_num_1, row_num_1, JOIN_KEY1, &test_array_1);
     insertion_sort_in_cpu(col_num_2, row_num_2, JOIN_KEY2, &test_array_2);
+    timer_end();
 
     // join
+    timer_begin("join", TIMER_STAGE);
     join_in_cpu(col_num_1, row_num_1, test_array_1, col_num_2, row_num_2, test_array_2, JOIN_KEY1, JOIN_KEY2);
+    timer_end();
 
-    // Stop timer
-    stop(&timer, 0);
+    // aggregate
+    if (agg.func_num > 0)
+    {
+        timer_begin("aggregate", TIMER_STAGE);
+        int agg_col = (agg.group_by_key ? 1 : 0) + agg.func_num;
+        T *agg_result = (T *)malloc(((agg.group_by_key ? result_row_num : 0) + 1) * agg_col * sizeof(T));
+
+        result_row_num = aggregate_rows(&agg, result, result_row_num, result_col_num, JOIN_KEY1, agg_result);
+        result_col_num = agg_col;
+        free(result);
+        result = agg_result;
+        timer_end();
+    }
 
     // Save to csv
     // save_to_csv("result.csv", result_col_num, result_row_num, result);
@@ -353,9 +429,10 @@ int main(int argc, char *argv[])
     printf("######### CPU #########\n");
     printf("### SORT-MERGE-JOIN ###\n");
     printf("       EXEC TIME       \n");
-    print(&timer, 0, 1);
-    printf("\n");
-    printf("#######################\n");
+    printf("TOTAL %f\n", timer_total());
+    printf("#######################\n\n");
+
+    timer_print();
 
     return 0;
 }
@@ -0,0 +1,139 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Host-side dictionary encoding of string columns
+ *
+ * load_csv turns every column holding a non-integer token into a string column and replaces its
+ * values by dense integer codes from one dictionary shared by all the tables of a query,
+ * so equal strings of two tables join on equal codes and the kernels never see a string.
+ * Once every table is loaded, dict_sort renumbers the codes in string order, so sorting,
+ * ORDER BY and min/max on codes follow the strings. The output writers decode the codes.
+ */
+
+typedef struct
+{
+    // String of every code
+    char **strs;
+    int str_num;
+    int str_cap;
+    // Open addressing hash table of code + 1, 0 is an empty slot
+    int *slots;
+    int slot_num;
+} dict_t;
+
+uint32_t dict_hash(const char *str)
+{
+    uint32_t h = 2166136261u;
+    for (; *str; str++)
+        h = (h ^ (uint8_t)*str) * 16777619u;
+
+    return h;
+}
+
+// Rebuilds the hash table with slot_num slots
+void dict_rehash(dict_t *dict, int slot_num)
+{
+    free(dict->slots);
+    dict->slot_num = slot_num;
+    dict->slots = (int *)calloc(slot_num, sizeof(int));
+
+    for (int code = 0; code < dict->str_num; code++)
+    {
+        uint32_t s = dict_hash(dict->strs[code]) & (slot_num - 1);
+        while (dict->slots[s] != 0)
+            s = (s + 1) & (slot_num - 1);
+        dict->slots[s] = code + 1;
+    }
+}
+
+// Returns the code of a string, a new string gets the next code
+int dict_code(dict_t *dict, const char *str)
+{
+    if (dict->slot_num == 0)
+        dict_rehash(dict, 1024);
+
+    uint32_t s = dict_hash(str) & (dict->slot_num - 1);
+    for (; dict->slots[s] != 0; s = (s + 1) & (dict->slot_num - 1))
+    {
+        if (strcmp(dict->strs[dict->slots[s] - 1], str) == 0)
+            return dict->slots[s] - 1;
+    }
+
+    if (dict->str_num == dict->str_cap)
+    {
+        dict->str_cap = dict->str_cap == 0 ? 1024 : dict->str_cap * 2;
+        dict->strs = (char **)realloc(dict->strs, dict->str_cap * sizeof(char *));
+    }
+
+    int code = dict->str_num++;
+    dict->strs[code] = (char *)malloc(strlen(str) + 1);
+    strcpy(dict->strs[code], str);
+    dict->slots[s] = code + 1;
+
+    // Keep the table at most half full
+    if (2 * dict->str_num > dict->slot_num)
+        dict_rehash(dict, 2 * dict->slot_num);
+
+    return code;
+}
+
+int dict_str_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Renumbers the codes in string order and returns the new code of every old code, the caller frees it
+int *dict_sort(dict_t *dict)
+{
+    char **old_strs = (char **)malloc(dict->str_num * sizeof(char *) + sizeof(char *));
+    memcpy(old_strs, dict->strs, dict->str_num * sizeof(char *));
+    qsort(dict->strs, dict->str_num, sizeof(char *), dict_str_cmp);
+    dict_rehash(dict, dict->slot_num > 0 ? dict->slot_num : 1024);
+
+    int *remap = (int *)malloc(dict->str_num * sizeof(int) + sizeof(int));
+    for (int code = 0; code < dict->str_num; code++)
+    {
+        remap[code] = dict_code(dict, old_strs[code]);
+    }
+    free(old_strs);
+
+    return remap;
+}
+
+// Rewrites the codes of the string columns of row_num rows with remap
+void dict_remap(const int *remap, T *rows, uint64_t row_num, int col_num, const bool *str_cols)
+{
+    for (int c = 0; c < col_num; c++)
+    {
+        if (!str_cols[c])
+            continue;
+
+        for (uint64_t r = 0; r < row_num; r++)
+        {
+            rows[r * col_num + c] = remap[(int64_t)rows[r * col_num + c]];
+        }
+    }
+}
+
+void dict_free(dict_t *dict)
+{
+    for (int code = 0; code < dict->str_num; code++)
+    {
+        free(dict->strs[code]);
+    }
+    free(dict->strs);
+    free(dict->slots);
+}
+
+// Writes a value, or the string of its code
+void write_value(FILE *file, const dict_t *dict, bool is_str, T val)
+{
+    if (is_str)
+        fprintf(file, "%s", dict->strs[(int64_t)val]);
+    else
+        fprintf(file, "%ld", val);
+}
@@ -0,0 +1,344 @@
+#include <stdint.h>
+#include <string.h>
+#include <mram.h>
+#include <alloc.h>
+#include <seqread.h>
+#include "dpu_stats.h"
+
+/*
+ * DPU-side MRAM access helpers shared by the kernels
+ *
+ * row_reader_t  : forward row cursor on top of the SDK sequential reader
+ * row_writer_t  : output rows gathered in WRAM and written with one DMA per tile
+ * block_cache_t : WRAM tile over a sorted table for binary search and galloping probes,
+ *                 or over packed rows that it widens to T rows as they are loaded
+ * schema_widen  : rows packed with a schema_t widened to T rows in place
+ * index_write   : sparse key index written after a sorted block for the host searches
+ *
+ * Tile loads of the block cache and writer flushes are charged to PHASE_LOAD and PHASE_WRITE.
+ *
+ * Tile sizes are chosen per kernel: the reader caches twice SEQREAD_CACHE_SIZE (set in common.h) and reads
+ * wider rows one DMA each, the writer and the cache take their size in bytes, at least one row and at most
+ * MAX_DMA_SIZE. tile_fit cuts a tile down to what the WRAM heap of the tasklet leaves past the one row it needs.
+ */
+
+// Forward row cursor, buf holds the row when rows are wider than the sequential reader cache
+typedef struct
+{
+    seqreader_t sr;
+    uint32_t addr;
+    T *row;
+    T *buf;
+    int row_size;
+} row_reader_t;
+
+// Buffered row writer
+typedef struct
+{
+    uint32_t addr;
+    int row_size;
+    int cap_rows;
+    int rows;
+    T *buf;
+} row_writer_t;
+
+// WRAM tile over consecutive rows of a table in MRAM
+typedef struct
+{
+    uint32_t base_addr;
+    int col_num;
+    int row_num;
+    int cap_rows;
+    int start;
+    int rows;
+    T *buf;
+    T *key_buf;
+    const schema_t *schema;
+} block_cache_t;
+
+// Bytes of a tile of size bytes over rows of row_size bytes, cut down to one row and spare bytes
+// spare is what the tasklet heap leaves once every tile of the kernel holds one row
+int tile_fit(int size, int row_size, int spare)
+{
+    spare &= ~7;
+    if (size > row_size + spare)
+        size = row_size + spare;
+    return size < row_size ? row_size : size;
+}
+
+/* ****************** */
+/*     Row reader     */
+/* ****************** */
+
+// Moves the reader to the row at addr and returns it
+T *reader_seek(row_reader_t *r, uint32_t addr)
+{
+    if (r->buf == NULL)
+    {
+        r->row = (T *)seqread_seek((__mram_ptr void *)addr, &r->sr);
+        return r->row;
+    }
+
+    r->addr = addr;
+    mram_read((__mram_ptr void const *)addr, r->buf, r->row_size);
+    return r->row;
+}
+
+// Positions the reader on the row at addr and returns it
+T *reader_init(row_reader_t *r, uint32_t addr, int col_num)
+{
+    r->row_size = col_num * sizeof(T);
+    if (r->row_size > SEQREAD_CACHE_SIZE)
+    {
+        r->buf = (T *)mem_alloc(r->row_size);
+        r->row = r->buf;
+        return reader_seek(r, addr);
+    }
+
+    r->buf = NULL;
+    r->row = (T *)seqread_init(seqread_alloc(), (__mram_ptr void *)addr, &r->sr);
+    return r->row;
+}
+
+// Moves to the next row and returns it
+T *reader_next(row_reader_t *r)
+{
+    if (r->buf != NULL)
+        return reader_seek(r, r->addr + r->row_size);
+
+    r->row = (T *)seqread_get(r->row, r->row_size, &r->sr);
+    return r->row;
+}
+
+/* ****************** */
+/*     Row writer     */
+/* ****************** */
+
+// Points the writer at addr for rows of col_num columns, the buffer holds size bytes
+void writer_attach(row_writer_t *w, uint32_t addr, int col_num, int size)
+{
+    w->addr = addr;
+    w->row_size = col_num * sizeof(T);
+    w->cap_rows = size / w->row_size;
+    w->rows = 0;
+}
+
+void writer_init(row_writer_t *w, uint32_t addr, int col_num, int size)
+{
+    writer_attach(w, addr, col_num, size);
+    w->buf = (T *)mem_alloc(size);
+}
+
+// Returns the buffer of the next row
+T *writer_slot(row_writer_t *w)
+{
+    return w->buf + w->rows * (w->row_size / sizeof(T));
+}
+
+// Commits the slot, returns 1 once the buffer is full and has to be flushed
+int writer_commit(row_writer_t *w)
+{
+    w->rows++;
+    return w->rows == w->cap_rows;
+}
+
+// Writes the buffered rows at the write address and moves the address past them
+void writer_flush(row_writer_t *w)
+{
+    if (w->rows > 0)
+    {
+        stats_begin(me());
+        mram_write(w->buf, (__mram_ptr void *)w->addr, w->rows * w->row_size);
+        stats_end(me(), PHASE_WRITE);
+    }
+
+    w->addr += w->rows * w->row_size;
+    w->rows = 0;
+}
+
+// Copies a row to the output
+void writer_append(row_writer_t *w, T *row)
+{
+    memcpy(writer_slot(w), row, w->row_size);
+    if (writer_commit(w))
+        writer_flush(w);
+}
+
+/* ******************* */
+/*     Packed rows     */
+/* ******************* */
+
+// Returns the column of width bytes at p as a T
+T packed_load(const uint8_t *p, int width)
+{
+    switch (width)
+    {
+    case 1:
+        return T_SIGNED ? (T)(*(const int8_t *)p) : (T)(*p);
+    case 2:
+        return T_SIGNED ? (T)(*(const int16_t *)p) : (T)(*(const uint16_t *)p);
+    case 4:
+        return T_SIGNED ? (T)(*(const int32_t *)p) : (T)(*(const uint32_t *)p);
+    default:
+        return *(const T *)p;
+    }
+}
+
+// Widens row_num rows packed at the front of buf into T rows in place
+// A packed row is never longer than a T row, so going from the last row to the first
+// only overwrites rows already widened, each row is read whole before it is written
+void schema_widen(const schema_t *schema, T *buf, int row_num)
+{
+    int col_num = schema->col_num;
+    T row[MAX_SCHEMA_COLS];
+
+    for (int r = row_num - 1; r >= 0; r--)
+    {
+        const uint8_t *packed = (const uint8_t *)buf + r * schema->row_size;
+        for (int c = 0; c < col_num; c++)
+        {
+            row[c] = packed_load(packed + schema->offset[c], schema->width[c]);
+        }
+        memcpy(buf + r * col_num, row, col_num * sizeof(T));
+    }
+}
+
+/* ******************* */
+/*     Block cache     */
+/* ******************* */
+
+// Points the cache at another table, the tile holds size bytes
+void cache_attach(block_cache_t *c, uint32_t base_addr, int col_num, int row_num, int size)
+{
+    c->base_addr = base_addr;
+    c->col_num = col_num;
+    c->row_num = row_num;
+    c->cap_rows = size / (col_num * sizeof(T));
+    c->start = 0;
+    c->rows = 0;
+    c->schema = NULL;
+}
+
+void cache_init(block_cache_t *c, uint32_t base_addr, int col_num, int row_num, int size)
+{
+    cache_attach(c, base_addr, col_num, row_num, size);
+    c->buf = (T *)mem_alloc(size);
+    c->key_buf = (T *)mem_alloc(sizeof(T));
+}
+
+// Loads the tile so that it starts at row idx
+void cache_fill(block_cache_t *c, int idx)
+{
+    c->start = idx;
+    c->rows = c->row_num - idx < c->cap_rows ? c->row_num - idx : c->cap_rows;
+    if (c->rows <= 0)
+        return;
+
+    stats_begin(me());
+    if (c->schema != NULL)
+    {
+        mram_read((__mram_ptr void *)(c->base_addr + idx * c->schema->row_size), c->buf, c->rows * c->schema->row_size);
+        schema_widen(c->schema, c->buf, c->rows);
+    }
+    else
+    {
+        mram_read((__mram_ptr void *)(c->base_addr + idx * c->col_num * sizeof(T)), c->buf, c->rows * c->col_num * sizeof(T));
+    }
+    stats_end(me(), PHASE_LOAD);
+}
+
+// Returns row idx, rows already in the tile are never read again
+T *cache_row(block_cache_t *c, int idx)
+{
+    if (idx < c->start || idx >= c->start + c->rows)
+        cache_fill(c, idx);
+
+    return c->buf + (idx - c->start) * c->col_num;
+}
+
+// Returns the key of row idx
+// Rows right after the tile are streamed in, a far probe reads the key alone unless the rows are packed
+T cache_key(block_cache_t *c, int idx, int key_col)
+{
+    if (idx >= c->start && idx < c->start + c->rows)
+        return c->buf[(idx - c->start) * c->col_num + key_col];
+
+    if (c->schema != NULL || (idx >= c->start + c->rows && idx < c->start + c->rows + c->cap_rows))
+    {
+        cache_fill(c, idx);
+        return c->buf[key_col];
+    }
+
+    mram_read((__mram_ptr void *)(c->base_addr + (idx * c->col_num + key_col) * sizeof(T)), c->key_buf, sizeof(T));
+    return *c->key_buf;
+}
+
+// Loads rows [lo, hi) with one DMA once a search has narrowed down to a single tile
+void cache_span(block_cache_t *c, int lo, int hi)
+{
+    if (lo < hi && hi - lo <= c->cap_rows && (lo < c->start || hi > c->start + c->rows))
+        cache_fill(c, lo);
+}
+
+// Galloping search for the first row in [lo, hi) whose key is greater than target (upper)
+// or not less than target (!upper)
+// Exponential steps bracket the answer, so skipping n rows costs O(log n) key reads
+int cache_gallop(block_cache_t *c, int key_col, int lo, int hi, T target, int upper)
+{
+    int left = lo;
+    int right = lo;
+    int step = 1;
+
+    while (right < hi)
+    {
+        T key = cache_key(c, right, key_col);
+        if (upper ? key > target : key >= target)
+            break;
+
+        left = right + 1;
+        right = lo + step;
+        step <<= 1;
+    }
+    if (right > hi)
+        right = hi;
+
+    cache_span(c, left, right);
+    while (left < right)
+    {
+        int mid = (left + right) / 2;
+        T key = cache_key(c, mid, key_col);
+        if (upper ? key > target : key >= target)
+            right = mid;
+        else
+            left = mid + 1;
+    }
+
+    return left;
+}
+
+/* ******************** */
+/*     Sparse index     */
+/* ******************** */
+
+// Writes the key of every INDEX_STRIDE-th row of a sorted block at index_addr
+// Each tasklet takes an even slice of the keys and gathers them in buf, size bytes, before each write
+void index_write(unsigned int tasklet_id, uint32_t rows_addr, int col_num, int key_col, int row_num, uint32_t index_addr, T *buf, int size)
+{
+    int key_num = index_num(row_num);
+    int per_tasklet = key_num / NR_TASKLETS;
+    int remain = key_num % NR_TASKLETS;
+    int start = tasklet_id * per_tasklet + (tasklet_id < remain ? tasklet_id : remain);
+    int end = start + per_tasklet + (tasklet_id < remain ? 1 : 0);
+    int cap = size / sizeof(T);
+
+    for (int k = start; k < end; k += cap)
+    {
+        int keys = end - k < cap ? end - k : cap;
+        for (int i = 0; i < keys; i++)
+        {
+            uint32_t key_addr = rows_addr + ((k + i) * INDEX_STRIDE * col_num + key_col) * sizeof(T);
+            mram_read((__mram_ptr void const *)key_addr, &buf[i], sizeof(T));
+        }
+        mram_write(buf, (__mram_ptr void *)(index_addr + k * sizeof(T)), keys * sizeof(T));
+    }
+}
@@ -0,0 +1,150 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * DPU-side k-way merge shared by the merge and join kernels
+ *
+ * The ways are sorted tables read through block_cache_t tiles. Rows are ordered by key, then by way,
+ * then by position, so every tasklet finds the same split of the output, and a tasklet merges its
+ * slice with a tournament (loser) tree over the head rows of the ways.
+ * A kernel sets MERGE_WAYS before including this file to merge more than MAX_MERGE_WAYS ways.
+ */
+
+#ifndef MERGE_WAYS
+#define MERGE_WAYS MAX_MERGE_WAYS
+#endif
+
+// Merge state of a tasklet: the next row, the slice end and the head key of every way,
+// tree[0] is the way holding the smallest head and tree[1..way_num) the losers of the tournament
+typedef struct
+{
+    int way_num;
+    int key_col;
+    int pos[MERGE_WAYS];
+    int end[MERGE_WAYS];
+    int below[MERGE_WAYS];
+    T head[MERGE_WAYS];
+    int tree[MERGE_WAYS];
+} merge_state_t;
+
+// Finds how many rows of every way are among the first k merged rows
+// Each step ranks the middle row of the widest open range of pos/end and halves that range.
+// Rows are counted inside the open ranges only, which puts the pivot on the same side as a full count
+void merge_split(merge_state_t *st, block_cache_t *ways, int k, int *split)
+{
+    int *lo = st->pos;
+    int *hi = st->end;
+    for (int w = 0; w < st->way_num; w++)
+    {
+        lo[w] = 0;
+        hi[w] = ways[w].row_num;
+    }
+
+    while (true)
+    {
+        int m = -1;
+        for (int w = 0; w < st->way_num; w++)
+        {
+            if (hi[w] > lo[w] && (m < 0 || hi[w] - lo[w] > hi[m] - lo[m]))
+                m = w;
+        }
+        if (m < 0)
+            break;
+
+        int mid = (lo[m] + hi[m]) / 2;
+        T pivot = cache_key(&ways[m], mid, st->key_col);
+
+        int rank = 0;
+        for (int w = 0; w < st->way_num; w++)
+        {
+            st->below[w] = w == m ? mid : cache_gallop(&ways[w], st->key_col, lo[w], hi[w], pivot, w < m);
+            rank += st->below[w];
+        }
+
+        for (int w = 0; w < st->way_num; w++)
+        {
+            if (rank < k)
+                lo[w] = st->below[w] + (w == m ? 1 : 0);
+            else
+                hi[w] = st->below[w];
+        }
+    }
+
+    for (int w = 0; w < st->way_num; w++)
+    {
+        split[w] = lo[w];
+    }
+}
+
+// Returns 1 when the head of way a comes before the head of way b, an exhausted way comes last
+int way_before(merge_state_t *st, int a, int b)
+{
+    int a_done = st->pos[a] == st->end[a];
+    int b_done = st->pos[b] == st->end[b];
+
+    if (a_done || b_done)
+        return a_done == b_done ? a < b : b_done;
+    if (st->head[a] != st->head[b])
+        return st->head[a] < st->head[b];
+    return a < b;
+}
+
+// Starts a slice at rows start[w] up to end[w] of every way and returns its row count
+// The tournament puts leaf w at node way_num + w, node n plays the winners of 2n and 2n + 1
+int merge_start(merge_state_t *st, block_cache_t *ways, const int *start, const int *end)
+{
+    int rows = 0;
+    for (int w = 0; w < st->way_num; w++)
+    {
+        st->pos[w] = start[w];
+        st->end[w] = end[w];
+        if (st->pos[w] < st->end[w])
+            st->head[w] = cache_key(&ways[w], st->pos[w], st->key_col);
+        rows += st->end[w] - st->pos[w];
+    }
+
+    int win[2 * MERGE_WAYS];
+    for (int w = 0; w < st->way_num; w++)
+    {
+        win[st->way_num + w] = w;
+    }
+
+    for (int n = st->way_num - 1; n >= 1; n--)
+    {
+        int a = win[2 * n];
+        int b = win[2 * n + 1];
+        win[n] = way_before(st, a, b) ? a : b;
+        st->tree[n] = win[n] == a ? b : a;
+    }
+    st->tree[0] = st->way_num > 1 ? win[1] : 0;
+
+    return rows;
+}
+
+// Returns the row of the slice that comes next, it stays valid until merge_pop
+T *merge_top(merge_state_t *st, block_cache_t *ways)
+{
+    int w = st->tree[0];
+    return cache_row(&ways[w], st->pos[w]);
+}
+
+// Moves past the row of merge_top and replays the matches on the path of its way
+// Moving may reload the tile of the way, the row must be consumed before
+void merge_pop(merge_state_t *st, block_cache_t *ways)
+{
+    int w = st->tree[0];
+    st->pos[w]++;
+    if (st->pos[w] < st->end[w])
+        st->head[w] = cache_key(&ways[w], st->pos[w], st->key_col);
+
+    for (int n = (st->way_num + w) / 2; n >= 1; n /= 2)
+    {
+        if (way_before(st, st->tree[n], w))
+        {
+            int loser = w;
+            w = st->tree[n];
+            st->tree[n] = loser;
+        }
+    }
+    st->tree[0] = w;
+}
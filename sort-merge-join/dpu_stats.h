@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <defs.h>
+#include <barrier.h>
+#include <perfcounter.h>
+
+/*
+ * DPU-side cycle counts of the phases of a launch, per tasklet
+ *
+ * stats_start begins the count of a tasklet and every cycle goes to PHASE_COMPUTE, except those
+ * between stats_begin and stats_end which go to the phase given to stats_end:
+ * the block cache loads (PHASE_LOAD), the row writer flushes and the final copies (PHASE_WRITE)
+ * and stats_barrier_wait (PHASE_BARRIER). stats_stop charges the cycles left before the kernel returns,
+ * stats_idle ends the count of a launch that leaves the DPU without work.
+ * The host reads phase_cycles after every launch.
+ * The counter is never reset, a reset by one tasklet would break the marks of the others.
+ */
+
+__host uint64_t phase_cycles[NR_TASKLETS][PHASE_NUM];
+perfcounter_t phase_mark[NR_TASKLETS];
+
+void stats_start(unsigned int tasklet_id)
+{
+    if (tasklet_id == 0)
+        perfcounter_config(COUNT_CYCLES, false);
+
+    for (int p = 0; p < PHASE_NUM; p++)
+    {
+        phase_cycles[tasklet_id][p] = 0;
+    }
+    phase_mark[tasklet_id] = perfcounter_get();
+}
+
+// Charges the cycles since the last mark to PHASE_COMPUTE
+void stats_begin(unsigned int tasklet_id)
+{
+    perfcounter_t now = perfcounter_get();
+    phase_cycles[tasklet_id][PHASE_COMPUTE] += now - phase_mark[tasklet_id];
+    phase_mark[tasklet_id] = now;
+}
+
+// Charges the cycles since stats_begin to phase
+void stats_end(unsigned int tasklet_id, int phase)
+{
+    perfcounter_t now = perfcounter_get();
+    phase_cycles[tasklet_id][phase] += now - phase_mark[tasklet_id];
+    phase_mark[tasklet_id] = now;
+}
+
+void stats_stop(unsigned int tasklet_id)
+{
+    stats_begin(tasklet_id);
+}
+
+// Clears the cycles of a tasklet that returns without work, the host leaves a DPU whose tasklets
+// report no cycles at all out of the stats
+void stats_idle(unsigned int tasklet_id)
+{
+    for (int p = 0; p < PHASE_NUM; p++)
+    {
+        phase_cycles[tasklet_id][p] = 0;
+    }
+}
+
+void stats_barrier_wait(unsigned int tasklet_id, barrier_t *barrier)
+{
+    stats_begin(tasklet_id);
+    barrier_wait(barrier);
+    stats_end(tasklet_id, PHASE_BARRIER);
+}
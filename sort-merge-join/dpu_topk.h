@@ -0,0 +1,123 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <mram.h>
+
+/*
+ * DPU-side top-K selection shared by the select and join kernels
+ *
+ * Every tasklet keeps its k best rows as (key, row index) pairs in a WRAM heap whose root is
+ * the worst of them, so a row that does not beat the root costs a single comparison.
+ * One tasklet then folds the other heaps into its own and writes the k best rows in order.
+ * Equal keys rank by row index, so a kernel always returns the same rows.
+ */
+
+typedef struct
+{
+    T key;
+    int idx;
+} topk_entry_t;
+
+topk_entry_t topk_heap[NR_TASKLETS][MAX_TOPK];
+int topk_size[NR_TASKLETS];
+
+// Returns 1 when a ranks before b
+int topk_before(const topk_args_t *args, topk_entry_t a, topk_entry_t b)
+{
+    if (a.key != b.key)
+        return args->desc ? a.key > b.key : a.key < b.key;
+
+    return a.idx < b.idx;
+}
+
+// Moves entry i down until no child ranks after it
+void topk_sift_down(const topk_args_t *args, topk_entry_t *heap, int size, int i)
+{
+    while (true)
+    {
+        int worst = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+
+        if (left < size && topk_before(args, heap[worst], heap[left]))
+            worst = left;
+        if (right < size && topk_before(args, heap[worst], heap[right]))
+            worst = right;
+        if (worst == i)
+            return;
+
+        topk_entry_t tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+// Offers a row to the heap of a tasklet
+void topk_push(const topk_args_t *args, int tasklet_id, T key, int idx)
+{
+    topk_entry_t *heap = topk_heap[tasklet_id];
+    topk_entry_t entry = {key, idx};
+    int i = topk_size[tasklet_id];
+
+    if (i < args->k)
+    {
+        // Not full yet, move the entry up while it ranks after its parent
+        topk_size[tasklet_id]++;
+        while (i > 0 && topk_before(args, heap[(i - 1) / 2], entry))
+        {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = entry;
+    }
+    else if (topk_before(args, entry, heap[0]))
+    {
+        heap[0] = entry;
+        topk_sift_down(args, heap, i, 0);
+    }
+}
+
+// Folds the heaps of all tasklets into the one of tasklet_id and sorts it best first
+// Called by one tasklet once every heap is complete, returns the number of rows kept
+int topk_reduce(const topk_args_t *args, int tasklet_id)
+{
+    for (int t = 0; t < NR_TASKLETS; t++)
+    {
+        if (t == tasklet_id)
+            continue;
+
+        for (int i = 0; i < topk_size[t]; i++)
+        {
+            topk_push(args, tasklet_id, topk_heap[t][i].key, topk_heap[t][i].idx);
+        }
+    }
+
+    // Heap sort, the worst entry goes to the back each step
+    topk_entry_t *heap = topk_heap[tasklet_id];
+    for (int size = topk_size[tasklet_id] - 1; size > 0; size--)
+    {
+        topk_entry_t tmp = heap[0];
+        heap[0] = heap[size];
+        heap[size] = tmp;
+        topk_sift_down(args, heap, size, 0);
+    }
+
+    return topk_size[tasklet_id];
+}
+
+// Copies the kept rows from the table at rows_addr to the writer in order
+// Rows packed with a schema are widened as they are copied, schema is NULL for T rows
+void topk_write(int tasklet_id, int row_num, uint32_t rows_addr, const schema_t *schema, row_writer_t *w)
+{
+    int row_size = schema != NULL ? schema->row_size : w->row_size;
+
+    for (int i = 0; i < row_num; i++)
+    {
+        mram_read((__mram_ptr void const *)(rows_addr + topk_heap[tasklet_id][i].idx * row_size), writer_slot(w), row_size);
+        if (schema != NULL)
+            schema_widen(schema, writer_slot(w), 1);
+        if (writer_commit(w))
+            writer_flush(w);
+    }
+    writer_flush(w);
+}
@@ -0,0 +1,1098 @@
+#include <dpu.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Host-side executor shared by the join (app.c) and group-by (group_app.c) pipelines
+ *
+ * A stage loads a kernel on a DPU set, sends every DPU its dpu_block_t and its rows,
+ * launches the set and reads the rows back. After sort_blocks, merge_rounds merges the
+ * sorted blocks of each table on the DPUs, several per DPU, until few enough blocks per table are left.
+ * A top-K skips both: every DPU returns its k first rows and merge_topk picks the k first of all.
+ * Transfer and launch times are added to the caller's cpu_dpu / dpu / dpu_cpu totals in ms.
+ * After every launch the phase cycles of each DPU and tasklet are added to kernel_stats.
+ */
+
+#ifndef DPU_BINARY_SELECT
+#define DPU_BINARY_SELECT "./select"
+#endif
+
+#ifndef DPU_BINARY_SORT_DPU
+#define DPU_BINARY_SORT_DPU "./sort_dpu"
+#endif
+
+#ifndef DPU_BINARY_MERGE_DPU
+#define DPU_BINARY_MERGE_DPU "./merge_dpu"
+#endif
+
+void set_csv_size(const char *filename, int *col_num, uint64_t *row_num)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file)
+    {
+        perror("Failed to open file");
+        exit(EXIT_FAILURE);
+    }
+
+    char line[1024];
+    int is_first_line = 1;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        if (is_first_line)
+        {
+            is_first_line = 0;
+            char *token = strtok(line, ",");
+            while (token)
+            {
+                (*col_num)++;
+                token = strtok(NULL, ",");
+            }
+        }
+        (*row_num)++;
+    }
+
+    (*row_num)--;
+    fclose(file);
+}
+
+// Returns true if the token is an integer, the line break of the last column is ignored
+bool is_integer(const char *token)
+{
+    char *end;
+    strtol(token, &end, 10);
+    return end != token && strspn(end, "\r\n") == strlen(end);
+}
+
+// Loads the rows of a csv file
+// A column holding any non-integer token is a string column, str_cols[c] is set for it and its
+// values are the codes of their strings in dict
+void load_csv(const char *filename, int col_num, uint64_t row_num, T **test_array, dict_t *dict, bool *str_cols)
+{
+    // Allocate memory for the array
+    *test_array = (T *)malloc(col_num * row_num * sizeof(T) + sizeof(T));
+
+    FILE *file = fopen(filename, "r");
+    if (!file)
+    {
+        perror("Failed to open file");
+        exit(EXIT_FAILURE);
+    }
+
+    char line[1024];
+    uint64_t row = 0;
+
+    // Find the string columns first, a column is encoded as a whole
+    memset(str_cols, 0, col_num * sizeof(bool));
+    fgets(line, sizeof(line), file);
+    while (fgets(line, sizeof(line), file))
+    {
+        char *token = strtok(line, ",");
+        for (int col = 0; token && col < col_num; col++)
+        {
+            if (!str_cols[col] && !is_integer(token))
+                str_cols[col] = true;
+            token = strtok(NULL, ",");
+        }
+    }
+    rewind(file);
+
+    // Skip header line
+    fgets(line, sizeof(line), file);
+
+    // Read each row from the file
+    while (fgets(line, sizeof(line), file))
+    {
+        char *token = strtok(line, ",");
+        int col = 0;
+        while (token)
+        {
+            if (str_cols[col])
+            {
+                token[strcspn(token, "\r\n")] = '\0';
+                (*test_array)[row * col_num + col] = dict_code(dict, token);
+            }
+            else
+            {
+                (*test_array)[row * col_num + col] = (T)strtoll(token, NULL, 10);
+            }
+            token = strtok(NULL, ",");
+            col++;
+        }
+        row++;
+    }
+
+    fclose(file);
+}
+
+/* ******************** */
+/*     MRAM budgets     */
+/* ******************** */
+
+// Host row counts and byte sizes are 64-bit, a block keeps int rows and 32-bit MRAM offsets on its DPU,
+// so every block is checked against the MRAM when a table is split on the DPUs
+
+// MRAM symbols of a DPU program are linked from this address, its heap starts past the last one
+#define MRAM_SYMBOL_BASE 0x08000000
+
+// MRAM bytes of the heap of the program loaded by alloc_dpus, the whole MRAM while no set is allocated
+// Checks made before a set is allocated are upper bounds, the stages check every block again once it is loaded
+uint64_t mram_heap_size = MRAM_SIZE;
+
+// Heap bytes of every binary alloc_dpus has loaded
+#define MAX_PROGRAMS 8
+const char *program_binaries[MAX_PROGRAMS];
+uint64_t program_heap_sizes[MAX_PROGRAMS];
+
+// MRAM bytes the select kernel needs for row_num rows: the packed input and its zone map,
+// or the T rows selected out of them if larger, followed by the staging area
+uint64_t select_mram_size(uint64_t row_num, const schema_t *schema)
+{
+    uint64_t rows_size = row_num * schema->col_num * sizeof(T);
+    uint64_t input_size = row_num * schema->row_size + (row_num + ZONE_ROWS - 1) / ZONE_ROWS * 2 * schema->col_num * sizeof(T);
+    return (input_size > rows_size ? input_size : rows_size) + rows_size;
+}
+
+// MRAM bytes the sort kernel needs for row_num rows of col_num columns and their sparse index,
+// a grouped agg stages its group rows past the rows
+uint64_t sort_mram_size(uint64_t row_num, int col_num, const agg_args_t *agg)
+{
+    uint64_t row_size = col_num * sizeof(T);
+    uint64_t group_size = (1 + agg->func_num) * sizeof(T);
+    if (agg->group_by_key)
+        return row_num * ((row_size > group_size ? row_size : group_size) + group_size);
+
+    return row_num * row_size + (row_num + INDEX_STRIDE - 1) / INDEX_STRIDE * sizeof(T);
+}
+
+// MRAM bytes the merge kernel needs for row_num rows of col_num columns: the input blocks back to back,
+// then the merged rows laid out as the sort kernel lays out its rows
+uint64_t merge_mram_size(uint64_t row_num, int col_num, const agg_args_t *agg)
+{
+    return row_num * col_num * sizeof(T) + sort_mram_size(row_num, col_num, agg);
+}
+
+// Exits when rows of col_num columns are larger than a DMA, or when a tasklet of the stage needs wram_size bytes
+// for them, more than its WRAM heap
+void check_row_size(const char *stage, int col_num, int wram_size)
+{
+    if (col_num * sizeof(T) > MAX_DMA_SIZE)
+    {
+        fprintf(stderr, "%s: rows of %d columns take %lu bytes, more than the %d bytes of one DMA\n",
+                stage, col_num, (unsigned long)(col_num * sizeof(T)), MAX_DMA_SIZE);
+        exit(EXIT_FAILURE);
+    }
+
+    if (wram_size > TASKLET_HEAP_SIZE)
+    {
+        fprintf(stderr, "%s: rows of %d columns need %d bytes of WRAM per tasklet, more than the %d bytes of a tasklet heap with %d tasklets\n",
+                stage, col_num, wram_size, TASKLET_HEAP_SIZE, NR_TASKLETS);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Exits when the block of a DPU needs more than the MRAM heap
+void check_mram_size(const char *stage, int dpu_id, uint64_t row_num, uint64_t size)
+{
+    if (size <= mram_heap_size)
+        return;
+
+    fprintf(stderr, "%s: DPU %d needs %lu bytes of MRAM for %lu rows, more DPUs are needed\n",
+            stage, dpu_id, (unsigned long)size, (unsigned long)row_num);
+    exit(EXIT_FAILURE);
+}
+
+/* ****************** */
+/*     Transfers      */
+/* ****************** */
+
+// Sends blocks[i] to DPU i with one parallel transfer
+void push_blocks(struct dpu_set_t set, const char *symbol, dpu_block_t *blocks)
+{
+    struct dpu_set_t dpu;
+    uint32_t dpu_id;
+    timer_begin("push blocks", TIMER_CPU_DPU);
+    uint64_t bytes = 0;
+
+    DPU_FOREACH(set, dpu, dpu_id)
+    {
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &blocks[dpu_id]));
+        bytes += sizeof(dpu_block_t);
+    }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, symbol, 0, sizeof(dpu_block_t), DPU_XFER_DEFAULT));
+    timer_bytes(bytes);
+    timer_end();
+}
+
+// Reads the block of every DPU back into blocks[i] with one parallel transfer
+void pull_blocks(struct dpu_set_t set, const char *symbol, dpu_block_t *blocks)
+{
+    struct dpu_set_t dpu;
+    uint32_t dpu_id;
+    timer_begin("pull blocks", TIMER_DPU_CPU);
+    uint64_t bytes = 0;
+
+    DPU_FOREACH(set, dpu, dpu_id)
+    {
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &blocks[dpu_id]));
+        bytes += sizeof(dpu_block_t);
+    }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, symbol, 0, sizeof(dpu_block_t), DPU_XFER_DEFAULT));
+    timer_bytes(bytes);
+    timer_end();
+}
+
+// Sends the rows of blocks[i] from rows[i] to the MRAM heap of DPU i at offset
+void push_rows(struct dpu_set_t set, const dpu_block_t *blocks, T **rows, uint32_t offset)
+{
+    struct dpu_set_t dpu;
+    uint32_t dpu_id;
+    timer_begin("push rows", TIMER_CPU_DPU);
+    uint64_t bytes = 0;
+
+    DPU_FOREACH(set, dpu, dpu_id)
+    {
+        uint32_t transfer_size = blocks[dpu_id].row_num * blocks[dpu_id].col_num * sizeof(T);
+        if (transfer_size == 0)
+            continue;
+
+        DPU_ASSERT(dpu_prepare_xfer(dpu, rows[dpu_id]));
+        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, offset, transfer_size, DPU_XFER_DEFAULT));
+        bytes += transfer_size;
+    }
+    timer_bytes(bytes);
+    timer_end();
+}
+
+// Reads the rows of blocks[i] from the MRAM heap of DPU i at offset into results[i]
+// The sparse index of a sorted block follows its rows and comes in the same transfer
+void pull_rows(struct dpu_set_t set, const dpu_block_t *blocks, dpu_result_t *results, uint32_t offset, bool indexed)
+{
+    struct dpu_set_t dpu;
+    uint32_t dpu_id;
+    timer_begin("pull rows", TIMER_DPU_CPU);
+    uint64_t bytes = 0;
+
+    DPU_FOREACH(set, dpu, dpu_id)
+    {
+        uint32_t rows_size = blocks[dpu_id].row_num * blocks[dpu_id].col_num * sizeof(T);
+        uint32_t transfer_size = rows_size + (indexed ? index_num(blocks[dpu_id].row_num) * sizeof(T) : 0);
+
+        results[dpu_id].table_num = blocks[dpu_id].table_num;
+        results[dpu_id].dpu_id = dpu_id;
+        results[dpu_id].col_num = blocks[dpu_id].col_num;
+        results[dpu_id].row_num = blocks[dpu_id].row_num;
+        results[dpu_id].arr = (T *)malloc(transfer_size + sizeof(T));
+        results[dpu_id].index = indexed ? results[dpu_id].arr + rows_size / sizeof(T) : NULL;
+        if (transfer_size == 0)
+            continue;
+
+        DPU_ASSERT(dpu_prepare_xfer(dpu, results[dpu_id].arr));
+        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, DPU_MRAM_HEAP_POINTER_NAME, offset, transfer_size, DPU_XFER_DEFAULT));
+        bytes += transfer_size;
+    }
+    timer_bytes(bytes);
+    timer_end();
+}
+
+// Reads the ordered top rows every DPU left at topk->out_offset into results[i]
+void pull_topk(struct dpu_set_t set, const topk_args_t *topk, int col_num, dpu_result_t *results)
+{
+    struct dpu_set_t dpu;
+    uint32_t dpu_id, dpu_num;
+
+    DPU_ASSERT(dpu_get_nr_dpus(set, &dpu_num));
+    topk_args_t args[dpu_num];
+    dpu_block_t blocks[dpu_num];
+
+    timer_begin("pull topk", TIMER_DPU_CPU);
+    DPU_FOREACH(set, dpu, dpu_id)
+    {
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &args[dpu_id]));
+    }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "topk", 0, sizeof(topk_args_t), DPU_XFER_DEFAULT));
+    timer_bytes(dpu_num * sizeof(topk_args_t));
+    timer_end();
+
+    for (uint32_t i = 0; i < dpu_num; i++)
+    {
+        blocks[i].table_num = 0;
+        blocks[i].key_col = topk->col;
+        blocks[i].col_num = col_num;
+        blocks[i].row_num = args[i].row_num;
+    }
+    pull_rows(set, blocks, results, topk->out_offset, false);
+}
+
+// Merges the ordered top rows of every DPU into out and returns the number of rows kept
+// Equal keys keep the DPU order, so the result does not depend on timing
+int merge_topk(const topk_args_t *topk, const dpu_result_t *results, int list_num, int col_num, T *out)
+{
+    int next[list_num];
+    memset(next, 0, sizeof(next));
+
+    int row_num = 0;
+    while (row_num < topk->k)
+    {
+        int best = -1;
+        for (int l = 0; l < list_num; l++)
+        {
+            if (next[l] == results[l].row_num)
+                continue;
+
+            T key = results[l].arr[next[l] * col_num + topk->col];
+            T best_key = best < 0 ? key : results[best].arr[next[best] * col_num + topk->col];
+            if (best < 0 || (topk->desc ? key > best_key : key < best_key))
+                best = l;
+        }
+        if (best < 0)
+            break;
+
+        memcpy(out + row_num * col_num, results[best].arr + next[best] * col_num, col_num * sizeof(T));
+        next[best]++;
+        row_num++;
+    }
+
+    return row_num;
+}
+
+/* ************************ */
+/*     Phase statistics     */
+/* ************************ */
+
+typedef enum
+{
+    KERNEL_SELECT,
+    KERNEL_SORT,
+    KERNEL_MERGE,
+    KERNEL_JOIN,
+    KERNEL_NUM
+} kernel_t;
+
+// Cycles of every phase of a kernel over its launches, one sample per tasklet of every DPU that had work
+// span is the cycle count of the slowest tasklet of a DPU, one sample per DPU and launch
+typedef struct
+{
+    const char *name;
+    uint64_t samples;
+    uint64_t min[PHASE_NUM];
+    uint64_t max[PHASE_NUM];
+    double sum[PHASE_NUM];
+    uint64_t span_samples;
+    uint64_t span_min;
+    uint64_t span_max;
+    double span_sum;
+} phase_stats_t;
+
+phase_stats_t kernel_stats[KERNEL_NUM] = {{.name = "select"}, {.name = "sort_dpu"}, {.name = "merge_dpu"}, {.name = "join"}};
+
+// Reads the phase cycles every DPU of the set left after a launch of kernel
+void stats_collect(struct dpu_set_t set, int kernel)
+{
+    struct dpu_set_t dpu;
+    uint32_t dpu_id, dpu_num;
+
+    DPU_ASSERT(dpu_get_nr_dpus(set, &dpu_num));
+    uint64_t (*cycles)[NR_TASKLETS][PHASE_NUM] = malloc(dpu_num * sizeof(*cycles));
+    timer_begin("pull cycles", TIMER_SETUP);
+    DPU_FOREACH(set, dpu, dpu_id)
+    {
+        DPU_ASSERT(dpu_prepare_xfer(dpu, cycles[dpu_id]));
+    }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "phase_cycles", 0, sizeof(cycles[0]), DPU_XFER_DEFAULT));
+    timer_bytes(dpu_num * sizeof(cycles[0]));
+    timer_end();
+
+    // A DPU left without work in this launch reports no cycles and stays out of the samples
+    phase_stats_t *stats = &kernel_stats[kernel];
+    for (uint32_t d = 0; d < dpu_num; d++)
+    {
+        bool idle = true;
+        for (int t = 0; t < NR_TASKLETS && idle; t++)
+        {
+            for (int p = 0; p < PHASE_NUM; p++)
+            {
+                if (cycles[d][t][p] != 0)
+                    idle = false;
+            }
+        }
+        if (idle)
+            continue;
+
+        uint64_t span = 0;
+        int slowest = 0;
+        for (int t = 0; t < NR_TASKLETS; t++)
+        {
+            uint64_t total = 0;
+            for (int p = 0; p < PHASE_NUM; p++)
+            {
+                uint64_t c = cycles[d][t][p];
+                stats->min[p] = stats->samples == 0 || c < stats->min[p] ? c : stats->min[p];
+                stats->max[p] = stats->samples == 0 || c > stats->max[p] ? c : stats->max[p];
+                stats->sum[p] += c;
+                total += c;
+            }
+            stats->samples++;
+            if (total > span)
+            {
+                span = total;
+                slowest = t;
+            }
+        }
+        trace_dpu_phases(stats->name, d, cycles[d][slowest]);
+
+        stats->span_min = stats->span_samples == 0 || span < stats->span_min ? span : stats->span_min;
+        stats->span_max = stats->span_samples == 0 || span > stats->span_max ? span : stats->span_max;
+        stats->span_sum += span;
+        stats->span_samples++;
+    }
+
+    free(cycles);
+}
+
+// Prints min / mean / max cycles of every phase of the kernels that ran
+// A phase whose max is far above its mean points at stragglers, load and write against compute at the DMA
+void stats_print(void)
+{
+    const char *phase_names[PHASE_NUM] = {"load", "compute", "barrier", "write"};
+
+    printf("######## CYCLES #######\n");
+    printf("%-10s %-8s %12s %12s %12s\n", "kernel", "phase", "min", "mean", "max");
+    for (int k = 0; k < KERNEL_NUM; k++)
+    {
+        const phase_stats_t *stats = &kernel_stats[k];
+        if (stats->samples == 0)
+            continue;
+
+        for (int p = 0; p < PHASE_NUM; p++)
+        {
+            printf("%-10s %-8s %12lu %12.0f %12lu\n", p == 0 ? stats->name : "", phase_names[p],
+                   (unsigned long)stats->min[p], stats->sum[p] / stats->samples, (unsigned long)stats->max[p]);
+        }
+        printf("%-10s %-8s %12lu %12.0f %12lu\n", "", "span",
+               (unsigned long)stats->span_min, stats->span_sum / stats->span_samples, (unsigned long)stats->span_max);
+    }
+    printf("#######################\n\n");
+}
+
+/* ************** */
+/*     Stages     */
+/* ************** */
+
+// Allocates dpu_num DPUs and loads binary on them, mram_heap_size is the MRAM left past its static symbols
+void alloc_dpus(uint32_t dpu_num, const char *binary, struct dpu_set_t *set)
+{
+    timer_begin("alloc", TIMER_SETUP);
+    DPU_ASSERT(dpu_alloc(dpu_num, "backend=simulator", set));
+    timer_end();
+
+    timer_begin("load", TIMER_SETUP);
+    struct dpu_program_t *program;
+    struct dpu_symbol_t heap;
+    DPU_ASSERT(dpu_load(*set, binary, &program));
+    DPU_ASSERT(dpu_get_symbol(program, DPU_MRAM_HEAP_POINTER_NAME, &heap));
+    mram_heap_size = MRAM_SIZE - (heap.address - MRAM_SYMBOL_BASE);
+    timer_end();
+
+    for (int p = 0; p < MAX_PROGRAMS; p++)
+    {
+        if (program_binaries[p] == NULL || strcmp(program_binaries[p], binary) == 0)
+        {
+            program_binaries[p] = binary;
+            program_heap_sizes[p] = mram_heap_size;
+            break;
+        }
+    }
+}
+
+void free_dpus(struct dpu_set_t set)
+{
+    timer_begin("free", TIMER_SETUP);
+    DPU_ASSERT(dpu_free(set));
+    mram_heap_size = MRAM_SIZE;
+    timer_end();
+}
+
+// MRAM heap bytes of binary, for sizing a stage before its set is allocated
+// A binary not loaded yet is loaded once on a single DPU
+uint64_t program_heap_size(const char *binary)
+{
+    for (int p = 0; p < MAX_PROGRAMS && program_binaries[p] != NULL; p++)
+    {
+        if (strcmp(program_binaries[p], binary) == 0)
+            return program_heap_sizes[p];
+    }
+
+    struct dpu_set_t set;
+    alloc_dpus(1, binary, &set);
+    uint64_t heap_size = mram_heap_size;
+    free_dpus(set);
+    return heap_size;
+}
+
+// Runs kernel on every DPU of the set, stats_collect reads its cycles afterwards
+void launch_kernel(struct dpu_set_t set, int kernel)
+{
+    timer_begin(kernel_stats[kernel].name, TIMER_DPU);
+    DPU_ASSERT(dpu_launch(set, DPU_SYNCHRONOUS));
+    timer_end();
+}
+
+// Runs the select kernel twice on set for a semi-join reduction: the blocks of build_table build
+// a Bloom filter on their key column, the others drop the rows whose key cannot be in it
+// The filter follows the largest select area, so it is at the same offset on every DPU
+void bloom_blocks(struct dpu_set_t set, const dpu_block_t *blocks, int block_num, const schema_t *schema, int build_table,
+                  uint64_t build_rows, uint64_t *dropped_rows)
+{
+    struct dpu_set_t dpu;
+    uint32_t dpu_id;
+
+    // Size the filter for the build side, in whole 64-bit words
+    uint32_t word_num = BLOOM_MIN_WORDS;
+    uint32_t word_bits = 6;
+    while (word_num < BLOOM_MAX_WORDS && (uint64_t)word_num * 64 < build_rows * BLOOM_BITS_PER_KEY)
+    {
+        word_num <<= 1;
+        word_bits++;
+    }
+    uint32_t hash_num = (uint32_t)((double)word_num * 64 / (build_rows > 0 ? build_rows : 1) * log(2.0) + 0.5);
+    if (hash_num < 1)
+        hash_num = 1;
+    if (hash_num > 8)
+        hash_num = 8;
+
+    uint64_t filter_offset = 0;
+    int filter_dpu = 0;
+    for (int i = 0; i < block_num; i++)
+    {
+        uint64_t select_size = select_mram_size(blocks[i].row_num, &schema[blocks[i].table_num]);
+        if (select_size > filter_offset)
+        {
+            filter_offset = select_size;
+            filter_dpu = i;
+        }
+    }
+    filter_offset = (filter_offset + 7) & ~(uint64_t)7;
+    check_mram_size("Bloom filter", filter_dpu, blocks[filter_dpu].row_num, filter_offset + (uint64_t)word_num * sizeof(uint64_t));
+
+    bloom_args_t bloom_args[block_num];
+    for (int i = 0; i < block_num; i++)
+    {
+        bloom_args[i].mode = blocks[i].table_num == build_table ? BLOOM_BUILD : BLOOM_SKIP;
+        bloom_args[i].key_col = blocks[i].key_col;
+        bloom_args[i].filter_offset = (uint32_t)filter_offset;
+        bloom_args[i].word_num = word_num;
+        bloom_args[i].word_bits = word_bits;
+        bloom_args[i].hash_num = hash_num;
+        bloom_args[i].dropped = 0;
+    }
+
+    // Build the filter on the build side
+    timer_begin("push bloom args", TIMER_CPU_DPU);
+    DPU_FOREACH(set, dpu, dpu_id)
+    {
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &bloom_args[dpu_id]));
+    }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "bloom", 0, sizeof(bloom_args_t), DPU_XFER_DEFAULT));
+    timer_bytes(sizeof(bloom_args));
+    timer_end();
+    launch_kernel(set, KERNEL_SELECT);
+    stats_collect(set, KERNEL_SELECT);
+
+    // Merge the partial filters and hand the result to every DPU
+    timer_begin("bloom filter", TIMER_HOST);
+    uint64_t *filter = (uint64_t *)calloc(word_num, sizeof(uint64_t));
+    uint64_t *partial_filter = (uint64_t *)malloc(word_num * sizeof(uint64_t));
+    DPU_FOREACH(set, dpu, dpu_id)
+    {
+        if (bloom_args[dpu_id].mode != BLOOM_BUILD)
+            continue;
+
+        DPU_ASSERT(dpu_copy_from(dpu, DPU_MRAM_HEAP_POINTER_NAME, (uint32_t)filter_offset, partial_filter, word_num * sizeof(uint64_t)));
+        for (uint32_t w = 0; w < word_num; w++)
+        {
+            filter[w] |= partial_filter[w];
+        }
+    }
+    timer_end();
+
+    timer_begin("broadcast bloom filter", TIMER_CPU_DPU);
+    DPU_ASSERT(dpu_broadcast_to(set, DPU_MRAM_HEAP_POINTER_NAME, (uint32_t)filter_offset, filter, word_num * sizeof(uint64_t), DPU_XFER_DEFAULT));
+    timer_bytes((uint64_t)block_num * word_num * sizeof(uint64_t));
+    timer_end();
+
+    int filter_bits = 0;
+    for (uint32_t w = 0; w < word_num; w++)
+    {
+        filter_bits += __builtin_popcountll(filter[w]);
+    }
+    free(filter);
+    free(partial_filter);
+
+    // Probe the filter on the other side, the build side already holds its result
+    for (int i = 0; i < block_num; i++)
+    {
+        bloom_args[i].mode = blocks[i].table_num == build_table ? BLOOM_SKIP : BLOOM_PROBE;
+    }
+
+    timer_begin("push bloom args", TIMER_CPU_DPU);
+    DPU_FOREACH(set, dpu, dpu_id)
+    {
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &bloom_args[dpu_id]));
+    }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "bloom", 0, sizeof(bloom_args_t), DPU_XFER_DEFAULT));
+    timer_bytes(sizeof(bloom_args));
+    timer_end();
+    launch_kernel(set, KERNEL_SELECT);
+    stats_collect(set, KERNEL_SELECT);
+
+    timer_begin("pull bloom args", TIMER_DPU_CPU);
+    DPU_FOREACH(set, dpu, dpu_id)
+    {
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &bloom_args[dpu_id]));
+    }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, "bloom", 0, sizeof(bloom_args_t), DPU_XFER_DEFAULT));
+    timer_bytes(sizeof(bloom_args));
+    timer_end();
+
+    *dropped_rows = 0;
+    for (int i = 0; i < block_num; i++)
+    {
+        if (bloom_args[i].mode == BLOOM_PROBE)
+            *dropped_rows += bloom_args[i].dropped;
+    }
+
+    // Predicted false positive rate of a blocked filter with k bits in one word
+    double fill = (double)filter_bits / ((double)word_num * 64);
+    printf("Bloom filter (table %d) : %u bits, %u hashes, fill %.3f, estimated FPR %.6f\n",
+           build_table + 1, word_num * 64, hash_num, fill, pow(fill, hash_num));
+}
+
+// Selects the rows of blocks[i] matching pred[t] on DPU i, t = blocks[i].table_num, zones of rows that cannot match are skipped
+// The rows are sent packed with schema[t] and come back as T rows
+// With a top-K (topk != NULL) every DPU returns only its k first selected rows in order
+// With a Bloom filter (build_table >= 0) the blocks of build_table first build it on their key column,
+// then the other blocks drop the rows whose key cannot be in it and *dropped_rows counts them
+void select_blocks(dpu_block_t *blocks, T **rows, dpu_result_t *results, int block_num, const schema_t *schema,
+                   const predicate_t *pred, topk_args_t *topk, int build_table, uint64_t *dropped_rows)
+{
+    struct dpu_set_t set, dpu;
+    uint32_t dpu_id;
+    timer_begin("select", TIMER_STAGE);
+
+    // Build the zone maps of every DPU, a DPU whose rows cannot match gets no rows at all
+    timer_begin("zone maps", TIMER_HOST);
+    T *zone_maps[block_num];
+    uint8_t *packed_rows[block_num];
+    uint32_t max_input_size = 0;
+    uint64_t build_rows = 0;
+    int skipped_dpus = 0;
+    for (int i = 0; i < block_num; i++)
+    {
+        int t = blocks[i].table_num;
+        int col_num = blocks[i].col_num;
+        int zone_num = get_zone_num(blocks[i].row_num);
+        if (t == build_table)
+            build_rows += blocks[i].row_num;
+
+        zone_maps[i] = (T *)malloc(zone_num * 2 * col_num * sizeof(T) + sizeof(T));
+        build_zone_map(rows[i], blocks[i].row_num, col_num, zone_maps[i]);
+
+        T zone[2 * col_num];
+        merge_zone_map(zone_maps[i], zone_num, col_num, zone);
+        if (zone_num > 0 && !zone_match_predicate(&pred[t], zone, col_num))
+        {
+            blocks[i].row_num = 0;
+            skipped_dpus++;
+        }
+
+        packed_rows[i] = pack_rows(&schema[t], rows[i], blocks[i].row_num);
+
+        uint32_t input_size = blocks[i].row_num * schema[t].row_size + get_zone_num(blocks[i].row_num) * 2 * col_num * sizeof(T);
+        if (input_size > max_input_size)
+            max_input_size = input_size;
+    }
+    timer_end();
+
+#ifdef DEBUG
+    printf("Zone map : skip %d of %d DPUs in select\n", skipped_dpus, block_num);
+#endif
+
+    alloc_dpus(block_num, DPU_BINARY_SELECT, &set);
+    for (int i = 0; i < block_num; i++)
+    {
+        check_mram_size("Select", i, blocks[i].row_num, select_mram_size(blocks[i].row_num, &schema[blocks[i].table_num]));
+    }
+
+    // The zone map follows the input rows, the top rows of a top-K follow the largest input and zone map
+    push_blocks(set, "bl", blocks);
+    timer_begin("push args", TIMER_CPU_DPU);
+    DPU_FOREACH(set, dpu, dpu_id)
+    {
+        DPU_ASSERT(dpu_prepare_xfer(dpu, (void *)&pred[blocks[dpu_id].table_num]));
+    }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "pred", 0, sizeof(predicate_t), DPU_XFER_DEFAULT));
+    DPU_FOREACH(set, dpu, dpu_id)
+    {
+        DPU_ASSERT(dpu_prepare_xfer(dpu, (void *)&schema[blocks[dpu_id].table_num]));
+    }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "schema", 0, sizeof(schema_t), DPU_XFER_DEFAULT));
+    if (topk != NULL)
+    {
+        topk->out_offset = max_input_size;
+        DPU_ASSERT(dpu_broadcast_to(set, "topk", 0, topk, sizeof(topk_args_t), DPU_XFER_DEFAULT));
+    }
+    timer_bytes((uint64_t)block_num * (sizeof(predicate_t) + sizeof(schema_t) + (topk != NULL ? sizeof(topk_args_t) : 0)));
+    timer_end();
+
+    timer_begin("push rows", TIMER_CPU_DPU);
+    uint64_t bytes = 0;
+    DPU_FOREACH(set, dpu, dpu_id)
+    {
+        uint32_t transfer_size = blocks[dpu_id].row_num * schema[blocks[dpu_id].table_num].row_size;
+        uint32_t zone_size = get_zone_num(blocks[dpu_id].row_num) * 2 * blocks[dpu_id].col_num * sizeof(T);
+        if (zone_size == 0)
+            continue;
+
+        DPU_ASSERT(dpu_prepare_xfer(dpu, packed_rows[dpu_id]));
+        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, 0, transfer_size, DPU_XFER_DEFAULT));
+        DPU_ASSERT(dpu_prepare_xfer(dpu, zone_maps[dpu_id]));
+        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, transfer_size, zone_size, DPU_XFER_DEFAULT));
+        bytes += transfer_size + zone_size;
+    }
+    timer_bytes(bytes);
+    timer_end();
+
+    for (int i = 0; i < block_num; i++)
+    {
+        free(zone_maps[i]);
+        free(packed_rows[i]);
+    }
+
+    if (build_table >= 0)
+        bloom_blocks(set, blocks, block_num, schema, build_table, build_rows, dropped_rows);
+    else
+    {
+        launch_kernel(set, KERNEL_SELECT);
+        stats_collect(set, KERNEL_SELECT);
+    }
+
+    pull_blocks(set, "bl", blocks);
+    if (topk != NULL)
+        pull_topk(set, topk, blocks[0].col_num, results);
+    else
+        pull_rows(set, blocks, results, 0, false);
+
+    free_dpus(set);
+    timer_end();
+}
+
+
+// Range of the keys of a block of rows
+// The narrow sort needs two word arrays and a copy of the rows next to the block in MRAM
+void block_key_range(const dpu_block_t *block, const T *rows, key_range_t *range)
+{
+    range->base = 0;
+    range->narrow = 0;
+
+#if !defined(DOUBLE)
+    if (block->row_num == 0)
+        return;
+
+    uint64_t row_size = block->col_num * sizeof(T);
+    if ((uint64_t)block->row_num * (2 * row_size + 2 * sizeof(uint64_t)) > mram_heap_size)
+        return;
+
+    T min = rows[block->key_col];
+    T max = min;
+    for (int r = 1; r < block->row_num; r++)
+    {
+        T key = rows[(uint64_t)r * block->col_num + block->key_col];
+        if (key < min)
+            min = key;
+        if (key > max)
+            max = key;
+    }
+
+    range->base = min;
+    range->narrow = (uint64_t)max - (uint64_t)min <= UINT32_MAX;
+#endif
+}
+
+// Sorts the rows of every block on its key_col, one block per DPU
+// A grouped agg also collapses every run of equal keys into one row of the key and its aggregates,
+// the blocks then describe the group rows
+void sort_blocks(dpu_block_t *blocks, T **rows, dpu_result_t *results, int block_num, const agg_args_t *agg)
+{
+    struct dpu_set_t set, dpu;
+    uint32_t dpu_id;
+    timer_begin("sort", TIMER_STAGE);
+
+    alloc_dpus(block_num, DPU_BINARY_SORT_DPU, &set);
+    for (int i = 0; i < block_num; i++)
+    {
+        check_mram_size("Sort", i, blocks[i].row_num, sort_mram_size(blocks[i].row_num, blocks[i].col_num, agg));
+    }
+
+    timer_begin("key ranges", TIMER_HOST);
+    key_range_t ranges[block_num];
+    DPU_FOREACH(set, dpu, dpu_id)
+    {
+        block_key_range(&blocks[dpu_id], rows[dpu_id], &ranges[dpu_id]);
+    }
+    timer_end();
+
+    timer_begin("push key ranges", TIMER_CPU_DPU);
+    DPU_FOREACH(set, dpu, dpu_id)
+    {
+        DPU_ASSERT(dpu_prepare_xfer(dpu, &ranges[dpu_id]));
+    }
+    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "key_range", 0, sizeof(key_range_t), DPU_XFER_DEFAULT));
+    timer_bytes(sizeof(ranges));
+    timer_end();
+    push_blocks(set, "bl", blocks);
+    timer_begin("broadcast args", TIMER_CPU_DPU);
+    DPU_ASSERT(dpu_broadcast_to(set, "agg", 0, agg, sizeof(agg_args_t), DPU_XFER_DEFAULT));
+    timer_bytes((uint64_t)block_num * sizeof(agg_args_t));
+    timer_end();
+    push_rows(set, blocks, rows, 0);
+
+    launch_kernel(set, KERNEL_SORT);
+    stats_collect(set, KERNEL_SORT);
+
+    pull_blocks(set, "bl", blocks);
+    pull_rows(set, blocks, results, 0, true);
+
+    free_dpus(set);
+    timer_end();
+}
+
+// Picks the number of blocks merged by one DPU in the next round
+// The round count of MAX_MERGE_WAYS down to target blocks is kept with the fewest ways that reach it, which spreads the rows
+// on more DPUs, then the ways shrink until every merge fits in the MRAM heap of the merge kernel (input, output
+// and its sparse index or the grouped staging), a tile row per way fits in the WRAM tile bytes of a tasklet
+// and a row per way and buffer fits in the WRAM heap of a tasklet.
+int merge_ways(const dpu_block_t *blocks, int table_num, const int *first, const int *left, int target, const agg_args_t *agg)
+{
+    int max_left = 0;
+    for (int t = 0; t < table_num; t++)
+    {
+        if (left[t] > max_left)
+            max_left = left[t];
+    }
+
+    int rounds = 0;
+    for (long reach = target; reach < max_left; reach *= MAX_MERGE_WAYS)
+    {
+        rounds++;
+    }
+
+    int ways = 2;
+    for (; ways < MAX_MERGE_WAYS; ways++)
+    {
+        long reach = target;
+        for (int r = 0; r < rounds; r++)
+        {
+            reach *= ways;
+        }
+        if (reach >= max_left)
+            break;
+    }
+
+    uint64_t heap_size = program_heap_size(DPU_BINARY_MERGE_DPU);
+    for (; ways > 2; ways--)
+    {
+        bool fits = true;
+        for (int t = 0; t < table_num && fits; t++)
+        {
+            for (int g = 0; g < left[t] && fits; g += ways)
+            {
+                int col_num = blocks[first[t] + g].col_num;
+                uint64_t merge_rows = 0;
+                for (int b = g; b < g + ways && b < left[t]; b++)
+                {
+                    merge_rows += blocks[first[t] + b].row_num;
+                }
+
+                uint64_t tile_size = (uint64_t)ways * col_num * sizeof(T);
+                fits = merge_mram_size(merge_rows, col_num, agg) <= heap_size && tile_size <= MERGE_TILE_SIZE &&
+                       merge_wram_size(col_num, ways) <= TASKLET_HEAP_SIZE;
+            }
+        }
+        if (fits)
+            break;
+    }
+
+    return ways;
+}
+
+// Merges the sorted blocks of each table, up to MAX_MERGE_WAYS per DPU, until at most target blocks per table are left
+// Table t owns blocks [first[t], first[t] + count[t]) and count[t] is set to the blocks left from first[t] on.
+// All merges of a round run in one launch, with a grouped agg the equal keys of a merge are folded together
+void merge_rounds(dpu_block_t *blocks, dpu_result_t *results, int table_num, const int *first, int *count, int target,
+                  const agg_args_t *agg)
+{
+    timer_begin("merge", TIMER_STAGE);
+    int left[table_num];
+    for (int t = 0; t < table_num; t++)
+    {
+        left[t] = count[t];
+    }
+
+    for (int round = 0;; round++)
+    {
+        int ways = merge_ways(blocks, table_num, first, left, target, agg);
+
+        // Merge m takes way_nums[m] blocks from src[m] into dst[m], a last block without a partner only moves
+        int merge_num = 0;
+        for (int t = 0; t < table_num; t++)
+        {
+            merge_num += left[t] > target ? (left[t] + ways - 2) / ways : 0;
+        }
+        if (merge_num == 0)
+            break;
+
+        char round_name[32];
+        snprintf(round_name, sizeof(round_name), "merge round %d", round);
+        timer_begin(round_name, TIMER_STAGE);
+
+        int src[merge_num];
+        int dst[merge_num];
+        int way_nums[merge_num];
+        for (int t = 0, m = 0; t < table_num; t++)
+        {
+            for (int g = 0; left[t] > target && g < (left[t] + ways - 2) / ways; g++, m++)
+            {
+                src[m] = first[t] + g * ways;
+                dst[m] = first[t] + g;
+                way_nums[m] = left[t] - g * ways < ways ? left[t] - g * ways : ways;
+            }
+        }
+
+        dpu_block_t way_blocks[merge_num][MAX_MERGE_WAYS];
+        uint32_t output_offsets[merge_num];
+        for (int m = 0; m < merge_num; m++)
+        {
+            output_offsets[m] = 0;
+            for (int w = 0; w < way_nums[m]; w++)
+            {
+                way_blocks[m][w] = blocks[src[m] + w];
+                output_offsets[m] += blocks[src[m] + w].row_num * blocks[src[m] + w].col_num * sizeof(T);
+            }
+        }
+
+        struct dpu_set_t set, dpu;
+        uint32_t dpu_id;
+        alloc_dpus(merge_num, DPU_BINARY_MERGE_DPU, &set);
+        for (int m = 0; m < merge_num; m++)
+        {
+            uint64_t merge_rows = 0;
+            for (int w = 0; w < way_nums[m]; w++)
+            {
+                merge_rows += way_blocks[m][w].row_num;
+            }
+            check_mram_size("Merge", m, merge_rows, merge_mram_size(merge_rows, way_blocks[m][0].col_num, agg));
+        }
+
+        // The blocks of a merge are placed back to back, the merged rows follow them
+        timer_begin("push args", TIMER_CPU_DPU);
+        DPU_FOREACH(set, dpu, dpu_id)
+        {
+            DPU_ASSERT(dpu_prepare_xfer(dpu, way_blocks[dpu_id]));
+        }
+        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "bl", 0, sizeof(way_blocks[0]), DPU_XFER_DEFAULT));
+        DPU_FOREACH(set, dpu, dpu_id)
+        {
+            DPU_ASSERT(dpu_prepare_xfer(dpu, &way_nums[dpu_id]));
+        }
+        DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, "way_num", 0, sizeof(int), DPU_XFER_DEFAULT));
+        DPU_ASSERT(dpu_broadcast_to(set, "agg", 0, agg, sizeof(agg_args_t), DPU_XFER_DEFAULT));
+        timer_bytes((uint64_t)merge_num * (sizeof(way_blocks[0]) + sizeof(int) + sizeof(agg_args_t)));
+        timer_end();
+
+        timer_begin("push rows", TIMER_CPU_DPU);
+        uint64_t bytes = 0;
+        DPU_FOREACH(set, dpu, dpu_id)
+        {
+            uint32_t offset = 0;
+            for (int w = 0; w < way_nums[dpu_id]; w++)
+            {
+                uint32_t way_size = way_blocks[dpu_id][w].row_num * way_blocks[dpu_id][w].col_num * sizeof(T);
+                if (way_size > 0)
+                {
+                    DPU_ASSERT(dpu_prepare_xfer(dpu, results[src[dpu_id] + w].arr));
+                    DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_TO_DPU, DPU_MRAM_HEAP_POINTER_NAME, offset, way_size, DPU_XFER_DEFAULT));
+                }
+                offset += way_size;
+            }
+            bytes += offset;
+        }
+        timer_bytes(bytes);
+        timer_end();
+
+        for (int m = 0; m < merge_num; m++)
+        {
+            for (int w = 0; w < way_nums[m]; w++)
+            {
+                free(results[src[m] + w].arr);
+            }
+        }
+
+        launch_kernel(set, KERNEL_MERGE);
+        stats_collect(set, KERNEL_MERGE);
+
+        // Folding equal keys can shrink a merge, the kernel reports the merged row count in its first block
+        // and leaves the sparse index of the merged block after its rows
+        dpu_block_t merged_blocks[merge_num];
+        pull_blocks(set, "bl", merged_blocks);
+        timer_begin("pull rows", TIMER_DPU_CPU);
+        bytes = 0;
+        DPU_FOREACH(set, dpu, dpu_id)
+        {
+            dpu_result_t *merged = &results[dst[dpu_id]];
+            uint32_t rows_size = merged_blocks[dpu_id].row_num * merged_blocks[dpu_id].col_num * sizeof(T);
+            uint32_t transfer_size = rows_size + index_num(merged_blocks[dpu_id].row_num) * sizeof(T);
+
+            blocks[dst[dpu_id]] = merged_blocks[dpu_id];
+            merged->table_num = merged_blocks[dpu_id].table_num;
+            merged->dpu_id = dst[dpu_id];
+            merged->col_num = merged_blocks[dpu_id].col_num;
+            merged->row_num = merged_blocks[dpu_id].row_num;
+            merged->arr = (T *)malloc(transfer_size + sizeof(T));
+            merged->index = merged->arr + rows_size / sizeof(T);
+            if (transfer_size == 0)
+                continue;
+
+            DPU_ASSERT(dpu_prepare_xfer(dpu, merged->arr));
+            DPU_ASSERT(dpu_push_xfer(set, DPU_XFER_FROM_DPU, DPU_MRAM_HEAP_POINTER_NAME, output_offsets[dpu_id], transfer_size, DPU_XFER_DEFAULT));
+            bytes += transfer_size;
+        }
+        timer_bytes(bytes);
+        timer_end();
+
+        free_dpus(set);
+
+        // A last block without a partner moves up to the next free slot of its table
+        for (int t = 0; t < table_num; t++)
+        {
+            if (left[t] > target && left[t] % ways == 1)
+            {
+                blocks[first[t] + left[t] / ways] = blocks[first[t] + left[t] - 1];
+                results[first[t] + left[t] / ways] = results[first[t] + left[t] - 1];
+                results[first[t] + left[t] / ways].dpu_id = first[t] + left[t] / ways;
+            }
+            if (left[t] > target)
+                left[t] = (left[t] + ways - 1) / ways;
+        }
+        timer_end();
+    }
+
+    for (int t = 0; t < table_num; t++)
+    {
+        count[t] = left[t];
+    }
+    timer_end();
+}
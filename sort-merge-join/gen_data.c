@@ -0,0 +1,480 @@
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Multithreaded generator of the csv input tables
+ *
+ * col1 is the join key, the other columns hold values in [1, 3 * rows] like the tables of the original
+ * runs. Every row draws from its own random stream seeded by (seed, table, row), so a seed gives the same
+ * tables with any thread count. The rows are formatted in batches by the threads and written in order.
+ *
+ * The key of a table 1 row is the rank of a key out of about rows / dup keys, drawn from the distribution,
+ * and written as the even value 2 * rank + 2 (sorted keys leave random gaps between the ranks):
+ *   unique        : each key dup times, the rows shuffled
+ *   uniform       : keys drawn uniformly
+ *   zipf          : key of rank k drawn with weight 1 / k^s (--zipf s), key 2 is the most frequent
+ *   sequential    : 2, 4, 6, ..., each key dup times in order
+ *   sorted        : increasing keys with random gaps, each key dup times
+ *   nearly-sorted : sorted, but a --disorder fraction of the rows take a random key
+ *   clustered     : the rows come in --clusters runs, the keys of a run fall in their own narrow range
+ * A table 2 row takes the key of a table 1 row with probability --match (the row at the same relative
+ * position for the ordered and clustered distributions), otherwise that key minus one, which no table 1 row holds.
+ * With --selectivity s, a fraction s of the rows of the --select-col column hold a value in [1, rows]
+ * and the rest one in (rows, 3 * rows], so colN<=rows keeps s of the rows.
+ */
+
+#define BATCH_ROWS 65536
+#define MAX_LINE 24
+#define MAX_GEN_THREADS 256
+
+typedef enum
+{
+    DIST_UNIQUE,
+    DIST_UNIFORM,
+    DIST_ZIPF,
+    DIST_SEQUENTIAL,
+    DIST_SORTED,
+    DIST_NEARLY_SORTED,
+    DIST_CLUSTERED,
+    DIST_NUM
+} dist_t;
+
+const char *dist_names[DIST_NUM] = {"unique", "uniform", "zipf", "sequential", "sorted", "nearly-sorted", "clustered"};
+
+// Zipf sampler by rejection-inversion (Hörmann and Derflinger), constant time for any key count
+typedef struct
+{
+    double s;
+    uint64_t n;
+    double h_x1;
+    double h_n;
+    double threshold;
+} zipf_t;
+
+typedef struct
+{
+    dist_t dist;
+    uint64_t rows[2];
+    int col_num;
+    uint64_t dup;
+    uint64_t key_num;
+    double match;
+    double disorder;
+    uint64_t clusters;
+    int select_col;
+    double selectivity;
+    uint64_t seed;
+    zipf_t zipf;
+    // Shuffles the rows for unique and the key ranges of the clusters
+    uint64_t shuffle_key;
+} gen_args_t;
+
+typedef struct
+{
+    const gen_args_t *args;
+    int table;
+    uint64_t first;
+    uint64_t last;
+    char *buf;
+    size_t len;
+} gen_batch_t;
+
+/* ******************** */
+/*     Random draws     */
+/* ******************** */
+
+uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Stream of row row of table table (0 for the keys of table 1, shared by both tables)
+uint64_t row_stream(uint64_t seed, int table, uint64_t row)
+{
+    uint64_t state = seed ^ ((uint64_t)table << 56);
+    splitmix64(&state);
+    state ^= row * 0xd1b54a32d192ed03ULL;
+    return splitmix64(&state);
+}
+
+// Uniform in [0, n)
+uint64_t rand_below(uint64_t *state, uint64_t n)
+{
+    return (uint64_t)(((unsigned __int128)splitmix64(state) * n) >> 64);
+}
+
+// Uniform in [0, 1)
+double rand_unit(uint64_t *state)
+{
+    return (splitmix64(state) >> 11) * 0x1.0p-53;
+}
+
+double zipf_helper1(double x)
+{
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+double zipf_helper2(double x)
+{
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+}
+
+double zipf_h(const zipf_t *z, double x)
+{
+    return exp(-z->s * log(x));
+}
+
+double zipf_h_integral(const zipf_t *z, double x)
+{
+    double log_x = log(x);
+    return zipf_helper2((1 - z->s) * log_x) * log_x;
+}
+
+double zipf_h_integral_inverse(const zipf_t *z, double x)
+{
+    double t = x * (1 - z->s);
+    if (t < -1)
+        t = -1;
+    return exp(zipf_helper1(t) * x);
+}
+
+void zipf_init(zipf_t *z, uint64_t n, double s)
+{
+    z->s = s;
+    z->n = n;
+    z->h_x1 = zipf_h_integral(z, 1.5) - 1;
+    z->h_n = zipf_h_integral(z, n + 0.5);
+    z->threshold = 2 - zipf_h_integral_inverse(z, zipf_h_integral(z, 2.5) - zipf_h(z, 2));
+}
+
+// Rank in [1, n]
+uint64_t zipf_sample(const zipf_t *z, uint64_t *state)
+{
+    while (true)
+    {
+        double u = z->h_n + rand_unit(state) * (z->h_x1 - z->h_n);
+        double x = zipf_h_integral_inverse(z, u);
+        uint64_t k = x < 1.5 ? 1 : (uint64_t)(x + 0.5);
+        if (k > z->n)
+            k = z->n;
+
+        if (k - x <= z->threshold || u >= zipf_h_integral(z, k + 0.5) - zipf_h(z, k))
+            return k;
+    }
+}
+
+// Position of r in a shuffle of [0, n) keyed by key, a 4 round Feistel network cycle-walked into [0, n)
+uint64_t shuffle_index(uint64_t r, uint64_t n, uint64_t key)
+{
+    int half = 1;
+    while (half < 31 && (1ULL << (2 * half)) < n)
+    {
+        half++;
+    }
+    uint64_t mask = (1ULL << half) - 1;
+
+    do
+    {
+        uint64_t left = r >> half;
+        uint64_t right = r & mask;
+        for (int round = 0; round < 4; round++)
+        {
+            uint64_t state = key ^ (right * 0x9e3779b97f4a7c15ULL) ^ round;
+            uint64_t t = left ^ (splitmix64(&state) & mask);
+            left = right;
+            right = t;
+        }
+        r = (left << half) | right;
+    } while (r >= n);
+
+    return r;
+}
+
+/* ************** */
+/*     Tables     */
+/* ************** */
+
+// Even key of row row of table 1
+uint64_t table1_key(const gen_args_t *args, uint64_t row)
+{
+    uint64_t state = row_stream(args->seed, 0, row);
+    uint64_t rank = 0;
+
+    switch (args->dist)
+    {
+    case DIST_UNIQUE:
+        rank = shuffle_index(row, args->rows[0], args->shuffle_key) / args->dup;
+        break;
+    case DIST_UNIFORM:
+        rank = rand_below(&state, args->key_num);
+        break;
+    case DIST_ZIPF:
+        rank = zipf_sample(&args->zipf, &state) - 1;
+        break;
+    case DIST_SEQUENTIAL:
+        rank = row / args->dup;
+        break;
+    case DIST_SORTED:
+    case DIST_NEARLY_SORTED:
+    {
+        rank = row / args->dup;
+        if (args->dist == DIST_NEARLY_SORTED && rand_unit(&state) < args->disorder)
+            rank = rand_below(&state, args->key_num);
+
+        // Ranks 1 to 3 apart leave random gaps between the keys, the same for every row holding a key
+        uint64_t rank_state = row_stream(args->seed, 3, rank);
+        rank = rank * 2 + rand_below(&rank_state, 2);
+        break;
+    }
+    case DIST_CLUSTERED:
+    {
+        uint64_t cluster = row * args->clusters / args->rows[0];
+        uint64_t width = args->key_num / args->clusters;
+        uint64_t range = shuffle_index(cluster, args->clusters, args->shuffle_key);
+        rank = range * width + rand_below(&state, width);
+        break;
+    }
+    default:
+        break;
+    }
+
+    return 2 * rank + 2;
+}
+
+// Formats value followed by sep
+char *put_value(char *out, uint64_t value, char sep)
+{
+    char digits[MAX_LINE];
+    int n = 0;
+    do
+    {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+
+    while (n > 0)
+    {
+        *out++ = digits[--n];
+    }
+    *out++ = sep;
+    return out;
+}
+
+void *gen_batch(void *arg)
+{
+    gen_batch_t *batch = (gen_batch_t *)arg;
+    const gen_args_t *args = batch->args;
+    uint64_t rows = args->rows[batch->table];
+    uint64_t value_max = rows * 3;
+    char *out = batch->buf;
+
+    for (uint64_t row = batch->first; row < batch->last; row++)
+    {
+        uint64_t state = row_stream(args->seed, batch->table + 1, row);
+        uint64_t key;
+        if (batch->table == 0)
+        {
+            key = table1_key(args, row);
+        }
+        else
+        {
+            // The ordered and clustered distributions keep their layout in table 2 by taking the row at the same relative position
+            bool positional = args->dist >= DIST_SEQUENTIAL;
+            uint64_t source = positional ? (uint64_t)((unsigned __int128)row * args->rows[0] / rows) : rand_below(&state, args->rows[0]);
+            key = table1_key(args, source);
+            if (rand_unit(&state) >= args->match)
+                key--;
+        }
+        out = put_value(out, key, args->col_num > 1 ? ',' : '\n');
+
+        for (int c = 1; c < args->col_num; c++)
+        {
+            uint64_t value;
+            if (c == args->select_col && args->selectivity >= 0)
+                value = rand_unit(&state) < args->selectivity ? 1 + rand_below(&state, rows) : rows + 1 + rand_below(&state, value_max - rows);
+            else
+                value = 1 + rand_below(&state, value_max);
+            out = put_value(out, value, c < args->col_num - 1 ? ',' : '\n');
+        }
+    }
+
+    batch->len = out - batch->buf;
+    return NULL;
+}
+
+void write_table(const char *filename, const gen_args_t *args, int table, int thread_num)
+{
+    FILE *file = fopen(filename, "w");
+    if (!file)
+    {
+        perror("Failed to open file");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int c = 1; c <= args->col_num; c++)
+    {
+        fprintf(file, "col%d%c", c, c < args->col_num ? ',' : '\n');
+    }
+
+    pthread_t threads[thread_num];
+    gen_batch_t batches[thread_num];
+    for (int t = 0; t < thread_num; t++)
+    {
+        batches[t].args = args;
+        batches[t].table = table;
+        batches[t].buf = (char *)malloc((size_t)BATCH_ROWS * args->col_num * MAX_LINE);
+    }
+
+    // Every round formats thread_num batches in parallel, then writes them in row order
+    uint64_t rows = args->rows[table];
+    for (uint64_t first = 0; first < rows; first += (uint64_t)thread_num * BATCH_ROWS)
+    {
+        int used = 0;
+        for (int t = 0; t < thread_num && first + (uint64_t)t * BATCH_ROWS < rows; t++, used++)
+        {
+            batches[t].first = first + (uint64_t)t * BATCH_ROWS;
+            batches[t].last = batches[t].first + BATCH_ROWS < rows ? batches[t].first + BATCH_ROWS : rows;
+            pthread_create(&threads[t], NULL, gen_batch, &batches[t]);
+        }
+
+        for (int t = 0; t < used; t++)
+        {
+            pthread_join(threads[t], NULL);
+            if (fwrite(batches[t].buf, 1, batches[t].len, file) != batches[t].len)
+            {
+                perror("Failed to write file");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    for (int t = 0; t < thread_num; t++)
+    {
+        free(batches[t].buf);
+    }
+    fclose(file);
+}
+
+int main(int argc, char *argv[])
+{
+    gen_args_t args = {0};
+    args.dist = DIST_UNIQUE;
+    args.col_num = 4;
+    args.dup = 1;
+    args.match = 1.0;
+    args.disorder = 0.01;
+    args.clusters = 16;
+    args.select_col = 1;
+    args.selectivity = -1;
+    args.seed = 1;
+
+    double zipf_s = 1.0;
+    uint64_t rows = 1000000;
+    uint64_t rows2 = 0;
+    int thread_num = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *files[2] = {NULL, NULL};
+    int file_num = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc)
+            rows = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--rows2") == 0 && i + 1 < argc)
+            rows2 = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--cols") == 0 && i + 1 < argc)
+            args.col_num = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--dist") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            args.dist = DIST_NUM;
+            for (int d = 0; d < DIST_NUM; d++)
+            {
+                if (strcmp(name, dist_names[d]) == 0)
+                    args.dist = d;
+            }
+            if (args.dist == DIST_NUM)
+            {
+                fprintf(stderr, "Unknown distribution %s\n", name);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "--zipf") == 0 && i + 1 < argc)
+            zipf_s = atof(argv[++i]);
+        else if (strcmp(argv[i], "--dup") == 0 && i + 1 < argc)
+            args.dup = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--match") == 0 && i + 1 < argc)
+            args.match = atof(argv[++i]);
+        else if (strcmp(argv[i], "--disorder") == 0 && i + 1 < argc)
+            args.disorder = atof(argv[++i]);
+        else if (strcmp(argv[i], "--clusters") == 0 && i + 1 < argc)
+            args.clusters = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--select-col") == 0 && i + 1 < argc)
+        {
+            const char *col = argv[++i];
+            args.select_col = (strncmp(col, "col", 3) == 0 ? atoi(col + 3) : atoi(col)) - 1;
+        }
+        else if (strcmp(argv[i], "--selectivity") == 0 && i + 1 < argc)
+            args.selectivity = atof(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            args.seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            thread_num = atoi(argv[++i]);
+        else if (argv[i][0] != '-' && file_num < 2)
+            files[file_num++] = argv[i];
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (file_num == 0)
+    {
+        fprintf(stderr, "Usage: %s [--rows N] [--rows2 N] [--cols N] [--dist unique|uniform|zipf|sequential|sorted|nearly-sorted|clustered] "
+                        "[--zipf s] [--dup D] [--match m] [--disorder p] [--clusters C] [--select-col colN] [--selectivity s] "
+                        "[--seed S] [--threads T] <table1.csv> [<table2.csv>]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    args.rows[0] = rows;
+    args.rows[1] = rows2 > 0 ? rows2 : rows;
+    if (rows == 0 || args.col_num < 1 || args.dup < 1 || args.clusters < 1 || zipf_s <= 0 || args.match < 0 || args.match > 1 ||
+        args.disorder < 0 || args.disorder > 1 || args.selectivity > 1 || (args.selectivity >= 0 && (args.select_col < 1 || args.select_col >= args.col_num)))
+    {
+        fprintf(stderr, "Invalid options, see the usage with no table\n");
+        exit(EXIT_FAILURE);
+    }
+    if (thread_num < 1)
+        thread_num = 1;
+    if (thread_num > MAX_GEN_THREADS)
+        thread_num = MAX_GEN_THREADS;
+
+    // Every key of an ordered or unique table is held by dup rows, the others draw from as many keys
+    args.key_num = (rows + args.dup - 1) / args.dup;
+    if (args.clusters > args.key_num)
+        args.clusters = args.key_num;
+    zipf_init(&args.zipf, args.key_num, zipf_s);
+
+    args.shuffle_key = row_stream(args.seed, 4, 0);
+
+    for (int t = 0; t < file_num; t++)
+    {
+        write_table(files[t], &args, t, thread_num);
+    }
+
+    if (args.selectivity >= 0)
+        fprintf(stderr, "col%d<=%lu keeps %.3f of the rows of table 1\n", args.select_col + 1, (unsigned long)rows, args.selectivity);
+
+    return 0;
+}
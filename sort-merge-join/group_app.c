@@ -0,0 +1,252 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dpu.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "timer.h"
+#include "common.h"
+#include "user.h"
+#include "predicate.h"
+#include "zone_map.h"
+#include "schema.h"
+#include "dictionary.h"
+#include "aggregate.h"
+#include "trace.h"
+#include "executor.h"
+
+dpu_result_t dpu_result[NR_DPUS];
+
+int main(int argc, char *argv[])
+{
+    // Get file name
+    if (argc < 4)
+    {
+        fprintf(stderr, "Usage: %s <table.csv> --by colN [--where <predicate>] [--agg <functions>] [--trace <trace.json>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    const char *FILE_NAME = argv[1];
+
+    // Set variables
+    int col_num = 0;
+    uint64_t row_num = 0;
+    uint64_t total_row_num = 0;
+    T *test_array = NULL;
+    const char *trace_file = NULL;
+
+    timer_begin("csv size", TIMER_HOST);
+    set_csv_size(FILE_NAME, &col_num, &row_num);
+    timer_end();
+
+    // Without --agg the result holds the distinct keys, every row is kept by default
+    predicate_t pred = {0};
+    agg_args_t agg = {0};
+    int key_col = -1;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--by") == 0 && i + 1 < argc)
+        {
+            key_col = parse_column(argv[++i], col_num);
+            if (key_col < 0)
+            {
+                fprintf(stderr, "Unknown group column %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "--where") == 0 && i + 1 < argc)
+        {
+            if (parse_predicate(argv[++i], col_num, &pred) != 0)
+                exit(EXIT_FAILURE);
+        }
+        else if (strcmp(argv[i], "--agg") == 0 && i + 1 < argc)
+        {
+            if (parse_aggregate(argv[++i], col_num, &agg) != 0)
+                exit(EXIT_FAILURE);
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            trace_file = argv[++i];
+            trace_enable();
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (key_col < 0)
+    {
+        fprintf(stderr, "--by is required\n");
+        exit(EXIT_FAILURE);
+    }
+    agg.group_by_key = 1;
+
+    check_row_size("Select", col_num, select_wram_size(col_num));
+    check_row_size("Sort", col_num, sort_wram_size(col_num, &agg));
+
+    // String columns are dictionary encoded, codes in string order
+    dict_t dict = {0};
+    bool str_cols[col_num];
+    timer_begin("load csv", TIMER_HOST);
+    load_csv(FILE_NAME, col_num, row_num, &test_array, &dict, str_cols);
+    timer_end();
+
+    timer_begin("dictionary", TIMER_HOST);
+    int *remap = dict_sort(&dict);
+    dict_remap(remap, test_array, row_num, col_num, str_cols);
+    free(remap);
+    timer_end();
+
+    // Columns are sent to the select kernel in the narrowest width holding their values
+    schema_t schema;
+    infer_schema(test_array, row_num, col_num, &schema);
+
+    int using_dpus = row_num / NR_DPUS == 0 ? 1 : NR_DPUS;
+    uint64_t row_size = row_num / using_dpus;
+    uint64_t last_rows = row_num - (using_dpus - 1) * row_size;
+    check_mram_size("Select", using_dpus - 1, last_rows, select_mram_size(last_rows, &schema));
+
+    /* ************** */
+    /*     select     */
+    /* ************** */
+
+    // Split the table evenly, the last DPU takes the remainder
+    dpu_block_t input_args[using_dpus];
+    T *input_rows[using_dpus];
+    for (int i = 0; i < using_dpus; i++)
+    {
+        input_args[i].table_num = 0;
+        input_args[i].key_col = key_col;
+        input_args[i].col_num = col_num;
+        input_args[i].row_num = i < using_dpus - 1 ? row_size : last_rows;
+        input_rows[i] = test_array + i * row_size * col_num;
+    }
+
+    select_blocks(input_args, input_rows, dpu_result, using_dpus, &schema, &pred, NULL, -1, NULL);
+    free(test_array);
+
+    for (int i = 0; i < using_dpus; i++)
+    {
+        total_row_num += input_args[i].row_num;
+    }
+
+    T *select_array = (T *)malloc(col_num * total_row_num * sizeof(T) + sizeof(T));
+    uint64_t offset = 0;
+    for (int i = 0; i < using_dpus; i++)
+    {
+        uint64_t size = (uint64_t)dpu_result[i].row_num * col_num;
+        memcpy(select_array + offset, dpu_result[i].arr, size * sizeof(T));
+        offset += size;
+        free(dpu_result[i].arr);
+    }
+
+    /* ******************************** */
+    /*     sort & group in each DPU     */
+    /* ******************************** */
+
+    // The selected rows are spread evenly again, every DPU sorts them and collapses its groups
+    row_size = total_row_num / using_dpus;
+    last_rows = total_row_num - (using_dpus - 1) * row_size;
+    check_mram_size("Sort", using_dpus - 1, last_rows, sort_mram_size(last_rows, col_num, &agg));
+    for (int i = 0; i < using_dpus; i++)
+    {
+        input_args[i].key_col = key_col;
+        input_args[i].col_num = col_num;
+        input_args[i].row_num = i < using_dpus - 1 ? row_size : last_rows;
+        input_rows[i] = select_array + i * row_size * col_num;
+    }
+
+    sort_blocks(input_args, input_rows, dpu_result, using_dpus, &agg);
+    free(select_array);
+
+#ifdef DEBUG
+    printf("==================\n");
+    printf("#     sort.c     #\n");
+    printf("==================\n");
+
+    for (int d = 0; d < using_dpus; d++)
+    {
+        printf("DPU %d : %d groups\n", d, dpu_result[d].row_num);
+    }
+
+    printf("total_row_num: %lu\n", (unsigned long)total_row_num);
+    printf("####################\n\n");
+#endif
+
+    /* ************************ */
+    /*     merge the groups     */
+    /* ************************ */
+
+    // Equal keys of two blocks fold into one group row at every merge
+    int first_block = 0;
+    int block_count = using_dpus;
+    merge_rounds(input_args, dpu_result, 1, &first_block, &block_count, 1, &agg);
+
+    int out_col = dpu_result[0].col_num;
+    int group_num = dpu_result[0].row_num;
+
+#ifdef DEBUG
+    printf("==================\n");
+    printf("#     merge.c    #\n");
+    printf("==================\n");
+
+    printf("%d groups of %lu rows\n", group_num, (unsigned long)total_row_num);
+    printf("####################\n\n");
+#endif
+
+    // save result as csv file
+    timer_begin("write result", TIMER_HOST);
+    FILE *file = fopen("./data/result.csv", "w");
+    if (!file)
+    {
+        perror("Failed to open file");
+        exit(EXIT_FAILURE);
+    }
+
+    // The key, and the minimum or maximum of a string column, are written as strings
+    bool str_out[out_col];
+    str_out[0] = str_cols[key_col];
+    for (int f = 0; f < agg.func_num; f++)
+    {
+        str_out[1 + f] = (agg.funcs[f] == AGG_MIN || agg.funcs[f] == AGG_MAX) && str_cols[agg.cols[f]];
+    }
+
+    write_agg_header(file, &agg, &key_col, 1);
+    for (int i = 0; i < group_num; i++)
+    {
+        for (int j = 0; j < out_col; j++)
+        {
+            write_value(file, &dict, str_out[j], dpu_result[0].arr[i * out_col + j]);
+            if (j < out_col - 1)
+            {
+                fprintf(file, ",");
+            }
+        }
+        fprintf(file, "\n");
+    }
+
+    fclose(file);
+    timer_end();
+    free(dpu_result[0].arr);
+    dict_free(&dict);
+
+    printf("\n");
+    printf("######### PIM #########\n");
+    printf("###  SORT GROUP BY  ###\n");
+    printf("         EXEC TIME     \n");
+    printf("CPU-DPU  %f\n", timer_class_total(TIMER_CPU_DPU));
+    printf("DPU      %f\n", timer_class_total(TIMER_DPU));
+    printf("DPU-CPU  %f\n", timer_class_total(TIMER_DPU_CPU));
+    printf("-----------------------\n");
+    printf("TOTAL %f\n", timer_class_total(TIMER_CPU_DPU) + timer_class_total(TIMER_DPU) + timer_class_total(TIMER_DPU_CPU));
+    printf("#######################\n\n");
+
+    stats_print();
+    timer_print();
+
+    if (trace_file != NULL)
+        trace_write(trace_file);
+
+    return 0;
+}
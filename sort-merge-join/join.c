@@ -7,52 +7,196 @@
 #include <alloc.h>
 #include "common.h"
 #include "user.h"
+#include "dpu_io.h"
+#include "dpu_topk.h"
 
-#include <mutex.h>
+#define MERGE_WAYS MAX_JOIN_RUNS
+#include "dpu_merge.h"
 
-int using_tasklets = NR_TASKLETS;
+// Bytes of the WRAM tile over each input and of the output buffer of a tasklet
+#define WINDOW_SIZE (CACHE_SIZE / 2)
+#define OUTPUT_SIZE CACHE_SIZE
+
+// Bytes of the output buffer of a tasklet while it merges runs
+#define RUN_OUTPUT_SIZE (CACHE_SIZE / 4)
 
-MUTEX_INIT(my_mutex);
 BARRIER_INIT(my_barrier, NR_TASKLETS);
 
-uint32_t addr[NR_TASKLETS];
-int rows[NR_TASKLETS];
-int used_idx[NR_TASKLETS];
-int used_rows[NR_TASKLETS];
-int joined_rows[NR_TASKLETS];
+int end_rows1[NR_TASKLETS];
+int end_rows2[NR_TASKLETS];
+
+// Private output region of each tasklet past the result area, its capacity and the rows written to it,
+// the prefix sum of those rows places the output of the tasklets in key order
+uint32_t region_addr[NR_TASKLETS];
+int region_rows[NR_TASKLETS];
+int output_rows[NR_TASKLETS];
 
 __host dpu_block_t bl1;
 __host dpu_block_t bl2;
+
+// Sorted runs of both tables, each table arrives as run_num[t] slices of run_rows[t][r] rows back to back
+__host int run_num[2];
+__host int run_rows[2][MAX_JOIN_RUNS];
+
+int run_splits[NR_TASKLETS + 1][MAX_JOIN_RUNS];
 __host int joined_row;
+__host int max_joined_row;
+
+// Offset of the result area, the same on every DPU so the host gathers all results in one transfer
+__host uint32_t result_offset;
+
+// Aggregation over the joined rows, a global aggregation leaves its result in agg_result
+__host agg_args_t agg;
+__host T agg_result[MAX_AGG_FUNCS];
+
+T partial_aggs[NR_TASKLETS][MAX_AGG_FUNCS];
+int partial_runs[NR_TASKLETS];
+
+// ORDER BY ... LIMIT over the joined rows, the host reads only the first topk.row_num rows
+__host topk_args_t topk;
 
-// Find matched index or lower bound index
-int binary_search(uint32_t base_addr, int col_num, int row_num, T target)
+// Writes the buffered rows with a single DMA
+void join_flush(row_writer_t *wr)
 {
-    int left = 0;
-    int right = row_num - 1;
-    int idx = -1;
+    // Never write past the private region of the tasklet, it holds every row the host counted
+    unsigned int tasklet_id = me();
+    int pos = (wr->addr - region_addr[tasklet_id]) / wr->row_size;
+    if (region_rows[tasklet_id] - pos < wr->rows)
+        wr->rows = region_rows[tasklet_id] - pos > 0 ? region_rows[tasklet_id] - pos : 0;
+
+    writer_flush(wr);
+}
+
+// Appends the joined row of row1 and row2
+void join_emit(row_writer_t *wr, T *row1, int col_num1, T *row2, int col_num2)
+{
+    T *merge_row = writer_slot(wr);
 
-    T *mid_row = (T *)mem_alloc(col_num * sizeof(T));
-    while (left <= right)
+    int cur_col = 0;
+    for (int c = 0; c < col_num1; c++)
+    {
+        merge_row[cur_col] = row1[c];
+        cur_col++;
+    }
+    for (int c = 0; c < col_num2; c++)
     {
-        int mid = (left + right) / 2;
+        if (c == bl2.key_col)
+        {
+            continue;
+        }
+
+        merge_row[cur_col] = row2[c];
+        cur_col++;
+    }
+
+    if (writer_commit(wr))
+        join_flush(wr);
+}
 
-        mram_read((__mram_ptr void *)(base_addr + mid * col_num * sizeof(T)), mid_row, col_num * sizeof(T));
+// Aggregates the cross product of two equal-key runs without building it
+// Every row of one run meets every row of the other, so a sum is the run sum times the other run length
+// and a minimum or maximum is the one of the run holding the column
+void run_aggregate(block_cache_t *w1, int start1, int end1, block_cache_t *w2, int start2, int end2, T *vals)
+{
+    int col_num1 = w1->col_num;
+    T n1 = end1 - start1;
+    T n2 = end2 - start2;
 
-        if (mid_row[JOIN_KEY2] == target)
-            return mid;
-        else if (mid_row[JOIN_KEY2] < target)
+    for (int f = 0; f < agg.func_num; f++)
+    {
+        int col = agg.cols[f];
+        int first = col < col_num1;
+        block_cache_t *w = first ? w1 : w2;
+        int start = first ? start1 : start2;
+        int end = first ? end1 : end2;
+
+        // Columns of table 2 follow those of table 1 in the joined row, without its key
+        if (!first)
         {
-            idx = mid;
-            left = mid + 1;
+            col -= col_num1;
+            if (col >= bl2.key_col)
+                col++;
         }
-        else
+
+        if (agg.funcs[f] == AGG_COUNT)
         {
-            right = mid - 1;
+            vals[f] = n1 * n2;
+            continue;
         }
+
+        T acc = cache_row(w, start)[col];
+        for (int r = start + 1; r < end; r++)
+            acc = agg_fold(agg.funcs[f], acc, cache_row(w, r)[col]);
+
+        vals[f] = agg.funcs[f] == AGG_SUM ? acc * (first ? n2 : n1) : acc;
     }
+}
 
-    return idx;
+// Merges the runs of both tables at out_addr, table 2 right after table 1
+// Every tasklet produces an even slice of each table, its tiles and buffers are dropped afterwards
+void merge_runs(unsigned int tasklet_id, uint32_t in_addr, uint32_t out_addr)
+{
+    int max_runs = run_num[0] > run_num[1] ? run_num[0] : run_num[1];
+    int max_row_size = (bl1.col_num > bl2.col_num ? bl1.col_num : bl2.col_num) * sizeof(T);
+
+    // Every run gets a share of the tile bytes, at least one row
+    int tile_size = (RUN_TILE_SIZE / max_runs) & ~7;
+    if (tile_size < max_row_size)
+        tile_size = max_row_size;
+
+    block_cache_t *ways = (block_cache_t *)mem_alloc(max_runs * sizeof(block_cache_t));
+    for (int r = 0; r < max_runs; r++)
+    {
+        cache_init(&ways[r], in_addr, bl1.col_num, 0, tile_size);
+    }
+    merge_state_t *st = (merge_state_t *)mem_alloc(sizeof(merge_state_t));
+    int output_size = RUN_OUTPUT_SIZE < max_row_size ? max_row_size : RUN_OUTPUT_SIZE;
+    row_writer_t writer;
+    writer_init(&writer, out_addr, bl1.col_num, output_size);
+
+    for (int t = 0; t < 2; t++)
+    {
+        dpu_block_t *bl = t == 0 ? &bl1 : &bl2;
+        int row_size = bl->col_num * sizeof(T);
+
+        for (int r = 0; r < run_num[t]; r++)
+        {
+            cache_attach(&ways[r], in_addr, bl->col_num, run_rows[t][r], tile_size);
+            in_addr += run_rows[t][r] * row_size;
+        }
+        st->way_num = run_num[t];
+        st->key_col = bl->key_col;
+
+        int out_per_tasklet = bl->row_num / NR_TASKLETS;
+        int remain_rows = bl->row_num % NR_TASKLETS;
+        int out_start = tasklet_id * out_per_tasklet + (tasklet_id < remain_rows ? tasklet_id : remain_rows);
+
+        merge_split(st, ways, out_start, run_splits[tasklet_id]);
+        if (tasklet_id == NR_TASKLETS - 1)
+        {
+            for (int r = 0; r < run_num[t]; r++)
+            {
+                run_splits[NR_TASKLETS][r] = run_rows[t][r];
+            }
+        }
+
+        // Barrier
+        stats_barrier_wait(tasklet_id, &my_barrier);
+
+        writer_attach(&writer, out_addr + out_start * row_size, bl->col_num, output_size);
+        int slice_rows = merge_start(st, ways, run_splits[tasklet_id], run_splits[tasklet_id + 1]);
+        for (int i = 0; i < slice_rows; i++)
+        {
+            // The row is consumed before its run moves on
+            writer_append(&writer, merge_top(st, ways));
+            merge_pop(st, ways);
+        }
+        writer_flush(&writer);
+        out_addr += bl->row_num * row_size;
+
+        // Barrier
+        stats_barrier_wait(tasklet_id, &my_barrier);
+    }
 }
 
 int main()
@@ -63,204 +207,310 @@ int main()
 
     // Initialize variables
     unsigned int tasklet_id = me();
+    stats_start(tasklet_id);
     int col_num1 = bl1.col_num;
     int col_num2 = bl2.col_num;
     int row_num1 = bl1.row_num;
     int row_num2 = bl2.row_num;
     int one_row_size1 = col_num1 * sizeof(T);
     int one_row_size2 = col_num2 * sizeof(T);
-    uint32_t mram_base_addr_dpu2 = (uint32_t)DPU_MRAM_HEAP_POINTER + row_num1 * one_row_size1;
+    int total_col = col_num1 + col_num2 - 1;
+    uint32_t heap_addr = (uint32_t)DPU_MRAM_HEAP_POINTER;
+    uint32_t mram_base_addr_dpu1 = heap_addr;
 
-    // Calculate the number of rows to process per tasklet
-    int row_per_tasklet = row_num1 / NR_TASKLETS;
-    if (row_per_tasklet == 0)
-        using_tasklets = 1;
+    // Runs are merged after the inputs, the heap is empty again once every tasklet is done with them
+    if (run_num[0] > 1 || run_num[1] > 1)
+    {
+        mram_base_addr_dpu1 = heap_addr + row_num1 * one_row_size1 + row_num2 * col_num2 * sizeof(T);
+        merge_runs(tasklet_id, heap_addr, mram_base_addr_dpu1);
 
-    // Calculate the chunk size and offset from the base address
-    int chunk_size = row_per_tasklet * col_num1;
-    int start = tasklet_id * chunk_size;
-    if (tasklet_id == using_tasklets - 1)
+        if (tasklet_id == 0)
+            mem_reset();
+
+        // Barrier
+        stats_barrier_wait(tasklet_id, &my_barrier);
+    }
+    uint32_t mram_base_addr_dpu2 = mram_base_addr_dpu1 + row_num1 * one_row_size1;
+
+    // A grouped aggregation writes the key and the aggregates of each run instead of the joined rows
+    int out_col = agg.func_num == 0 ? total_col : 1 + agg.func_num;
+    int out_row_size = out_col * sizeof(T);
+
+    // Initialize the tiles over both inputs and the output buffer, each holds at least one row,
+    // the windows take a quarter and the output half of what the tasklet heap leaves past those rows
+    int spare = TASKLET_HEAP_SIZE - join_wram_size(col_num1, col_num2, out_col);
+    block_cache_t window1, window2;
+    cache_init(&window1, mram_base_addr_dpu1, col_num1, row_num1, tile_fit(WINDOW_SIZE, one_row_size1, spare / 4));
+    cache_init(&window2, mram_base_addr_dpu2, col_num2, row_num2, tile_fit(WINDOW_SIZE, one_row_size2, spare / 4));
+
+    row_writer_t writer;
+    writer_init(&writer, heap_addr + result_offset, out_col, tile_fit(OUTPUT_SIZE, out_row_size, spare / 2));
+    T *run_vals = (T *)mem_alloc(MAX_AGG_FUNCS * sizeof(T));
+    partial_runs[tasklet_id] = 0;
+    uint32_t result_addr = writer.addr;
+
+    /* ***************** */
+    /*     Partition     */
+    /* ***************** */
+
+    // Each tasklet takes an even slice of table 1, extended to the end of its last key run,
+    // so equal keys never straddle two tasklets
+    int row_per_tasklet = row_num1 / NR_TASKLETS;
+    int remain_rows = row_num1 % NR_TASKLETS;
+    int end1 = (tasklet_id + 1) * row_per_tasklet + (tasklet_id + 1 < remain_rows ? tasklet_id + 1 : remain_rows);
+    if (tasklet_id < NR_TASKLETS - 1 && end1 > 0)
     {
-        row_per_tasklet = row_num1 - (using_tasklets - 1) * row_per_tasklet;
-        chunk_size = row_per_tasklet * col_num1;
+        T last_key = cache_key(&window1, end1 - 1, bl1.key_col);
+        end1 = cache_gallop(&window1, bl1.key_col, end1, row_num1, last_key, 1);
     }
+    end_rows1[tasklet_id] = end1;
 
-    // Initialize the start address
-    uint32_t mram_base_addr = (uint32_t)DPU_MRAM_HEAP_POINTER + start * sizeof(T);
-
-    // Save the address and the number of rows
-    addr[tasklet_id] = mram_base_addr;
-    rows[tasklet_id] = row_per_tasklet;
+    // Barrier
+    stats_barrier_wait(tasklet_id, &my_barrier);
 
-    /* ********************* */
-    /*     Binary search     */
-    /* ********************* */
+    int start1 = tasklet_id == 0 ? 0 : end_rows1[tasklet_id - 1];
 
-    if (using_tasklets == 1)
+    // Table 2 is split after the last key of each slice, an empty slice takes no rows
+    int end2 = -1;
+    if (tasklet_id == NR_TASKLETS - 1)
     {
-        used_idx[0] = row_num2 - 1;
+        end2 = row_num2;
     }
-    else
+    else if (end1 > start1)
     {
-        // Load the last row
-        T *last_row = (T *)mem_alloc(one_row_size1);
-        mram_read((__mram_ptr void *)(mram_base_addr + (row_per_tasklet - 1) * one_row_size1), last_row, one_row_size1);
+        T last_key = cache_key(&window1, end1 - 1, bl1.key_col);
+        end2 = cache_gallop(&window2, bl2.key_col, 0, row_num2, last_key, 1);
+    }
+    end_rows2[tasklet_id] = end2;
 
-        // Find the index
-        if (tasklet_id < using_tasklets - 1)
-        {
-            used_idx[tasklet_id] = binary_search(mram_base_addr_dpu2, col_num2, row_num2, last_row[JOIN_KEY1]);
-        }
-        else
-        {
-            used_idx[tasklet_id] = row_num2 - 1;
-        }
+    // Barrier
+    stats_barrier_wait(tasklet_id, &my_barrier);
+
+    int start2 = 0;
+    for (int t = 0; t < tasklet_id; t++)
+    {
+        if (end_rows2[t] >= 0)
+            start2 = end_rows2[t];
     }
+    if (end2 < start2)
+        end2 = start2;
+
+    // Each tasklet joins its slices once into a private region past the result area, which holds at most
+    // the rows the host counted for the DPU and the rows the slices can produce, one per key run when grouped
+    // A global aggregation writes no rows
+    // A slice covered by the key run of the slice before it is empty
+    uint64_t slice_rows1 = end1 > start1 ? end1 - start1 : 0;
+    uint64_t slice_rows2 = end2 - start2;
+    uint64_t bound = agg.func_num == 0 ? slice_rows1 * slice_rows2 : (slice_rows1 < slice_rows2 ? slice_rows1 : slice_rows2);
+    if (agg.func_num > 0 && !agg.group_by_key)
+        bound = 0;
+    region_rows[tasklet_id] = bound < (uint64_t)max_joined_row ? (int)bound : max_joined_row;
 
     // Barrier
-    barrier_wait(&my_barrier);
+    stats_barrier_wait(tasklet_id, &my_barrier);
+
+    uint32_t region = result_addr + max_joined_row * writer.row_size;
+    for (int t = 0; t < tasklet_id; t++)
+    {
+        region += region_rows[t] * writer.row_size;
+    }
+    region_addr[tasklet_id] = region;
+    writer.addr = region;
 
     /* ************ */
     /*     Join     */
     /* ************ */
 
-    // Initialize the index
-    int start_idx = tasklet_id == 0 ? 0 : used_idx[tasklet_id - 1] + 1;
-    int end_idx = used_idx[tasklet_id];
-    int total_col = col_num1 + col_num2 - 1;
-
-    // Initialize local caches
-    T *first_row = (T *)mem_alloc(total_col * sizeof(T));
-    T *second_row = (T *)mem_alloc(total_col * sizeof(T));
-    T *merge_row = (T *)mem_alloc(total_col * sizeof(T));
-
-    // Save the number of rows
-    used_rows[tasklet_id] = end_idx - start_idx + 1;
+    int cur_idx1 = start1;
+    int cur_idx2 = start2;
 
-    // Initialize the current index and addresses
-    int cur_idx1 = 0;
-    int cur_idx2 = 0;
-    uint32_t first_addr = addr[tasklet_id];
-    uint32_t second_addr = mram_base_addr_dpu2 + start_idx * one_row_size2;
-    uint32_t res_addr = (uint32_t)DPU_MRAM_HEAP_POINTER + (row_num1 * col_num1 + row_num2 * col_num2) * sizeof(T);
-
-    // Load the rows
-    mram_read((__mram_ptr void *)(first_addr + cur_idx1 * one_row_size1), first_row, one_row_size1);
-    mram_read((__mram_ptr void *)(second_addr + cur_idx2 * one_row_size2), second_row, one_row_size2);
-
-    // Caculate the number of joined rows
-    int cur_row_idx = 0;
-    while (cur_idx1 < rows[tasklet_id] && cur_idx2 < used_rows[tasklet_id])
+    while (cur_idx1 < end1 && cur_idx2 < end2)
     {
-        if (using_tasklets == 1 && tasklet_id != 0)
+        T key1 = cache_key(&window1, cur_idx1, bl1.key_col);
+        T key2 = cache_key(&window2, cur_idx2, bl2.key_col);
+
+        // Skip non-matching stretches by galloping on the keys only
+        if (key1 < key2)
         {
-            break;
+            cur_idx1 = cache_gallop(&window1, bl1.key_col, cur_idx1 + 1, end1, key2, 0);
+            continue;
         }
-
-        if (first_row[JOIN_KEY1] == second_row[JOIN_KEY2])
+        if (key1 > key2)
         {
-            cur_idx1++;
-            cur_idx2++;
-            cur_row_idx++;
+            cur_idx2 = cache_gallop(&window2, bl2.key_col, cur_idx2 + 1, end2, key1, 0);
+            continue;
         }
-        else if (first_row[JOIN_KEY1] < second_row[JOIN_KEY2])
+
+        // Find the equal-key run on both sides
+        int run_end1 = cache_gallop(&window1, bl1.key_col, cur_idx1 + 1, end1, key1, 1);
+        int run_end2 = cache_gallop(&window2, bl2.key_col, cur_idx2 + 1, end2, key2, 1);
+
+        if (agg.func_num > 0)
         {
-            cur_idx1++;
+            run_aggregate(&window1, cur_idx1, run_end1, &window2, cur_idx2, run_end2, run_vals);
+
+            if (agg.group_by_key)
+            {
+                T *group_row = writer_slot(&writer);
+                group_row[0] = key1;
+                memcpy(group_row + 1, run_vals, agg.func_num * sizeof(T));
+                if (writer_commit(&writer))
+                    join_flush(&writer);
+            }
+            else
+            {
+                for (int f = 0; f < agg.func_num; f++)
+                {
+                    T *acc = &partial_aggs[tasklet_id][f];
+                    *acc = partial_runs[tasklet_id] == 0 ? run_vals[f] : agg_fold(agg.funcs[f], *acc, run_vals[f]);
+                }
+                partial_runs[tasklet_id]++;
+            }
+
+            cur_idx1 = run_end1;
+            cur_idx2 = run_end2;
+            continue;
         }
-        else
+
+        // The smaller run is held in its window, chunk by chunk, and the larger one is streamed once per chunk
+        int small_is_first = run_end1 - cur_idx1 <= run_end2 - cur_idx2;
+        block_cache_t *small = small_is_first ? &window1 : &window2;
+        block_cache_t *large = small_is_first ? &window2 : &window1;
+        int small_start = small_is_first ? cur_idx1 : cur_idx2;
+        int small_end = small_is_first ? run_end1 : run_end2;
+        int large_start = small_is_first ? cur_idx2 : cur_idx1;
+        int large_end = small_is_first ? run_end2 : run_end1;
+
+        for (int c = small_start; c < small_end; c += small->cap_rows)
         {
-            cur_idx2++;
+            int rows = small_end - c < small->cap_rows ? small_end - c : small->cap_rows;
+            if (c < small->start || c + rows > small->start + small->rows)
+                cache_fill(small, c);
+
+            for (int l = large_start; l < large_end; l++)
+            {
+                T *large_row = cache_row(large, l);
+
+                for (int s = c; s < c + rows; s++)
+                {
+                    T *small_row = small->buf + (s - small->start) * small->col_num;
+                    if (small_is_first)
+                        join_emit(&writer, small_row, col_num1, large_row, col_num2);
+                    else
+                        join_emit(&writer, large_row, col_num1, small_row, col_num2);
+                }
+            }
         }
 
-        mram_read((__mram_ptr void *)(first_addr + cur_idx1 * one_row_size1), first_row, one_row_size1);
-        mram_read((__mram_ptr void *)(second_addr + cur_idx2 * one_row_size2), second_row, one_row_size2);
+        cur_idx1 = run_end1;
+        cur_idx2 = run_end2;
     }
 
-    joined_rows[tasklet_id] = cur_row_idx;
+    // Flush the remaining rows
+    join_flush(&writer);
+    output_rows[tasklet_id] = (writer.addr - region) / writer.row_size;
 
     // Barrier
-    barrier_wait(&my_barrier);
-
-    // Calculate the offset
-    int local_offset = 0;
-    for (int t = 0; t < tasklet_id; t++)
+    stats_barrier_wait(tasklet_id, &my_barrier);
+
+    /* *************** */
+    /*     Compact     */
+    /* *************** */
+
+    // Move the private region after the rows of the tasklets before it, the regions lie past the result area
+    // so no row is overwritten before it is moved. The result area never takes more rows than the host counted,
+    // the host checks joined_row
+    int output_offset = 0;
+    int total_rows = 0;
+    for (int t = 0; t < NR_TASKLETS; t++)
     {
-        local_offset += joined_rows[t];
+        if (t < tasklet_id)
+            output_offset += output_rows[t];
+        total_rows += output_rows[t];
     }
 
-    res_addr += local_offset * total_col * sizeof(T);
-    int write_idx = 0;
+    int move_rows = output_rows[tasklet_id];
+    if (max_joined_row - output_offset < move_rows)
+        move_rows = max_joined_row - output_offset > 0 ? max_joined_row - output_offset : 0;
 
-    cur_idx1 = 0;
-    cur_idx2 = 0;
+    uint32_t output_addr = result_addr + output_offset * writer.row_size;
+    stats_begin(tasklet_id);
+    for (int r = 0; r < move_rows; r += writer.cap_rows)
+    {
+        int rows = move_rows - r < writer.cap_rows ? move_rows - r : writer.cap_rows;
+        mram_read((__mram_ptr void const *)(region + r * writer.row_size), writer.buf, rows * writer.row_size);
+        mram_write(writer.buf, (__mram_ptr void *)(output_addr + r * writer.row_size), rows * writer.row_size);
+    }
+    stats_end(tasklet_id, PHASE_WRITE);
 
     // Barrier
-    barrier_wait(&my_barrier);
+    stats_barrier_wait(tasklet_id, &my_barrier);
 
-    // Load the rows
-    mram_read((__mram_ptr void *)(first_addr + cur_idx1 * one_row_size1), first_row, one_row_size1);
-    mram_read((__mram_ptr void *)(second_addr + cur_idx2 * one_row_size2), second_row, one_row_size2);
+    /* ************* */
+    /*     Top-K     */
+    /* ************* */
 
-    // Join
-    while (cur_idx1 < rows[tasklet_id] && cur_idx2 < used_rows[tasklet_id])
+    // The joined rows are ranked where they were written, each tasklet takes an even slice of them
+    // and the last tasklet writes the best ones at the offset the host chose
+    if (topk.k > 0)
     {
-        if (using_tasklets == 1 && tasklet_id != 0)
+        int rows = total_rows < max_joined_row ? total_rows : max_joined_row;
+        int rank_per_tasklet = rows / NR_TASKLETS;
+        int rank_remain = rows % NR_TASKLETS;
+        int rank_start = tasklet_id * rank_per_tasklet + (tasklet_id < rank_remain ? tasklet_id : rank_remain);
+        int rank_end = rank_start + rank_per_tasklet + (tasklet_id < rank_remain ? 1 : 0);
+
+        // The output buffer is empty after the last flush and holds one tile of the slice at a time
+        topk_size[tasklet_id] = 0;
+        for (int r = rank_start; r < rank_end; r += writer.cap_rows)
         {
-            break;
-        }
-
-        if (first_row[JOIN_KEY1] == second_row[JOIN_KEY2])
-        {
-            int cur_col = 0;
-            for (int c = 0; c < col_num1; c++)
-            {
-                merge_row[cur_col] = first_row[c];
-                cur_col++;
-            }
-            for (int c = 0; c < col_num2; c++)
+            int tile_rows = rank_end - r < writer.cap_rows ? rank_end - r : writer.cap_rows;
+            stats_begin(tasklet_id);
+            mram_read((__mram_ptr void const *)(result_addr + r * writer.row_size), writer.buf, tile_rows * writer.row_size);
+            stats_end(tasklet_id, PHASE_LOAD);
+            for (int i = 0; i < tile_rows; i++)
             {
-                if (c == JOIN_KEY2)
-                {
-                    continue;
-                }
-
-                merge_row[cur_col] = second_row[c];
-                cur_col++;
+                topk_push(&topk, tasklet_id, writer.buf[i * out_col + topk.col], r + i);
             }
+        }
 
-            mram_write(merge_row, (__mram_ptr void *)(res_addr + write_idx * total_col * sizeof(T)), total_col * sizeof(T));
+        // Barrier
+        stats_barrier_wait(tasklet_id, &my_barrier);
 
-            cur_idx1++;
-            cur_idx2++;
-            write_idx++;
-        }
-        else if (first_row[JOIN_KEY1] < second_row[JOIN_KEY2])
-        {
-            cur_idx1++;
-        }
-        else
+        if (tasklet_id == NR_TASKLETS - 1)
         {
-            cur_idx2++;
+            topk.row_num = topk_reduce(&topk, tasklet_id);
+            writer.addr = heap_addr + topk.out_offset;
+            topk_write(tasklet_id, topk.row_num, result_addr, NULL, &writer);
         }
-
-        mram_read((__mram_ptr void *)(first_addr + cur_idx1 * one_row_size1), first_row, one_row_size1);
-        mram_read((__mram_ptr void *)(second_addr + cur_idx2 * one_row_size2), second_row, one_row_size2);
     }
 
-    // Barrier
-    barrier_wait(&my_barrier);
-
     // Update the joined row
-    if (tasklet_id == using_tasklets - 1)
+    // The partials of a global aggregation are reduced in WRAM into a single row
+    if (tasklet_id == NR_TASKLETS - 1)
     {
-        for (int t = 0; t < using_tasklets; t++)
+        joined_row = total_rows;
+
+        if (agg.func_num > 0 && !agg.group_by_key)
         {
-            joined_row += joined_rows[t];
+            int runs = 0;
+            for (int t = 0; t < NR_TASKLETS; t++)
+            {
+                if (partial_runs[t] == 0)
+                    continue;
+
+                for (int f = 0; f < agg.func_num; f++)
+                    agg_result[f] = runs == 0 ? partial_aggs[t][f] : agg_fold(agg.funcs[f], agg_result[f], partial_aggs[t][f]);
+                runs += partial_runs[t];
+            }
+
+            joined_row = runs > 0 ? 1 : 0;
         }
     }
 
     // Reset the heap
     mem_reset();
 
+    stats_stop(tasklet_id);
     return 0;
-}
\ No newline at end of file
+}
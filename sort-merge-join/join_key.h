@@ -0,0 +1,214 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Host-side composite join keys
+ *
+ * A join on up to MAX_KEY_COLS columns of each table becomes a join on one column appended
+ * to the selected rows of both tables, so the sort, merge and join kernels keep comparing
+ * a single T per row. The key preserves the order of the columns, first column first:
+ *   - when the column ranges of both tables fit in 63 bits together, every column minus its
+ *     minimum takes a bit field of the key, the first column in the highest bits
+ *   - otherwise the key is the rank of the columns among the distinct keys of both tables
+ * Either way a key decodes back into its columns for the grouped results.
+ */
+
+#define MAX_KEY_COLS 4
+
+// Columns of one key, unused columns are 0 so keys compare on all MAX_KEY_COLS
+typedef struct
+{
+    T vals[MAX_KEY_COLS];
+} key_tuple_t;
+
+typedef struct
+{
+    int key_num;
+    bool packed;
+    T min[MAX_KEY_COLS];
+    int shift[MAX_KEY_COLS];
+    // Distinct keys in order when the key is a rank
+    key_tuple_t *dict;
+    uint64_t dict_num;
+} key_codec_t;
+
+// Parses a comma separated list of 1-based columns, "col1,col3", returns the number of columns or -1
+int parse_key_cols(const char *str, int col_num, int *cols)
+{
+    char buf[128];
+    int key_num = 0;
+
+    if (strlen(str) >= sizeof(buf))
+        return -1;
+    strcpy(buf, str);
+
+    for (char *token = strtok(buf, ","); token; token = strtok(NULL, ","))
+    {
+        if (key_num == MAX_KEY_COLS)
+        {
+            fprintf(stderr, "Join key \"%s\": more than %d columns\n", str, MAX_KEY_COLS);
+            return -1;
+        }
+
+        cols[key_num] = parse_column(token, col_num);
+        if (cols[key_num] < 0)
+        {
+            fprintf(stderr, "Join key \"%s\": unknown column %s\n", str, token);
+            return -1;
+        }
+        key_num++;
+    }
+
+    return key_num > 0 ? key_num : -1;
+}
+
+int key_tuple_cmp(const void *a, const void *b)
+{
+    const key_tuple_t *x = (const key_tuple_t *)a;
+    const key_tuple_t *y = (const key_tuple_t *)b;
+
+    for (int c = 0; c < MAX_KEY_COLS; c++)
+    {
+        if (x->vals[c] != y->vals[c])
+            return x->vals[c] < y->vals[c] ? -1 : 1;
+    }
+
+    return 0;
+}
+
+// Key columns of a row
+key_tuple_t key_tuple(const T *row, const int *cols, int key_num)
+{
+    key_tuple_t tuple = {{0}};
+    for (int c = 0; c < key_num; c++)
+    {
+        tuple.vals[c] = row[cols[c]];
+    }
+
+    return tuple;
+}
+
+// Picks the key of both tables, cols[t] are the key_num key columns of table t
+void build_key_codec(key_codec_t *codec, int key_num, T *const rows[2], const uint64_t row_num[2], const int col_num[2], const int cols[2][MAX_KEY_COLS])
+{
+    codec->key_num = key_num;
+    codec->dict = NULL;
+    codec->dict_num = 0;
+
+    T max[MAX_KEY_COLS];
+    bool found = false;
+    for (int t = 0; t < 2; t++)
+    {
+        for (uint64_t r = 0; r < row_num[t]; r++)
+        {
+            const T *row = rows[t] + r * col_num[t];
+            for (int c = 0; c < key_num; c++)
+            {
+                T val = row[cols[t][c]];
+                if (!found || val < codec->min[c])
+                    codec->min[c] = val;
+                if (!found || val > max[c])
+                    max[c] = val;
+            }
+            found = true;
+        }
+    }
+
+    // Bit field widths of the columns, the last column in the lowest bits
+    int total_bits = 0;
+#if defined(DOUBLE)
+    total_bits = 64;
+#else
+    for (int c = key_num - 1; c >= 0 && found; c--)
+    {
+        uint64_t range = (uint64_t)(max[c] - codec->min[c]);
+        int bits = 0;
+        while (bits < 64 && (range >> bits) != 0)
+            bits++;
+
+        codec->shift[c] = total_bits;
+        total_bits += bits;
+    }
+#endif
+
+    codec->packed = total_bits <= 63;
+    if (codec->packed)
+        return;
+
+    // Dictionary of the distinct keys of both tables
+    codec->dict = (key_tuple_t *)malloc((row_num[0] + row_num[1]) * sizeof(key_tuple_t) + sizeof(key_tuple_t));
+    for (int t = 0; t < 2; t++)
+    {
+        for (uint64_t r = 0; r < row_num[t]; r++)
+        {
+            codec->dict[codec->dict_num++] = key_tuple(rows[t] + r * col_num[t], cols[t], key_num);
+        }
+    }
+    qsort(codec->dict, codec->dict_num, sizeof(key_tuple_t), key_tuple_cmp);
+
+    uint64_t distinct = 0;
+    for (uint64_t i = 0; i < codec->dict_num; i++)
+    {
+        if (distinct == 0 || key_tuple_cmp(&codec->dict[distinct - 1], &codec->dict[i]) != 0)
+            codec->dict[distinct++] = codec->dict[i];
+    }
+    codec->dict_num = distinct;
+}
+
+// Key of the columns cols of a row
+T encode_key(const key_codec_t *codec, const T *row, const int *cols)
+{
+#if !defined(DOUBLE)
+    if (codec->packed)
+    {
+        uint64_t key = 0;
+        for (int c = 0; c < codec->key_num; c++)
+        {
+            key |= (uint64_t)(row[cols[c]] - codec->min[c]) << codec->shift[c];
+        }
+        return (T)key;
+    }
+#endif
+
+    key_tuple_t tuple = key_tuple(row, cols, codec->key_num);
+    key_tuple_t *found = (key_tuple_t *)bsearch(&tuple, codec->dict, codec->dict_num, sizeof(key_tuple_t), key_tuple_cmp);
+    return (T)(found - codec->dict);
+}
+
+// Writes the key_num columns of a key to vals
+void decode_key(const key_codec_t *codec, T key, T *vals)
+{
+#if !defined(DOUBLE)
+    if (codec->packed)
+    {
+        for (int c = 0; c < codec->key_num; c++)
+        {
+            int next_shift = c > 0 ? codec->shift[c - 1] : 64;
+            uint64_t mask = next_shift - codec->shift[c] >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << (next_shift - codec->shift[c])) - 1;
+            vals[c] = codec->min[c] + (T)(((uint64_t)key >> codec->shift[c]) & mask);
+        }
+        return;
+    }
+#endif
+
+    memcpy(vals, codec->dict[(uint64_t)key].vals, codec->key_num * sizeof(T));
+}
+
+// Returns the rows with their key appended as a last column, the caller frees them
+T *append_key(const key_codec_t *codec, const T *rows, uint64_t row_num, int col_num, const int *cols)
+{
+    T *keyed = (T *)malloc(row_num * (col_num + 1) * sizeof(T) + sizeof(T));
+
+    for (uint64_t r = 0; r < row_num; r++)
+    {
+        const T *row = rows + r * col_num;
+        T *out = keyed + r * (col_num + 1);
+        memcpy(out, row, col_num * sizeof(T));
+        out[col_num] = encode_key(codec, row, cols);
+    }
+
+    return keyed;
+}
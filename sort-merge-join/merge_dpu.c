@@ -8,49 +8,21 @@
 #include <alloc.h>
 #include "common.h"
 #include "user.h"
+#include "dpu_io.h"
+#include "dpu_merge.h"
+
+// Bytes of the output buffer of a tasklet
+#define OUTPUT_SIZE (CACHE_SIZE / 2)
 
 BARRIER_INIT(my_barrier, NR_TASKLETS);
 MUTEX_INIT(my_mutex);
 
-__host dpu_block_t bl1;
-__host dpu_block_t bl2;
-
-uint32_t addr[NR_TASKLETS];
-T rows[NR_TASKLETS];
-int used_idx[NR_TASKLETS];
-int used_rows[NR_TASKLETS];
-
-// Find matched index or lower bound index
-int binary_search(uint32_t base_addr, int col_num, int row_num, int target, int join_key)
-{
-    int left = 0;
-    int right = row_num - 1;
-    int idx = -1;
-
-    T *mid_row = (T *)mem_alloc(col_num * sizeof(T));
-    while (left <= right)
-    {
-        int mid = (left + right) / 2;
+__host dpu_block_t bl[MAX_MERGE_WAYS];
+__host int way_num;
+__host agg_args_t agg;
 
-        mram_read((__mram_ptr void *)(base_addr + mid * col_num * sizeof(T)), mid_row, col_num * sizeof(T));
-
-        if (mid_row[join_key] == target)
-        {
-            return mid;
-        }
-        else if (mid_row[join_key] < target)
-        {
-            idx = mid;
-            left = mid + 1;
-        }
-        else
-        {
-            right = mid - 1;
-        }
-    }
-
-    return idx;
-}
+int splits[NR_TASKLETS + 1][MAX_MERGE_WAYS];
+int groups[NR_TASKLETS];
 
 int main()
 {
@@ -60,164 +32,209 @@ int main()
 
     // Initialize variables
     unsigned int tasklet_id = me();
-    int col_num = bl1.col_num;
-    int row_num1 = bl1.row_num;
-    int row_num2 = bl2.row_num;
+    stats_start(tasklet_id);
+    int col_num = bl[0].col_num;
     int one_row_size = col_num * sizeof(T);
-    unsigned int join_key = bl1.table_num == 0 ? JOIN_KEY1 : JOIN_KEY2;
-    uint32_t mram_base_addr_dpu2 = (uint32_t)DPU_MRAM_HEAP_POINTER + (row_num1 + row_num2) * one_row_size;
+    unsigned int key_col = bl[0].key_col;
 
-    // Calculate the chunk size and offset from the base address
-    int row_per_tasklet = row_num1 / NR_TASKLETS;
-    int chunk_size = row_per_tasklet * col_num;
-    int start = tasklet_id * chunk_size;
-    if (tasklet_id == NR_TASKLETS - 1)
+    int total_rows = 0;
+    for (int w = 0; w < way_num; w++)
     {
-        row_per_tasklet = row_num1 - (NR_TASKLETS - 1) * row_per_tasklet;
-        chunk_size = row_per_tasklet * col_num;
+        total_rows += bl[w].row_num;
     }
 
-    // Initialize the start address
-    uint32_t mram_base_addr = (uint32_t)DPU_MRAM_HEAP_POINTER + start * sizeof(T);
-
-    // Save the address and the number of rows
-    addr[tasklet_id] = mram_base_addr;
-    rows[tasklet_id] = row_per_tasklet;
+    // A DPU left without blocks in this round has nothing to merge
+    if (total_rows == 0)
+    {
+        stats_idle(tasklet_id);
+        return 0;
+    }
 
-    /* ********************* */
-    /*     Binary search     */
-    /* ********************* */
+    // The host places the sorted blocks back to back and reads the merged rows after them
+    // Group rows are staged after the output and packed once every tasklet knows its group count
+    uint32_t output_addr = (uint32_t)DPU_MRAM_HEAP_POINTER + total_rows * one_row_size;
+    uint32_t staging_addr = output_addr + total_rows * one_row_size;
 
-    // Load the last row
-    T *last_row = (T *)mem_alloc(one_row_size);
-    mram_read((__mram_ptr void *)(mram_base_addr + (row_per_tasklet - 1) * one_row_size), last_row, one_row_size);
+    // Every way gets a share of the tile bytes, at least one row, the ways and the output buffer
+    // split what the tasklet heap leaves past the rows of every buffer in halves
+    int spare = TASKLET_HEAP_SIZE - merge_wram_size(col_num, way_num);
+    int tile_size = tile_fit((MERGE_TILE_SIZE / way_num) & ~7, one_row_size, spare / 2 / way_num);
 
-    // Find the index
-    if (tasklet_id < NR_TASKLETS - 1)
+    block_cache_t ways[MAX_MERGE_WAYS];
+    uint32_t way_addr = (uint32_t)DPU_MRAM_HEAP_POINTER;
+    for (int w = 0; w < way_num; w++)
     {
-        used_idx[tasklet_id] = binary_search(mram_base_addr_dpu2, col_num, row_num2, last_row[join_key], join_key);
+        cache_init(&ways[w], way_addr, col_num, bl[w].row_num, tile_size);
+        way_addr += bl[w].row_num * one_row_size;
     }
-    else
-    {
-        used_idx[tasklet_id] = row_num2 - 1;
-    }
-
-    // Barrier
-    barrier_wait(&my_barrier);
-
-    /* *********************** */
-    /*     Merge with dpus     */
-    /* *********************** */
 
-    // Initialize the index
-    int start_idx = tasklet_id == 0 ? 0 : used_idx[tasklet_id - 1] + 1;
-    int end_idx = used_idx[tasklet_id];
+    /* ************* */
+    /*     Split     */
+    /* ************* */
 
-    // Initialize local caches
-    T *first_row = (T *)mem_alloc(one_row_size);
-    T *second_row = (T *)mem_alloc(one_row_size);
-    T *tmp_row = (T *)mem_alloc(one_row_size);
-    T *save_row = (T *)mem_alloc(one_row_size);
+    // Each tasklet produces an even slice of the output
+    // The splits of the slice start are found by a search over all ways (k-way merge path)
+    int out_per_tasklet = total_rows / NR_TASKLETS;
+    int remain_rows = total_rows % NR_TASKLETS;
+    int out_start = tasklet_id * out_per_tasklet + (tasklet_id < remain_rows ? tasklet_id : remain_rows);
 
-    // Save the number of rows
-    used_rows[tasklet_id] = end_idx - start_idx + 1;
+    merge_state_t *st = (merge_state_t *)mem_alloc(sizeof(merge_state_t));
+    st->way_num = way_num;
+    st->key_col = key_col;
 
-    // Initialize the counter and addresses
-    int cur_cnt = 0;
-    uint32_t first_addr = addr[tasklet_id];
-    uint32_t second_addr = mram_base_addr_dpu2 + start_idx * one_row_size;
+    int *split = splits[tasklet_id];
+    merge_split(st, ways, out_start, split);
 
-    while (cur_cnt < rows[tasklet_id])
+    // Grouped blocks hold a key at most once each and the rows of a key follow each other in way order,
+    // the rows of the last key before a split that fall after it move to the previous slice
+    if (agg.group_by_key)
     {
-        // Load the rows
-        mram_read((__mram_ptr void *)(first_addr + cur_cnt * one_row_size), first_row, one_row_size);
-        mram_read((__mram_ptr void *)(second_addr), second_row, one_row_size);
-
-        // Compare
-        if (first_row[join_key] > second_row[join_key])
+        int last = -1;
+        T last_key = 0;
+        for (int w = 0; w < way_num; w++)
         {
-            // Exchange
-            mram_write(first_row, (__mram_ptr void *)second_addr, one_row_size);
-            mram_write(second_row, (__mram_ptr void *)(first_addr + cur_cnt * one_row_size), one_row_size);
-
-            // Re-sort in second
-            int change_idx = 1;
-
-            mram_read((__mram_ptr void *)(second_addr), save_row, one_row_size);
-            mram_read((__mram_ptr void *)(second_addr + change_idx * one_row_size), tmp_row, one_row_size);
-
-            int next_val = tmp_row[join_key];
-            while (next_val < save_row[join_key])
+            if (split[w] > 0)
             {
-                mram_write(tmp_row, (__mram_ptr void *)(second_addr + (change_idx - 1) * one_row_size), one_row_size);
-                change_idx++;
-
-                mram_read((__mram_ptr void *)(second_addr + change_idx * one_row_size), tmp_row, one_row_size);
-                next_val = tmp_row[join_key];
-
-                if (change_idx == used_rows[tasklet_id])
+                T key = cache_key(&ways[w], split[w] - 1, key_col);
+                if (last < 0 || key >= last_key)
                 {
-                    break;
+                    last = w;
+                    last_key = key;
                 }
             }
-
-            mram_write(save_row, (__mram_ptr void *)(second_addr + (change_idx - 1) * one_row_size), one_row_size);
         }
 
-        // Increment the counter
-        cur_cnt++;
+        for (int w = 0; last >= 0 && w < way_num; w++)
+        {
+            if (split[w] < bl[w].row_num && cache_key(&ways[w], split[w], key_col) == last_key)
+                split[w]++;
+        }
     }
 
-    // Barrier
-    barrier_wait(&my_barrier);
-
-    /* *********************************** */
-    /*     Re-sort (dpu-i & dpu-(i+1))     */
-    /* *********************************** */
-
-    // Initialize the target address
-    uint32_t target_addr;
-    if (tasklet_id == 0)
+    if (tasklet_id == NR_TASKLETS - 1)
     {
-        target_addr = (uint32_t)DPU_MRAM_HEAP_POINTER + (rows[0] - 1) * one_row_size;
+        for (int w = 0; w < way_num; w++)
+        {
+            splits[NR_TASKLETS][w] = bl[w].row_num;
+        }
     }
-    else
+
+    int slice_start = 0;
+    for (int w = 0; w < way_num; w++)
     {
-        target_addr = addr[tasklet_id] + (used_idx[tasklet_id - 1] + rows[tasklet_id]) * one_row_size;
+        slice_start += split[w];
     }
 
-    // Read and write rows in reverse order
-    for (int i = NR_TASKLETS - 1; i >= 0; i--)
+    // The output leaves WRAM one tile at a time, a tile holds at least one row
+    // Everything is allocated before the barrier, so a tasklet that finishes early never resets a live heap
+    int output_size = tile_fit(OUTPUT_SIZE, one_row_size, spare / 2);
+    row_writer_t writer;
+    uint32_t write_addr = agg.group_by_key ? staging_addr : output_addr;
+    writer_init(&writer, write_addr + slice_start * one_row_size, col_num, output_size);
+
+    T *group_row = (T *)mem_alloc(one_row_size);
+    int group_num = 0;
+
+    // Barrier
+    stats_barrier_wait(tasklet_id, &my_barrier);
+
+    /* ************* */
+    /*     Merge     */
+    /* ************* */
+
+    int slice_rows = merge_start(st, ways, split, splits[tasklet_id + 1]);
+
+    for (int i = 0; i < slice_rows; i++)
     {
-        // Barrier
-        barrier_wait(&my_barrier);
+        T *row = merge_top(st, ways);
 
-        if (tasklet_id == i)
+        if (!agg.group_by_key)
+        {
+            writer_append(&writer, row);
+        }
+        else if (group_num > 0 && group_row[key_col] == row[key_col])
         {
-            for (int r = rows[tasklet_id] - 1; r >= 0; r--)
+            // Equal keys of several ways meet in a row, the group row folds the aggregates of all of them
+            for (int f = 0; f < agg.func_num; f++)
             {
-                mram_read((__mram_ptr void *)(addr[tasklet_id] + r * one_row_size), tmp_row, one_row_size);
-                mram_write(tmp_row, (__mram_ptr void *)(target_addr), one_row_size);
-                target_addr -= one_row_size;
+                group_row[1 + f] = agg_fold(agg.funcs[f], group_row[1 + f], row[1 + f]);
             }
         }
+        else
+        {
+            if (group_num > 0)
+                writer_append(&writer, group_row);
+            memcpy(group_row, row, one_row_size);
+            group_num++;
+        }
 
-        // Barrier
-        barrier_wait(&my_barrier);
+        // The row is consumed before its way moves on
+        merge_pop(st, ways);
     }
 
-    // Initialize the insert address
-    uint32_t insert_addr = target_addr + (rows[tasklet_id] + 1) * one_row_size;
+    // Flush the remaining rows
+    if (group_num > 0)
+        writer_append(&writer, group_row);
+    writer_flush(&writer);
 
-    // Insert the rows
-    for (int r = 0; r < used_rows[tasklet_id]; r++)
+    /* ************ */
+    /*     Pack     */
+    /* ************ */
+
+    if (agg.group_by_key)
     {
-        mram_read((__mram_ptr void *)(second_addr + r * one_row_size), tmp_row, one_row_size);
-        mram_write(tmp_row, (__mram_ptr void *)(insert_addr + r * one_row_size), one_row_size);
+        groups[tasklet_id] = group_num;
+
+        // Barrier
+        stats_barrier_wait(tasklet_id, &my_barrier);
+
+        int packed = 0;
+        for (int t = 0; t < tasklet_id; t++)
+        {
+            packed += groups[t];
+        }
+
+        uint32_t src_addr = staging_addr + slice_start * one_row_size;
+        uint32_t dst_addr = output_addr + packed * one_row_size;
+        stats_begin(tasklet_id);
+        for (int done = 0; done < group_num; done += writer.cap_rows)
+        {
+            int copy_rows = group_num - done < writer.cap_rows ? group_num - done : writer.cap_rows;
+            mram_read((__mram_ptr void *)(src_addr + done * one_row_size), writer.buf, copy_rows * one_row_size);
+            mram_write(writer.buf, (__mram_ptr void *)(dst_addr + done * one_row_size), copy_rows * one_row_size);
+        }
+        stats_end(tasklet_id, PHASE_WRITE);
+
+        if (tasklet_id == NR_TASKLETS - 1)
+            bl[0].row_num = packed + group_num;
+
+        total_rows = 0;
+        for (int t = 0; t < NR_TASKLETS; t++)
+        {
+            total_rows += groups[t];
+        }
     }
+    else if (tasklet_id == NR_TASKLETS - 1)
+    {
+        // The host reads the merged row count back from the first block
+        bl[0].row_num = total_rows;
+    }
+
+    /* ******************** */
+    /*     Sparse index     */
+    /* ******************** */
+
+    // Barrier
+    stats_barrier_wait(tasklet_id, &my_barrier);
+
+    // The merged block goes back with a sample of its keys right after its rows
+    stats_begin(tasklet_id);
+    index_write(tasklet_id, output_addr, col_num, key_col, total_rows, output_addr + total_rows * one_row_size, writer.buf, output_size);
+    stats_end(tasklet_id, PHASE_WRITE);
 
     // Reset the heap
     mem_reset();
 
+    stats_stop(tasklet_id);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,231 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Host-side predicate helpers shared by the host programs
+ *
+ * A predicate is written in conjunctive normal form over 1-based column names:
+ *   "col1>5000&col2<=30|col3[10,20]&col4{1,5,9}"
+ * '&' separates clauses and '|' separates terms of a clause.
+ * Supported terms are colN=v, colN<v, colN<=v, colN>v, colN>=v,
+ * colN[lo,hi] (BETWEEN, inclusive) and colN{v1,v2,...} (IN-list).
+ */
+
+// Parses a value of type T
+T parse_value(const char *str, char **end)
+{
+#ifdef DOUBLE
+    return strtod(str, end);
+#elif defined(UINT64)
+    return strtoull(str, end, 10);
+#else
+    return strtoll(str, end, 10);
+#endif
+}
+
+// Parses a 1-based column name, returns the 0-based column or -1 when it is not one of col_num columns
+int parse_column(const char *str, int col_num)
+{
+    char *end;
+
+    if (strncmp(str, "col", 3) != 0)
+        return -1;
+
+    int col = (int)strtol(str + 3, &end, 10) - 1;
+    if (end == str + 3 || *end != '\0' || col < 0 || col >= col_num)
+        return -1;
+
+    return col;
+}
+
+// Sets the predicate to a single "column > value" term
+void set_default_predicate(predicate_t *pred, int select_col, T select_val)
+{
+    pred->term_num = 1;
+    pred->clause_num = 1;
+    pred->terms[0].col = select_col;
+    pred->terms[0].op = OP_GT;
+    pred->terms[0].clause = 0;
+    pred->terms[0].val_start = 0;
+    pred->terms[0].val_num = 0;
+    pred->terms[0].lo = select_val;
+    pred->terms[0].hi = select_val;
+}
+
+// Parses a predicate string, returns 0 on success and -1 on a malformed predicate
+int parse_predicate(const char *str, int col_num, predicate_t *pred)
+{
+    const char *p = str;
+    char *end;
+    int val_num = 0;
+
+    pred->term_num = 0;
+    pred->clause_num = 1;
+
+    while (*p)
+    {
+        if (pred->term_num == MAX_PRED_TERMS)
+        {
+            fprintf(stderr, "Predicate \"%s\": more than %d terms\n", str, MAX_PRED_TERMS);
+            return -1;
+        }
+
+        pred_term_t *term = &pred->terms[pred->term_num];
+        term->clause = pred->clause_num - 1;
+        term->val_start = 0;
+        term->val_num = 0;
+
+        // Column name
+        while (isspace((unsigned char)*p))
+            p++;
+        if (strncmp(p, "col", 3) != 0)
+            goto malformed;
+        term->col = (int)strtol(p + 3, &end, 10) - 1;
+        if (end == p + 3 || term->col < 0 || term->col >= col_num)
+        {
+            fprintf(stderr, "Predicate \"%s\": unknown column\n", str);
+            return -1;
+        }
+        p = end;
+        while (isspace((unsigned char)*p))
+            p++;
+
+        // Operator and values
+        if (*p == '[')
+        {
+            term->op = OP_BETWEEN;
+            term->lo = parse_value(p + 1, &end);
+            if (end == p + 1 || *end != ',')
+                goto malformed;
+            p = end + 1;
+            term->hi = parse_value(p, &end);
+            if (end == p || *end != ']')
+                goto malformed;
+            p = end + 1;
+        }
+        else if (*p == '{')
+        {
+            term->op = OP_IN;
+            term->val_start = val_num;
+            p++;
+            while (true)
+            {
+                if (val_num == MAX_PRED_VALS)
+                {
+                    fprintf(stderr, "Predicate \"%s\": more than %d IN-list values\n", str, MAX_PRED_VALS);
+                    return -1;
+                }
+                pred->vals[val_num] = parse_value(p, &end);
+                if (end == p)
+                    goto malformed;
+                val_num++;
+                term->val_num++;
+                p = end;
+                if (*p == '}')
+                    break;
+                if (*p != ',')
+                    goto malformed;
+                p++;
+            }
+            p++;
+        }
+        else
+        {
+            if (strncmp(p, "<=", 2) == 0)
+                term->op = OP_LE, p += 2;
+            else if (strncmp(p, ">=", 2) == 0)
+                term->op = OP_GE, p += 2;
+            else if (*p == '<')
+                term->op = OP_LT, p++;
+            else if (*p == '>')
+                term->op = OP_GT, p++;
+            else if (*p == '=')
+                term->op = OP_EQ, p++;
+            else
+                goto malformed;
+
+            term->lo = parse_value(p, &end);
+            if (end == p)
+                goto malformed;
+            term->hi = term->lo;
+            p = end;
+        }
+        pred->term_num++;
+
+        // Connective
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == '&')
+            pred->clause_num++, p++;
+        else if (*p == '|')
+            p++;
+        else if (*p != '\0')
+            goto malformed;
+        else
+            break;
+    }
+
+    if (pred->term_num == 0 || pred->terms[pred->term_num - 1].clause != pred->clause_num - 1)
+        goto malformed;
+
+    return 0;
+
+malformed:
+    fprintf(stderr, "Predicate \"%s\": malformed near \"%s\"\n", str, p);
+    return -1;
+}
+
+// Evaluates one term on a row
+bool match_term(const predicate_t *pred, const pred_term_t *term, const T *row)
+{
+    T val = row[term->col];
+
+    switch (term->op)
+    {
+    case OP_EQ:
+        return val == term->lo;
+    case OP_LT:
+        return val < term->lo;
+    case OP_LE:
+        return val <= term->lo;
+    case OP_GT:
+        return val > term->lo;
+    case OP_GE:
+        return val >= term->lo;
+    case OP_BETWEEN:
+        return val >= term->lo && val <= term->hi;
+    case OP_IN:
+        for (int v = term->val_start; v < term->val_start + term->val_num; v++)
+        {
+            if (val == pred->vals[v])
+                return true;
+        }
+        return false;
+    }
+
+    return false;
+}
+
+// Evaluates the whole predicate on a row
+bool match_predicate(const predicate_t *pred, const T *row)
+{
+    int t = 0;
+
+    for (int c = 0; c < pred->clause_num; c++)
+    {
+        bool clause_match = false;
+        for (; t < pred->term_num && pred->terms[t].clause == c; t++)
+        {
+            if (!clause_match && match_term(pred, &pred->terms[t], row))
+                clause_match = true;
+        }
+
+        if (!clause_match)
+            return false;
+    }
+
+    return true;
+}
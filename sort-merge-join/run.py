@@ -1,26 +1,280 @@
+import argparse
+import csv
+import itertools
+import json
+import math
+import os
+import re
+import statistics
 import subprocess
+import sys
+import time
 
-commands = [
-    ['make'],
-    ['./cpu_app', './data/data1.csv', './data/data2.csv'],
-    ['./app', './data/data1.csv', './data/data2.csv'],
-    ['make', 'clean']
-]
-
-def run_command(command):
-    try:
-        result = subprocess.run(command, check=True, text=True, capture_output=True)
-        print(f"\n{'=' * 40}") 
-        print(f"Command: {' '.join(command)}")
-        print("Output:")
-        print(result.stdout.strip() if result.stdout.strip() else "No output") 
-    except subprocess.CalledProcessError as e:
-        print(f"\n{'=' * 40}")  
+# Benchmark driver of the PIM sort-merge join
+#
+# Every configuration is a build variant (DPUs, tasklets) and a data variant (rows, key distribution,
+# columns, duplicate factor, join match rate, selectivity). Each one runs --warmup times unmeasured, then --repeat times measured.
+# The phases app prints (CPU-DPU, DPU, DPU-CPU, TOTAL in ms), every scope of its PHASES table (time and
+# bandwidth), the wall time of the process and the mean span cycles of every kernel are kept per run.
+# cpu_app prints the same PHASES table, its scopes are kept under cpu_phase next to the phase ones of app.
+# Medians come with a distribution-free confidence interval from the order statistics.
+# --baseline compares the medians with a stored results.json and flags the slowdowns.
+
+BENCH_DIR = os.path.join('data', 'bench')
+APP_PHASES = {'CPU-DPU': 'cpu_dpu', 'DPU': 'dpu', 'DPU-CPU': 'dpu_cpu', 'TOTAL': 'total'}
+DISTS = ('unique', 'uniform', 'zipf', 'sequential', 'sorted', 'nearly-sorted', 'clustered')
+TIMER_CLASSES = ('stage', 'host', 'setup', 'cpu-dpu', 'dpu', 'dpu-cpu')
+
+
+def parse_list(text, cast):
+    return [cast(v) for v in text.split(',') if v]
+
+
+def run_command(command, capture=True):
+    result = subprocess.run(command, text=True, capture_output=capture)
+    if result.returncode != 0:
+        print(f"\n{'=' * 40}")
         print(f"Error Command: {' '.join(command)}")
         print("Error output:")
-        print(e.stderr.strip() if e.stderr.strip() else "No error output")  
+        print(result.stderr.strip() if result.stderr and result.stderr.strip() else "No error output")
+        sys.exit(1)
+    return result.stdout
+
+
+# Data
+
+def table_pair(rows, dist, cols, dup, match):
+    # Tables come from gen_data, built by make all, and are kept in data/bench for the next runs
+    os.makedirs(BENCH_DIR, exist_ok=True)
+    paths = [os.path.join(BENCH_DIR, f"{rows}_{dist}_{cols}_{dup}_{match}_{t + 1}.csv") for t in range(2)]
+    if not all(os.path.exists(path) for path in paths):
+        seed = rows * 31 + cols * 7 + DISTS.index(dist) * 3 + dup
+        run_command(['./gen_data', '--rows', str(rows), '--cols', str(cols), '--dist', dist, '--dup', str(dup),
+                     '--match', str(match), '--seed', str(seed)] + paths)
+    return paths
+
+
+# Runs
+
+def parse_phases(stdout, prefix):
+    # Rows of the PHASES table of timer.h: the scope name indented by its depth, class, ms, calls, then bytes
+    # and MB/s when the scope moved bytes. A scope is named by its path, e.g. phase:merge/merge round 0/push rows
+    phases = {}
+    path = []
+    in_table = False
+    for line in stdout.splitlines():
+        if line.startswith('######## PHASES'):
+            in_table = True
+            continue
+        if not in_table or line.startswith('phase '):
+            continue
+        if line.startswith('###'):
+            break
+
+        fields = line.split()
+        c = len(fields) - 3 if fields[-3] in TIMER_CLASSES else len(fields) - 5
+        depth = (len(line) - len(line.lstrip(' '))) // 2
+        path = path[:depth] + [' '.join(fields[:c])]
+        name = f"{prefix}:{'/'.join(path)}"
+        phases[name] = float(fields[c + 1])
+        if c + 3 < len(fields):
+            phases[f"{name}:MB/s"] = float(fields[c + 4])
+    return phases
+
+
+def parse_app(stdout):
+    phases = parse_phases(stdout, 'phase')
+    for line in stdout.splitlines():
+        fields = line.split()
+        if len(fields) == 2 and fields[0] in APP_PHASES:
+            phases[APP_PHASES[fields[0]]] = float(fields[1])
+
+    # Mean span cycles of every kernel from the CYCLES table, the kernel name is only on its first row
+    kernel = None
+    for line in stdout.splitlines():
+        fields = line.split()
+        if len(fields) == 5 and fields[1] == 'load':
+            kernel = fields[0]
+        elif len(fields) == 4 and fields[0] == 'span' and kernel:
+            phases[f"{kernel}_span_cycles"] = float(fields[2])
+    return phases
+
+
+def parse_cpu(stdout):
+    phases = parse_phases(stdout, 'cpu_phase')
+    match = re.search(r"^TOTAL ([0-9.]+)", stdout, re.MULTILINE)
+    if match:
+        phases['cpu_total'] = float(match.group(1))
+    return phases
+
+
+def measure(command, parse, wall_name):
+    start = time.perf_counter()
+    stdout = run_command(command)
+    wall = (time.perf_counter() - start) * 1000
+    sample = parse(stdout)
+    sample[wall_name] = wall
+    return sample
+
+
+def build(dpus, tasklets):
+    run_command(['make', 'clean'])
+    run_command(['make', 'all', f"CFLAG=--std=c99 -DNR_DPUS={dpus}", f"DNR_TASKLETS=-DNR_TASKLETS={tasklets}"])
+
+
+# Statistics
+
+def median_ci(values, level=0.95):
+    # Distribution-free interval [x_(k), x_(n+1-k)] around the median, the number of samples
+    # below the median is Binomial(n, 1/2). Few samples only reach a lower level than asked,
+    # the interval is then the whole range
+    values = sorted(values)
+    n = len(values)
+    alpha = 1 - level
+    k = 0
+    cdf = 0.0
+    while k < n // 2:
+        p = math.comb(n, k) / 2 ** n
+        if cdf + p > alpha / 2:
+            break
+        cdf += p
+        k += 1
+    k = max(k, 1)
+    return values[k - 1], values[n - k]
+
+
+def summarize(samples):
+    summary = {}
+    for metric in sorted({m for s in samples for m in s}):
+        values = [s[metric] for s in samples if metric in s]
+        low, high = median_ci(values)
+        summary[metric] = {'median': statistics.median(values), 'ci_low': low, 'ci_high': high, 'n': len(values)}
+    return summary
+
+
+def compare(results, baseline, threshold):
+    # A slowdown: the median grew by more than threshold and the intervals do not overlap,
+    # for a bandwidth the median dropped instead
+    base = {r['name']: r['summary'] for r in baseline['configs']}
+    slowdowns = []
+    for config in results['configs']:
+        if config['name'] not in base:
+            continue
+        for metric, now in config['summary'].items():
+            before = base[config['name']].get(metric)
+            if before is None or before['median'] == 0:
+                continue
+            if metric.endswith(':MB/s'):
+                slower = now['median'] < before['median'] * (1 - threshold) and now['ci_high'] < before['ci_low']
+            else:
+                slower = now['median'] > before['median'] * (1 + threshold) and now['ci_low'] > before['ci_high']
+            if slower:
+                slowdowns.append((config['name'], metric, before['median'], now['median']))
+    return slowdowns
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Benchmark the PIM sort-merge join over a grid of configurations')
+    parser.add_argument('--rows', type=lambda s: parse_list(s, int), help='rows per table, comma separated (default: data/data1.csv, data/data2.csv)')
+    parser.add_argument('--dist', type=lambda s: parse_list(s, str), default=['unique'], help=f"join key distributions out of {', '.join(DISTS)}")
+    parser.add_argument('--cols', type=lambda s: parse_list(s, int), default=[4], help='columns per table, at least 2')
+    parser.add_argument('--dup', type=lambda s: parse_list(s, int), default=[1], help='rows per join key of table 1')
+    parser.add_argument('--match', type=lambda s: parse_list(s, float), default=[1.0], help='fraction of the rows of table 2 with a key in table 1')
+    parser.add_argument('--selectivity', type=lambda s: parse_list(s, float), default=[1.0], help='fraction of rows kept by the select on col2')
+    parser.add_argument('--dpus', type=lambda s: parse_list(s, int), default=[64], help='NR_DPUS build variants')
+    parser.add_argument('--tasklets', type=lambda s: parse_list(s, int), default=[16], help='NR_TASKLETS build variants')
+    parser.add_argument('--repeat', type=int, default=5, help='measured runs per configuration')
+    parser.add_argument('--warmup', type=int, default=1, help='unmeasured runs before them')
+    parser.add_argument('--cpu', action='store_true', help='also time cpu_app')
+    parser.add_argument('--out', default='results', help='directory of results.json, runs.csv and summary.csv')
+    parser.add_argument('--baseline', help='results.json of an earlier run to check for slowdowns')
+    parser.add_argument('--threshold', type=float, default=0.05, help='median growth counted as a slowdown')
+    args = parser.parse_args()
+
+    # Paths given by the user stay relative to where run.py was called, the runs happen next to it
+    args.out = os.path.abspath(args.out)
+    args.baseline = os.path.abspath(args.baseline) if args.baseline else None
+    os.chdir(os.path.dirname(os.path.abspath(__file__)))
+
+    for dist in args.dist:
+        if dist not in DISTS:
+            parser.error(f"unknown distribution {dist}")
+    if args.rows and min(args.cols) < 2:
+        parser.error('--cols needs at least 2 columns, the select runs on col2')
+    if args.repeat < 1:
+        parser.error('--repeat needs at least 1 run')
+
+    data_variants = list(itertools.product(args.rows, args.dist, args.cols, args.dup, args.match)) if args.rows else [None]
+    results = {'meta': {'argv': sys.argv[1:], 'repeat': args.repeat, 'warmup': args.warmup}, 'configs': []}
+    runs = []
+
+    for dpus, tasklets in itertools.product(args.dpus, args.tasklets):
+        build(dpus, tasklets)
+        for data, selectivity in itertools.product(data_variants, args.selectivity):
+            if data is None:
+                tables = ['./data/data1.csv', './data/data2.csv']
+                name = f"data1-data2/dpus={dpus}/tasklets={tasklets}/sel={selectivity}"
+                with open(tables[0]) as file:
+                    value_max = (sum(1 for _ in file) - 1) * 3
+            else:
+                rows, dist, cols, dup, match = data
+                tables = table_pair(rows, dist, cols, dup, match)
+                name = f"rows={rows}/dist={dist}/cols={cols}/dup={dup}/match={match}/dpus={dpus}/tasklets={tasklets}/sel={selectivity}"
+                value_max = rows * 3
+
+            # col2 holds values in [1, 3 * rows]
+            bound = int(selectivity * value_max)
+            where = ['--where1', f"col2<={bound}", '--where2', f"col2<={bound}"]
+
+            samples = []
+            for i in range(args.warmup + args.repeat):
+                sample = measure(['./app'] + tables + where, parse_app, 'wall')
+                if args.cpu:
+                    sample.update(measure(['./cpu_app'] + tables + where, parse_cpu, 'cpu_wall'))
+                if i >= args.warmup:
+                    samples.append(sample)
+                    runs.append(dict(config=name, run=i - args.warmup, **sample))
+
+            summary = summarize(samples)
+            results['configs'].append({'name': name, 'samples': samples, 'summary': summary})
+
+            print(f"\n{'=' * 40}")
+            print(name)
+            print(f"{'metric':<48} {'median':>12} {'95% CI':>27}")
+            for metric, s in summary.items():
+                print(f"{metric:<48} {s['median']:12.3f} [{s['ci_low']:12.3f}, {s['ci_high']:12.3f}]")
+
+    run_command(['make', 'clean'])
+
+    os.makedirs(args.out, exist_ok=True)
+    with open(os.path.join(args.out, 'results.json'), 'w') as file:
+        json.dump(results, file, indent=2)
+
+    metrics = sorted({m for r in runs for m in r if m not in ('config', 'run')})
+    with open(os.path.join(args.out, 'runs.csv'), 'w', newline='') as file:
+        writer = csv.DictWriter(file, fieldnames=['config', 'run'] + metrics)
+        writer.writeheader()
+        writer.writerows(runs)
+
+    with open(os.path.join(args.out, 'summary.csv'), 'w', newline='') as file:
+        writer = csv.writer(file)
+        writer.writerow(['config', 'metric', 'median', 'ci_low', 'ci_high', 'n'])
+        for config in results['configs']:
+            for metric, s in config['summary'].items():
+                writer.writerow([config['name'], metric, s['median'], s['ci_low'], s['ci_high'], s['n']])
+
+    print(f"\n{'=' * 40}")
+    print(f"Results in {args.out}/results.json, runs.csv, summary.csv")
+
+    if args.baseline:
+        with open(args.baseline) as file:
+            slowdowns = compare(results, json.load(file), args.threshold)
+        for name, metric, before, now in slowdowns:
+            print(f"SLOWDOWN {name} {metric}: {before:.3f} -> {now:.3f} ({(now / before - 1) * 100:+.1f}%)")
+        if slowdowns:
+            sys.exit(1)
+        print(f"No slowdown over {args.threshold * 100:.0f}% against {args.baseline}")
 
-for command in commands:
-    run_command(command)
 
-print(f"\n{'=' * 40}")  
\ No newline at end of file
+if __name__ == '__main__':
+    main()
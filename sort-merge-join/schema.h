@@ -0,0 +1,114 @@
+#include <stdint.h>
+
+/*
+ * Host-side column schema helpers
+ *
+ * The CSV files carry no types, so the schema of a table is inferred from its values:
+ * every column gets the narrowest width (1, 2, 4 or 8 bytes) holding all of them.
+ * The select kernel reads the packed rows and widens them to T rows as it scans,
+ * so the input tables cross the bus and sit in MRAM at their real width.
+ * A table with more than MAX_SCHEMA_COLS columns, or whose packed rows would not be
+ * smaller, keeps the plain layout.
+ */
+
+// Returns the narrowest width in bytes holding every value in [min, max]
+int column_width(T min, T max)
+{
+#if defined(DOUBLE)
+    return sizeof(T);
+#else
+    for (int width = 1; width < (int)sizeof(T); width *= 2)
+    {
+        int bits = width * 8;
+        T lo = T_SIGNED ? -((T)1 << (bits - 1)) : 0;
+        T hi = T_SIGNED ? ((T)1 << (bits - 1)) - 1 : ((T)1 << bits) - 1;
+        if (min >= lo && max <= hi)
+            return width;
+    }
+
+    return sizeof(T);
+#endif
+}
+
+// Infers the schema of row_num rows of col_num columns
+void infer_schema(const T *rows, uint64_t row_num, int col_num, schema_t *schema)
+{
+    schema->col_num = col_num;
+    schema->row_size = col_num * sizeof(T);
+    if (col_num > MAX_SCHEMA_COLS)
+        return;
+
+    for (int c = 0; c < col_num; c++)
+    {
+        T min = row_num > 0 ? rows[c] : 0;
+        T max = min;
+        for (uint64_t r = 1; r < row_num; r++)
+        {
+            T val = rows[r * col_num + c];
+            if (val < min)
+                min = val;
+            if (val > max)
+                max = val;
+        }
+        schema->width[c] = column_width(min, max);
+    }
+
+    // Wider columns first, so every column is aligned on its width
+    int offset = 0;
+    for (int width = sizeof(T); width >= 1; width /= 2)
+    {
+        for (int c = 0; c < col_num; c++)
+        {
+            if (schema->width[c] != width)
+                continue;
+
+            schema->offset[c] = offset;
+            offset += width;
+        }
+    }
+
+    int row_size = (offset + 7) & ~7;
+    if (row_size < schema->row_size)
+        schema->row_size = row_size;
+}
+
+// Returns row_num rows stored with the schema, the caller frees them
+uint8_t *pack_rows(const schema_t *schema, const T *rows, uint64_t row_num)
+{
+    int col_num = schema->col_num;
+    uint8_t *packed = (uint8_t *)calloc((size_t)row_num * schema->row_size + sizeof(T), 1);
+
+    if (!schema_packed(schema))
+    {
+        memcpy(packed, rows, (size_t)row_num * schema->row_size);
+        return packed;
+    }
+
+    for (uint64_t r = 0; r < row_num; r++)
+    {
+        uint8_t *row = packed + (size_t)r * schema->row_size;
+        for (int c = 0; c < col_num; c++)
+        {
+            T val = rows[r * col_num + c];
+            uint8_t *dst = row + schema->offset[c];
+
+            switch (schema->width[c])
+            {
+            case 1:
+                *dst = (uint8_t)val;
+                break;
+            case 2:
+                *(uint16_t *)dst = (uint16_t)val;
+                break;
+            case 4:
+                *(uint32_t *)dst = (uint32_t)val;
+                break;
+            default:
+                memcpy(dst, &val, sizeof(T));
+                break;
+            }
+        }
+    }
+
+    return packed;
+}
@@ -1,63 +1,174 @@
 #include <stdio.h>
 #include <defs.h>
 #include <barrier.h>
-#include <handshake.h>
-#include <mutex.h>
+#include <vmutex.h>
 #include <stdint.h>
 #include <string.h>
 #include <mram.h>
 #include <alloc.h>
 #include "common.h"
 #include "user.h"
+#include "dpu_io.h"
+#include "dpu_topk.h"
+
+// Virtual mutexes striped over the filter words, tasklets setting bits in different words rarely wait
+#define FILTER_LOCKS 256
 
 BARRIER_INIT(my_barrier, NR_TASKLETS);
-MUTEX_INIT(my_mutex);
+VMUTEX_INIT(filter_locks, FILTER_LOCKS, 8);
 
 __host dpu_block_t bl;
+__host predicate_t pred;
+__host bloom_args_t bloom;
+__host topk_args_t topk;
+__host schema_t schema;
+
+int selected_rows[NR_TASKLETS];
+int dropped_rows[NR_TASKLETS];
+int skipped_rows[NR_TASKLETS];
+
+// Returns the bits of a key in the filter and sets the index of the word holding them
+uint64_t bloom_bits(T key, uint32_t *word)
+{
+    uint64_t key_bits;
+    memcpy(&key_bits, &key, sizeof(key_bits));
+
+    uint32_t h = (uint32_t)key_bits ^ (uint32_t)(key_bits >> 32);
+    uint32_t h1 = h * 0x9E3779B1u;
+    uint32_t h2 = (h ^ (h >> 15)) * 0x85EBCA6Bu;
+    h2 ^= h2 >> 13;
 
-uint32_t message[NR_TASKLETS];
-uint32_t message_partial_count;
+    *word = h1 >> (32 - bloom.word_bits);
 
-int cycle_cnt[NR_TASKLETS];
+    // Double hashing inside the word
+    uint32_t pos = h2 & 63;
+    uint32_t step = (h2 >> 6) | 1;
+    uint64_t bits = 0;
+    for (uint32_t k = 0; k < bloom.hash_num; k++)
+    {
+        bits |= (uint64_t)1 << pos;
+        pos = (pos + step) & 63;
+    }
 
-// Selects rows from the input based on a specified condition and copies them to the output
-unsigned int select(int tasklet_id, T *input, T *output, int size, int col_num, int select_col, T select_val)
+    return bits;
+}
+
+// Evaluates one term over up to 32 rows and returns the bitmap of matching rows
+// The operator is dispatched once per block instead of once per row
+uint32_t eval_term(pred_term_t *term, T *rows, int row_num, int col_num)
 {
-    unsigned int cnt = 0;
-    int row_num = size / (col_num * sizeof(T));
+    uint32_t mask = 0;
+    T *val = rows + term->col;
+    T lo = term->lo;
+    T hi = term->hi;
 
-    for (int i = 0; i < row_num; i++)
+    switch (term->op)
     {
-        if (input[i * col_num + select_col] > select_val)
+    case OP_EQ:
+        for (int i = 0; i < row_num; i++, val += col_num)
+            mask |= (uint32_t)(*val == lo) << i;
+        break;
+    case OP_LT:
+        for (int i = 0; i < row_num; i++, val += col_num)
+            mask |= (uint32_t)(*val < lo) << i;
+        break;
+    case OP_LE:
+        for (int i = 0; i < row_num; i++, val += col_num)
+            mask |= (uint32_t)(*val <= lo) << i;
+        break;
+    case OP_GT:
+        for (int i = 0; i < row_num; i++, val += col_num)
+            mask |= (uint32_t)(*val > lo) << i;
+        break;
+    case OP_GE:
+        for (int i = 0; i < row_num; i++, val += col_num)
+            mask |= (uint32_t)(*val >= lo) << i;
+        break;
+    case OP_BETWEEN:
+        for (int i = 0; i < row_num; i++, val += col_num)
+            mask |= (uint32_t)(*val >= lo && *val <= hi) << i;
+        break;
+    case OP_IN:
+        for (int v = term->val_start; v < term->val_start + term->val_num; v++)
         {
-            memcpy(output + cnt * col_num, input + i * col_num, col_num * sizeof(T));
-            cnt++;
+            T in_val = pred.vals[v];
+            val = rows + term->col;
+            for (int i = 0; i < row_num; i++, val += col_num)
+                mask |= (uint32_t)(*val == in_val) << i;
         }
+        break;
     }
 
-    return cnt;
+    return mask;
 }
 
-// Synchronizes tasklets using a handshaking mechanism
-unsigned int handshake_sync(unsigned int l_count, unsigned int tasklet_id, bool is_last)
+// Returns 0 if no row of the zone can satisfy the predicate
+// The zone holds col_num minimums followed by col_num maximums
+int zone_match(T *zone, int col_num)
 {
-    unsigned int p_count;
+    int t = 0;
 
-    if (tasklet_id != 0)
+    for (int c = 0; c < pred.clause_num; c++)
     {
-        handshake_wait_for(tasklet_id - 1);
-        p_count = message[tasklet_id];
+        int clause_match = 0;
+        for (; t < pred.term_num && pred.terms[t].clause == c; t++)
+        {
+            pred_term_t *term = &pred.terms[t];
+            T lo = zone[term->col];
+            T hi = zone[col_num + term->col];
+
+            switch (term->op)
+            {
+            case OP_EQ:
+                clause_match |= term->lo >= lo && term->lo <= hi;
+                break;
+            case OP_LT:
+                clause_match |= lo < term->lo;
+                break;
+            case OP_LE:
+                clause_match |= lo <= term->lo;
+                break;
+            case OP_GT:
+                clause_match |= hi > term->lo;
+                break;
+            case OP_GE:
+                clause_match |= hi >= term->lo;
+                break;
+            case OP_BETWEEN:
+                clause_match |= term->lo <= hi && term->hi >= lo;
+                break;
+            case OP_IN:
+                for (int v = term->val_start; v < term->val_start + term->val_num; v++)
+                    clause_match |= pred.vals[v] >= lo && pred.vals[v] <= hi;
+                break;
+            }
+        }
+
+        if (!clause_match)
+            return 0;
     }
-    else
-        p_count = 0;
 
-    if (tasklet_id < NR_TASKLETS - 1 && !is_last)
+    return 1;
+}
+
+// Evaluates the predicate over up to 32 rows and returns the bitmap of matching rows
+uint32_t eval_predicate(T *rows, int row_num, int col_num)
+{
+    uint32_t result = row_num == 32 ? 0xFFFFFFFF : (1u << row_num) - 1;
+    int t = 0;
+
+    for (int c = 0; c < pred.clause_num && result != 0; c++)
     {
-        message[tasklet_id + 1] = p_count + l_count;
-        handshake_notify();
+        uint32_t clause_mask = 0;
+        for (; t < pred.term_num && pred.terms[t].clause == c; t++)
+        {
+            clause_mask |= eval_term(&pred.terms[t], rows, row_num, col_num);
+        }
+
+        result &= clause_mask;
     }
 
-    return p_count;
+    return result;
 }
 
 int main()
@@ -68,127 +179,255 @@ int main()
 
     // Initialize variables
     unsigned int tasklet_id = me();
+    stats_start(tasklet_id);
+
+    // DPUs of the other side sit out this launch of the semi-join reduction
+    if (bloom.mode == BLOOM_SKIP)
+    {
+        stats_idle(tasklet_id);
+        return 0;
+    }
+
     int col_num = bl.col_num;
     int row_num = bl.row_num;
-    unsigned int select_col = bl.table_num == 0 ? SELECT_COL1 : SELECT_COL2;
-    unsigned int select_val = bl.table_num == 0 ? SELECT_VAL1 : SELECT_VAL2;
 
     // Calculate sizes
+    // The input rows may be packed narrower than T, the zone map and the selected rows are T rows
     int one_row_size = col_num * sizeof(T);
-    int cache_size = CACHE_SIZE / one_row_size * one_row_size;
-    int input_size = row_num * col_num * sizeof(T);
+    int input_row_size = schema.row_size;
+    uint32_t input_size = row_num * input_row_size;
+
+    // Each tasklet scans one contiguous slice of the input
+    int row_per_tasklet = row_num / NR_TASKLETS;
+    int remain_rows = row_num % NR_TASKLETS;
+    int start_row = tasklet_id * row_per_tasklet + (tasklet_id < remain_rows ? tasklet_id : remain_rows);
+    if (tasklet_id < remain_rows)
+        row_per_tasklet++;
+
+    // Initialize the addresses
+    // The host writes the zone map after the input and the staging area follows it,
+    // so each tasklet owns the staging slice matching its input rows
+    // The staging area also starts past every selected row, packed input may be smaller than the output
+    uint32_t zone_size = (row_num + ZONE_ROWS - 1) / ZONE_ROWS * 2 * one_row_size;
+    uint32_t staging_start = input_size + zone_size > row_num * one_row_size ? input_size + zone_size : row_num * one_row_size;
+    uint32_t mram_base_addr = (uint32_t)DPU_MRAM_HEAP_POINTER;
+    uint32_t input_addr = mram_base_addr + start_row * input_row_size;
+    uint32_t zone_addr = mram_base_addr + input_size;
+    uint32_t staging_addr = mram_base_addr + staging_start + start_row * one_row_size;
+
+    // Plain rows stream through the row reader, packed rows through a tile that widens them as it loads them
+    // The tile and the output buffer hold at least one row and share what the tasklet heap leaves
+    int tile_size = tile_fit(CACHE_SIZE, one_row_size, (TASKLET_HEAP_SIZE - select_wram_size(col_num)) / 2);
+    const schema_t *packed = schema_packed(&schema) ? &schema : NULL;
+    row_reader_t reader;
+    block_cache_t input;
+    int reader_idx = 0;
+    if (packed == NULL)
+    {
+        reader_init(&reader, input_addr, col_num);
+    }
+    else
+    {
+        cache_init(&input, input_addr, col_num, row_per_tasklet, tile_size);
+        input.schema = packed;
+    }
+
+    row_writer_t staging;
+    writer_init(&staging, staging_addr, col_num, tile_size);
 
-    // Calculate the number of rows to process per tasklet
-    int row_per_tasklet = row_num / NR_TASKLETS == 0 ? 1 : row_num / NR_TASKLETS;
-    if (cache_size > row_per_tasklet * one_row_size)
-        cache_size = row_per_tasklet * one_row_size;
+    T *zone = (T *)mem_alloc(2 * one_row_size);
+    uint64_t *filter_word = (uint64_t *)mem_alloc(sizeof(uint64_t));
+    __mram_ptr uint64_t *bloom_filter = (__mram_ptr uint64_t *)(mram_base_addr + bloom.filter_offset);
 
-    // Reset the heap ocne
-    if (tasklet_id == 0)
+    // Clear the filter before the build side sets its bits, the last tasklet also clears the remainder
+    if (bloom.mode == BLOOM_BUILD)
     {
-        mem_reset();
-    }
+        uint32_t word_per_tasklet = bloom.word_num / NR_TASKLETS;
+        uint32_t start_word = tasklet_id * word_per_tasklet;
+        if (tasklet_id == NR_TASKLETS - 1)
+            word_per_tasklet = bloom.word_num - start_word;
+        uint32_t cache_words = staging.cap_rows * one_row_size / sizeof(uint64_t);
+        memset(staging.buf, 0, cache_words * sizeof(uint64_t));
 
-    // Barrier
-    barrier_wait(&my_barrier);
+        for (uint32_t w = 0; w < word_per_tasklet; w += cache_words)
+        {
+            uint32_t words = word_per_tasklet - w < cache_words ? word_per_tasklet - w : cache_words;
+            mram_write(staging.buf, &bloom_filter[start_word + w], words * sizeof(uint64_t));
+        }
+
+        // Barrier
+        stats_barrier_wait(tasklet_id, &my_barrier);
+    }
 
     /* ************** */
     /*     Select     */
     /* ************** */
 
-    // Initialize the start address and local caches
-    uint32_t mram_base_addr = (uint32_t)DPU_MRAM_HEAP_POINTER;
-    T *cache_A = (T *)mem_alloc(cache_size);
-    T *cache_B = (T *)mem_alloc(cache_size);
+    int dropped = 0;
 
-    // Initialize shared variables
-    if (tasklet_id == NR_TASKLETS - 1)
-        message_partial_count = 0;
+    int skipped = 0;
 
-    // Calculate the number of cycles
-    int cnt = (input_size - tasklet_id * cache_size + cache_size * NR_TASKLETS - 1) / (cache_size * NR_TASKLETS);
-    cycle_cnt[tasklet_id] = cnt;
+    // A top-K keeps the best selected rows in WRAM instead of staging every one of them
+    int kept = 0;
+    topk_size[tasklet_id] = 0;
 
-    // Find the max cycle count among all tasklets
-    int cycle = cycle_cnt[0];
-    for (int i = 1; i < NR_TASKLETS; i++)
+    for (int r = 0, rows = 0, zone_end = 0; r < row_per_tasklet; r += rows)
     {
-        if (cycle_cnt[i] > cycle)
+        // Skip the rest of a zone that cannot match, blocks never cross a zone boundary
+        if (r == zone_end)
         {
-            cycle = cycle_cnt[i];
+            int zone_id = (start_row + r) / ZONE_ROWS;
+            zone_end = (zone_id + 1) * ZONE_ROWS - start_row;
+            if (zone_end > row_per_tasklet)
+                zone_end = row_per_tasklet;
+
+            // The minimums and the maximums are read apart, a row is at most one DMA
+            uint32_t zone_entry = zone_addr + zone_id * 2 * one_row_size;
+            mram_read((__mram_ptr void const *)zone_entry, zone, one_row_size);
+            mram_read((__mram_ptr void const *)(zone_entry + one_row_size), zone + col_num, one_row_size);
+            if (!zone_match(zone, col_num))
+            {
+                rows = zone_end - r;
+                skipped += rows;
+                continue;
+            }
         }
-    }
 
-    // Barrier
-    barrier_wait(&my_barrier);
-
-    for (int byte_index = tasklet_id * cache_size, i = 0; i < cycle; byte_index += cache_size * NR_TASKLETS, i++)
-    {
-        // If the tasklet has run fewer cycles than cycle_cnt, wait for the other tasklets
-        if (i >= cycle_cnt[tasklet_id])
+        // Take the next row from the reader, which only seeks past skipped zones,
+        // or the next block from the input tile, rows already loaded are not read again
+        T *block;
+        if (packed == NULL)
         {
-            barrier_wait(&my_barrier);
-            barrier_wait(&my_barrier);
-            continue;
+            if (r == reader_idx + 1)
+                reader_next(&reader);
+            else if (r != reader_idx)
+                reader_seek(&reader, input_addr + r * one_row_size);
+            reader_idx = r;
+            block = reader.row;
+            rows = 1;
+        }
+        else
+        {
+            block = cache_row(&input, r);
+            rows = input.start + input.rows - r;
+            if (rows > zone_end - r)
+                rows = zone_end - r;
         }
 
-        // If the tasklet is processing the last cycle, adjust the cache size
-        bool is_last = input_size - byte_index <= cache_size;
-        if (is_last)
+        // Evaluate the predicate 32 rows at a time
+        for (int i = 0; i < rows; i += 32)
         {
-            cache_size = input_size - byte_index;
+            int eval_rows = rows - i < 32 ? rows - i : 32;
+            uint32_t mask = eval_predicate(block + i * col_num, eval_rows, col_num);
+
+            for (int j = 0; mask != 0; j++, mask >>= 1)
+            {
+                if ((mask & 1) == 0)
+                    continue;
+
+                // Semi-join reduction on the join key
+                if (bloom.mode != BLOOM_NONE)
+                {
+                    uint32_t word;
+                    uint64_t bits = bloom_bits(block[(i + j) * col_num + bloom.key_col], &word);
+
+                    if (bloom.mode == BLOOM_BUILD)
+                    {
+                        vmutex_lock(&filter_locks, word & (FILTER_LOCKS - 1));
+                        mram_read(&bloom_filter[word], filter_word, sizeof(uint64_t));
+                        *filter_word |= bits;
+                        mram_write(filter_word, &bloom_filter[word], sizeof(uint64_t));
+                        vmutex_unlock(&filter_locks, word & (FILTER_LOCKS - 1));
+                    }
+                    else
+                    {
+                        mram_read(&bloom_filter[word], filter_word, sizeof(uint64_t));
+                        if ((*filter_word & bits) != bits)
+                        {
+                            dropped++;
+                            continue;
+                        }
+                    }
+                }
+
+                if (topk.k > 0)
+                {
+                    topk_push(&topk, tasklet_id, block[(i + j) * col_num + topk.col], start_row + r + i + j);
+                    kept++;
+                    continue;
+                }
+
+                writer_append(&staging, block + (i + j) * col_num);
+            }
         }
+    }
+
+    // Flush the remaining rows
+    writer_flush(&staging);
+    int l_count = topk.k > 0 ? kept : (staging.addr - staging_addr) / one_row_size;
 
-        // Load data from MRAM to cache
-        mram_read((__mram_ptr void const *)(mram_base_addr + byte_index), cache_A, cache_size);
+    selected_rows[tasklet_id] = l_count;
+    dropped_rows[tasklet_id] = dropped;
+    skipped_rows[tasklet_id] = skipped;
 
-        // Select rows
-        uint32_t l_count = select(tasklet_id, cache_A, cache_B, cache_size, col_num, select_col, select_val);
+    // Barrier
+    stats_barrier_wait(tasklet_id, &my_barrier);
 
-        // Synchronize tasklets
-        uint32_t p_count = handshake_sync(l_count, tasklet_id, is_last);
+    /* *************** */
+    /*     Compact     */
+    /* *************** */
 
-        // Barrier
-        barrier_wait(&my_barrier);
+    // Calculate the offset
+    int local_offset = 0;
+    for (int t = 0; t < tasklet_id; t++)
+    {
+        local_offset += selected_rows[t];
+    }
 
-        if (l_count > 0)
-        {
-            mram_write(cache_B, (__mram_ptr void *)(mram_base_addr + (message_partial_count + p_count) * one_row_size), l_count * one_row_size);
-        }
+    // Move the staged rows to the front of the heap
+    // The input is no longer read, so the output never overlaps live data
+    uint32_t output_addr = mram_base_addr + local_offset * one_row_size;
+    stats_begin(tasklet_id);
+    for (int r = 0; r < l_count && topk.k == 0; r += staging.cap_rows)
+    {
+        int rows = l_count - r < staging.cap_rows ? l_count - r : staging.cap_rows;
+        mram_read((__mram_ptr void const *)(staging_addr + r * one_row_size), staging.buf, rows * one_row_size);
+        mram_write(staging.buf, (__mram_ptr void *)(output_addr + r * one_row_size), rows * one_row_size);
+    }
+    stats_end(tasklet_id, PHASE_WRITE);
 
-        // Update total row count
-        if (tasklet_id == NR_TASKLETS - 1)
+    // Update total row count
+    // A top-K writes its rows in order at the offset the host chose, the input rows are still in place
+    if (tasklet_id == NR_TASKLETS - 1)
+    {
+        bl.row_num = local_offset + l_count;
+
+        if (topk.k > 0)
         {
-            bl.row_num = message_partial_count + p_count + l_count;
-            message_partial_count = bl.row_num;
+            topk.row_num = topk_reduce(&topk, tasklet_id);
+            staging.addr = mram_base_addr + topk.out_offset;
+            topk_write(tasklet_id, topk.row_num, mram_base_addr, packed, &staging);
         }
-        else if (is_last)
+
+        bloom.dropped = 0;
+        for (int t = 0; t < NR_TASKLETS; t++)
         {
-            if (i == 0)
-            {
-                bl.row_num = 0;
-            }
-            bl.row_num += p_count + l_count;
+            bloom.dropped += dropped_rows[t];
         }
 
-        // Barrier
-        barrier_wait(&my_barrier);
-
 #ifdef DEBUG
-        mutex_lock(my_mutex);
-        if (is_last)
+        int total_skipped = 0;
+        for (int t = 0; t < NR_TASKLETS; t++)
         {
-            printf("Table %d : select %d rows\n", bl.table_num, bl.row_num);
+            total_skipped += skipped_rows[t];
         }
-        mutex_unlock(my_mutex);
+        printf("Table %d : select %d rows, %d rows skipped by zone map\n", bl.table_num, bl.row_num, total_skipped);
 #endif
     }
 
-    // Barrier
-    barrier_wait(&my_barrier);
-
     // Reset the heap
     mem_reset();
 
+    stats_stop(tasklet_id);
     return 0;
 }
@@ -8,15 +8,22 @@
 #include <alloc.h>
 #include "common.h"
 #include "user.h"
+#include "dpu_io.h"
 
 #define STACK_SIZE 250
 
 BARRIER_INIT(my_barrier, NR_TASKLETS);
 MUTEX_INIT(my_mutex);
 
+// Key words in the WRAM tile a tasklet sorts, merges and gathers its key words in
+#define WORD_TILE (WORD_TILE_SIZE / (int)sizeof(uint64_t))
+
 __host dpu_block_t bl;
+__host agg_args_t agg;
+__host key_range_t key_range;
 uint32_t addr[NR_TASKLETS];
 int rows[NR_TASKLETS];
+int groups[NR_TASKLETS];
 
 // Quick sort
 void quick_sort(uint32_t addr, int row_num, int col_num, int key)
@@ -38,7 +45,7 @@ void quick_sort(uint32_t addr, int row_num, int col_num, int key)
 
         int offset = ((pRight + pLeft) / 2) * col_num * sizeof(T);
         mram_read((__mram_ptr void const *)(addr + offset), pivot_arr, col_num * sizeof(T));
-        int pivot = pivot_arr[key];
+        T pivot = pivot_arr[key];
 
         int i = pLeft;
         int j = pRight;
@@ -81,8 +88,6 @@ void quick_sort(uint32_t addr, int row_num, int col_num, int key)
             stack[++top] = j;
         }
     }
-
-    mem_reset();
 }
 
 // Bubble sort
@@ -113,8 +118,6 @@ void bubble_sort(uint32_t addr, int row_num, int col_num, int key)
             break;
         }
     }
-
-    mem_reset();
 }
 
 // Selection sort
@@ -149,16 +152,13 @@ void selection_sort(uint32_t addr, int row_num, int col_num, int key)
             mram_write(temp_j_arr, (__mram_ptr void *)(addr + i * one_row_size), one_row_size);
         }
     }
-
-    mem_reset();
 }
 
 // Insertion sort
-void insertion_sort(uint32_t addr, int row_num, int col_num, int key)
+// temp_i_arr and temp_j_arr hold one row each
+void insertion_sort(uint32_t addr, int row_num, int col_num, int key, T *temp_i_arr, T *temp_j_arr)
 {
     int one_row_size = col_num * sizeof(T);
-    T *temp_i_arr = (T *)mem_alloc(one_row_size);
-    T *temp_j_arr = (T *)mem_alloc(one_row_size);
 
     for (int i = 1; i < row_num; i++)
     {
@@ -182,8 +182,159 @@ void insertion_sort(uint32_t addr, int row_num, int col_num, int key)
 
         mram_write(temp_i_arr, (__mram_ptr void *)(addr + (j + 1) * one_row_size), one_row_size);
     }
+}
 
-    mem_reset();
+// Buffered read cursor over a sorted run of words in MRAM
+typedef struct
+{
+    uint32_t addr;
+    int left;
+    int idx;
+    int len;
+    int cap;
+    uint64_t *buf;
+} word_run_t;
+
+// Returns 0 once the run is drained, loads the next words when the buffer is used up
+int word_run_ready(word_run_t *r)
+{
+    if (r->idx < r->len)
+        return 1;
+    if (r->left == 0)
+        return 0;
+
+    r->len = r->left < r->cap ? r->left : r->cap;
+    mram_read((__mram_ptr void const *)r->addr, r->buf, r->len * sizeof(uint64_t));
+    r->addr += r->len * sizeof(uint64_t);
+    r->left -= r->len;
+    r->idx = 0;
+
+    return 1;
+}
+
+// Sorts word_num words at addr, tmp_addr has room for as many, returns the address of the sorted words
+uint32_t word_sort(uint32_t addr, uint32_t tmp_addr, int word_num, uint64_t *tile)
+{
+    // Runs of one tile sorted in WRAM
+    for (int lo = 0; lo < word_num; lo += WORD_TILE)
+    {
+        int len = word_num - lo < WORD_TILE ? word_num - lo : WORD_TILE;
+        mram_read((__mram_ptr void const *)(addr + lo * sizeof(uint64_t)), tile, len * sizeof(uint64_t));
+
+        for (int i = 1; i < len; i++)
+        {
+            uint64_t word = tile[i];
+            int j = i - 1;
+            while (j >= 0 && tile[j] > word)
+            {
+                tile[j + 1] = tile[j];
+                j--;
+            }
+            tile[j + 1] = word;
+        }
+
+        mram_write(tile, (__mram_ptr void *)(addr + lo * sizeof(uint64_t)), len * sizeof(uint64_t));
+    }
+
+    // Bottom-up merges of pairs of runs, a quarter of the tile buffers each input and the output takes half
+    word_run_t first, second;
+    first.cap = second.cap = WORD_TILE / 4;
+    first.buf = tile;
+    second.buf = tile + WORD_TILE / 4;
+    uint64_t *out = tile + WORD_TILE / 2;
+    int out_cap = WORD_TILE / 2;
+
+    for (int width = WORD_TILE; width < word_num; width *= 2)
+    {
+        for (int lo = 0; lo < word_num; lo += 2 * width)
+        {
+            int mid = lo + width < word_num ? lo + width : word_num;
+            int hi = lo + 2 * width < word_num ? lo + 2 * width : word_num;
+
+            first.addr = addr + lo * sizeof(uint64_t);
+            first.left = mid - lo;
+            second.addr = addr + mid * sizeof(uint64_t);
+            second.left = hi - mid;
+            first.idx = first.len = second.idx = second.len = 0;
+
+            uint32_t out_addr = tmp_addr + lo * sizeof(uint64_t);
+            int out_len = 0;
+            while (true)
+            {
+                int first_ready = word_run_ready(&first);
+                int second_ready = word_run_ready(&second);
+                if (!first_ready && !second_ready)
+                    break;
+
+                word_run_t *src = !second_ready || (first_ready && first.buf[first.idx] <= second.buf[second.idx]) ? &first : &second;
+                out[out_len++] = src->buf[src->idx++];
+                if (out_len == out_cap)
+                {
+                    mram_write(out, (__mram_ptr void *)out_addr, out_len * sizeof(uint64_t));
+                    out_addr += out_len * sizeof(uint64_t);
+                    out_len = 0;
+                }
+            }
+            if (out_len > 0)
+                mram_write(out, (__mram_ptr void *)out_addr, out_len * sizeof(uint64_t));
+        }
+
+        uint32_t swap = addr;
+        addr = tmp_addr;
+        tmp_addr = swap;
+    }
+
+    return addr;
+}
+
+// Key sort
+// The key of every row minus base and the row number form one word, the words are sorted
+// and the rows are gathered once in their order, instead of moving rows on every comparison.
+// scratch_addr has room for two words per row and for a copy of the rows, row holds one row.
+void key_sort(uint32_t addr, int row_num, int col_num, int key, T base, uint32_t scratch_addr, T *row)
+{
+    int one_row_size = col_num * sizeof(T);
+    uint64_t *tile = (uint64_t *)mem_alloc(WORD_TILE_SIZE);
+
+    uint32_t word_addr = scratch_addr;
+    uint32_t tmp_addr = word_addr + row_num * sizeof(uint64_t);
+    uint32_t gather_addr = tmp_addr + row_num * sizeof(uint64_t);
+
+    // Words of the rows
+    for (int lo = 0; lo < row_num; lo += WORD_TILE)
+    {
+        int len = row_num - lo < WORD_TILE ? row_num - lo : WORD_TILE;
+        for (int i = 0; i < len; i++)
+        {
+            mram_read((__mram_ptr void const *)(addr + (lo + i) * one_row_size + key * sizeof(T)), &tile[i], sizeof(T));
+            tile[i] = ((uint64_t)((T)tile[i] - base) << 32) | (uint32_t)(lo + i);
+        }
+        mram_write(tile, (__mram_ptr void *)(word_addr + lo * sizeof(uint64_t)), len * sizeof(uint64_t));
+    }
+
+    word_addr = word_sort(word_addr, tmp_addr, row_num, tile);
+
+    // Gather the rows in the order of their words
+    for (int lo = 0; lo < row_num; lo += WORD_TILE)
+    {
+        int len = row_num - lo < WORD_TILE ? row_num - lo : WORD_TILE;
+        mram_read((__mram_ptr void const *)(word_addr + lo * sizeof(uint64_t)), tile, len * sizeof(uint64_t));
+        for (int i = 0; i < len; i++)
+        {
+            uint32_t idx = (uint32_t)tile[i];
+            mram_read((__mram_ptr void const *)(addr + idx * one_row_size), row, one_row_size);
+            mram_write(row, (__mram_ptr void *)(gather_addr + (lo + i) * one_row_size), one_row_size);
+        }
+    }
+
+    // Copy the sorted rows back over the block
+    uint32_t size = row_num * one_row_size;
+    for (uint32_t done = 0; done < size; done += WORD_TILE_SIZE)
+    {
+        uint32_t len = size - done < WORD_TILE_SIZE ? size - done : WORD_TILE_SIZE;
+        mram_read((__mram_ptr void const *)(gather_addr + done), tile, len);
+        mram_write(tile, (__mram_ptr void *)(addr + done), len);
+    }
 }
 
 int main()
@@ -194,11 +345,12 @@ int main()
 
     // Initialize variables
     unsigned int tasklet_id = me();
+    stats_start(tasklet_id);
     int using_tasklets = NR_TASKLETS;
     int col_num = bl.col_num;
     int row_num = bl.row_num;
     int one_row_size = col_num * sizeof(T);
-    unsigned int join_key = bl.table_num == 0 ? JOIN_KEY1 : JOIN_KEY2;
+    unsigned int join_key = bl.key_col;
 
     // Calculate the number of rows to process per tasklet
     int row_per_tasklet = row_num / NR_TASKLETS;
@@ -224,15 +376,46 @@ int main()
     addr[tasklet_id] = mram_base_addr;
     rows[tasklet_id] = row_per_tasklet;
 
+    // Initialize local caches, the sorts borrow the first two rows
+    T *first_row = (T *)mem_alloc(one_row_size);
+    T *second_row = (T *)mem_alloc(one_row_size);
+    T *tmp_row = (T *)mem_alloc(one_row_size);
+    T *save_row = (T *)mem_alloc(one_row_size);
+
+    // Buffer of the sparse index
+    T *index_buf = (T *)mem_alloc(INDEX_SIZE);
+
+    // Buffers of the group by pass, the reader is positioned once the rows are sorted
+    int group_col = 1 + agg.func_num;
+    row_reader_t group_reader;
+    row_writer_t group_writer;
+    T *group_row = NULL;
+    if (agg.group_by_key)
+    {
+        reader_init(&group_reader, (uint32_t)DPU_MRAM_HEAP_POINTER, col_num);
+        writer_init(&group_writer, 0, group_col, GROUP_SIZE);
+        group_row = (T *)mem_alloc(group_col * sizeof(T));
+    }
+
     /* ************ */
     /*     Sort     */
     /* ************ */
 
-    // Sort the data
-    insertion_sort(addr[tasklet_id], rows[tasklet_id], col_num, join_key);
+    // Sort the data, on single key words when the host found the key range narrow enough
+    if (key_range.narrow)
+    {
+        uint32_t block_end = (uint32_t)DPU_MRAM_HEAP_POINTER + row_num * one_row_size;
+        int start_row = start / col_num;
+        uint32_t scratch_addr = block_end + start_row * (2 * sizeof(uint64_t) + one_row_size);
+        key_sort(addr[tasklet_id], rows[tasklet_id], col_num, join_key, key_range.base, scratch_addr, first_row);
+    }
+    else
+    {
+        insertion_sort(addr[tasklet_id], rows[tasklet_id], col_num, join_key, first_row, second_row);
+    }
 
     // Barrier
-    barrier_wait(&my_barrier);
+    stats_barrier_wait(tasklet_id, &my_barrier);
 
     /* *************************** */
     /*     Merge with tasklets     */
@@ -242,17 +425,10 @@ int main()
     int running = using_tasklets;
     int step = 2;
 
-    // Initialize local caches
-    T *first_row = (T *)mem_alloc(one_row_size);
-    T *second_row = (T *)mem_alloc(one_row_size);
-    T *tmp_row = (T *)mem_alloc(one_row_size);
-    T *save_row = (T *)mem_alloc(one_row_size);
-
     while (running > 1)
     {
-        // If the tasklet_id is 0, reduce the running count by half
-        if (tasklet_id == 0)
-            running = (running + 1) / 2;
+        // Every tasklet halves the running count, so all of them leave the loop together
+        running = (running + 1) / 2;
 
         // If the tasklet_id is a multiple of the step value
         if (tasklet_id % step == 0)
@@ -289,7 +465,7 @@ int main()
                             mram_read((__mram_ptr void *)(second_addr), save_row, one_row_size);
                             mram_read((__mram_ptr void *)(second_addr + change_idx * one_row_size), tmp_row, one_row_size);
 
-                            int next_val = tmp_row[join_key];
+                            T next_val = tmp_row[join_key];
                             while (next_val < save_row[join_key])
                             {
                                 mram_write(tmp_row, (__mram_ptr void *)(second_addr + (change_idx - 1) * one_row_size), one_row_size);
@@ -319,10 +495,127 @@ int main()
         }
 
         // Barrier
-        barrier_wait(&my_barrier);
+        stats_barrier_wait(tasklet_id, &my_barrier);
+    }
+
+    /* **************** */
+    /*     Group by     */
+    /* **************** */
+
+    // Each run of equal keys becomes one row of the key followed by the aggregates
+    // A tasklet owns the groups that start in its even slice of the sorted rows and finishes the last one
+    // past the slice end, the group rows are staged and then packed to the block start
+    if (agg.group_by_key)
+    {
+        uint32_t base_addr = (uint32_t)DPU_MRAM_HEAP_POINTER;
+        int group_row_size = group_col * sizeof(T);
+        int slice = row_num / NR_TASKLETS;
+        int remain_rows = row_num % NR_TASKLETS;
+        int slice_start = tasklet_id * slice + (tasklet_id < remain_rows ? tasklet_id : remain_rows);
+        int slice_end = slice_start + slice + (tasklet_id < remain_rows ? 1 : 0);
+
+        // Group rows can be wider than the input rows, the staging area starts past both packed sizes
+        uint32_t staging_addr = base_addr + row_num * (one_row_size > group_row_size ? one_row_size : group_row_size);
+
+        int idx = slice_start > 0 ? slice_start - 1 : slice_start;
+        group_writer.addr = staging_addr + slice_start * group_row_size;
+        T *row = reader_seek(&group_reader, base_addr + idx * one_row_size);
+
+        // Skip the rows of a group started by the previous slice
+        if (slice_start > 0 && slice_start < slice_end)
+        {
+            T prev_key = row[join_key];
+            row = reader_next(&group_reader);
+            idx++;
+            while (idx < slice_end && row[join_key] == prev_key)
+            {
+                row = reader_next(&group_reader);
+                idx++;
+            }
+        }
+
+        int group_num = 0;
+        while (idx < slice_end)
+        {
+            T key = row[join_key];
+            group_row[0] = key;
+            for (int f = 0; f < agg.func_num; f++)
+            {
+                group_row[1 + f] = agg.funcs[f] == AGG_COUNT ? 1 : row[agg.cols[f]];
+            }
+
+            row = reader_next(&group_reader);
+            idx++;
+            while (idx < row_num && row[join_key] == key)
+            {
+                for (int f = 0; f < agg.func_num; f++)
+                {
+                    group_row[1 + f] = agg_fold(agg.funcs[f], group_row[1 + f], agg.funcs[f] == AGG_COUNT ? 1 : row[agg.cols[f]]);
+                }
+                row = reader_next(&group_reader);
+                idx++;
+            }
+
+            writer_append(&group_writer, group_row);
+            group_num++;
+        }
+        writer_flush(&group_writer);
+        groups[tasklet_id] = group_num;
+
+        // Barrier
+        stats_barrier_wait(tasklet_id, &my_barrier);
+
+        // Pack the staged group rows, the input below them is no longer read
+        int packed = 0;
+        for (int t = 0; t < tasklet_id; t++)
+        {
+            packed += groups[t];
+        }
+
+        uint32_t src_addr = staging_addr + slice_start * group_row_size;
+        uint32_t dst_addr = base_addr + packed * group_row_size;
+        stats_begin(tasklet_id);
+        for (int done = 0; done < group_num; done += group_writer.cap_rows)
+        {
+            int copy_rows = group_num - done < group_writer.cap_rows ? group_num - done : group_writer.cap_rows;
+            mram_read((__mram_ptr void *)(src_addr + done * group_row_size), group_writer.buf, copy_rows * group_row_size);
+            mram_write(group_writer.buf, (__mram_ptr void *)(dst_addr + done * group_row_size), copy_rows * group_row_size);
+        }
+        stats_end(tasklet_id, PHASE_WRITE);
+
+        // Barrier
+        stats_barrier_wait(tasklet_id, &my_barrier);
+
+        // The block now holds the group rows, keyed on their first column
+        if (tasklet_id == NR_TASKLETS - 1)
+        {
+            bl.key_col = 0;
+            bl.col_num = group_col;
+            bl.row_num = packed + group_num;
+        }
+
+        col_num = group_col;
+        join_key = 0;
+        row_num = 0;
+        for (int t = 0; t < NR_TASKLETS; t++)
+        {
+            row_num += groups[t];
+        }
+        one_row_size = col_num * sizeof(T);
     }
 
+    /* ******************** */
+    /*     Sparse index     */
+    /* ******************** */
+
+    // Every sorted block goes back with a sample of its keys right after its rows
+    uint32_t block_addr = (uint32_t)DPU_MRAM_HEAP_POINTER;
+    stats_begin(tasklet_id);
+    index_write(tasklet_id, block_addr, col_num, join_key, row_num, block_addr + row_num * one_row_size, index_buf, INDEX_SIZE);
+    stats_end(tasklet_id, PHASE_WRITE);
+
     mem_reset();
 
+    stats_stop(tasklet_id);
     return 0;
 }
\ No newline at end of file
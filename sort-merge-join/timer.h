@@ -1,63 +1,215 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 /*
- * Copyright (c) 2016 University of Cordoba and University of Illinois
- * All rights reserved.
- *
- * Developed by:    IMPACT Research Group
- *                  University of Cordoba and University of Illinois
- *                  http://impact.crhc.illinois.edu/
- *
- * Permission is hereby granted, free of charge, to any person obtaining a copy
- * of this software and associated documentation files (the "Software"), to deal
- * with the Software without restriction, including without limitation the
- * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
- * sell copies of the Software, and to permit persons to whom the Software is
- * furnished to do so, subject to the following conditions:
- *
- *      > Redistributions of source code must retain the above copyright notice,
- *        this list of conditions and the following disclaimers.
- *      > Redistributions in binary form must reproduce the above copyright
- *        notice, this list of conditions and the following disclaimers in the
- *        documentation and/or other materials provided with the distribution.
- *      > Neither the names of IMPACT Research Group, University of Cordoba,
- *        University of Illinois nor the names of its contributors may be used
- *        to endorse or promote products derived from this Software without
- *        specific prior written permission.
- *
- * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
- * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
- * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
- * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
- * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
- * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS WITH
- * THE SOFTWARE.
+ * Host-side phase timer on CLOCK_MONOTONIC
  *
+ * timer_begin opens a named scope inside the innermost open scope and timer_end closes it.
+ * A scope opened again under the same parent adds to its time and calls, so a stage keeps
+ * one total per step and every merge round keeps its own scope. The class of a scope puts
+ * the transfers (cpu-dpu, dpu-cpu) and the launches (dpu) in the EXEC TIME totals,
+ * timer_bytes counts the bytes moved inside the innermost scope and timer_print derives
+ * their bandwidth. With log set every closed scope is also kept as a span for the trace.
  */
 
-#include <sys/time.h>
+#define MAX_TIMER_SCOPES 256
+#define MAX_TIMER_DEPTH 8
+
+typedef enum
+{
+    TIMER_STAGE,
+    TIMER_HOST,
+    TIMER_SETUP,
+    TIMER_CPU_DPU,
+    TIMER_DPU,
+    TIMER_DPU_CPU,
+    TIMER_CLASS_NUM
+} timer_class_t;
+
+const char *timer_class_names[TIMER_CLASS_NUM] = {"stage", "host", "setup", "cpu-dpu", "dpu", "dpu-cpu"};
+
+typedef struct
+{
+    char name[40];
+    int parent;
+    int depth;
+    int cls;
+    uint64_t calls;
+    uint64_t bytes;
+    double ms;
+} timer_scope_t;
 
-typedef struct Timer
+// One closed scope, in microseconds since the first reading of the clock
+typedef struct
 {
+    int scope;
+    double start;
+    double end;
+    uint64_t bytes;
+} timer_span_t;
 
-    struct timeval startTime[7];
-    struct timeval stopTime[7];
-    double time[7];
+typedef struct
+{
+    bool started;
+    struct timespec origin;
+    timer_scope_t scopes[MAX_TIMER_SCOPES];
+    int scope_num;
+    // Open scopes, the innermost last
+    int open[MAX_TIMER_DEPTH];
+    double open_start[MAX_TIMER_DEPTH];
+    uint64_t open_bytes[MAX_TIMER_DEPTH];
+    int depth;
+    bool log;
+    timer_span_t *spans;
+    int span_num;
+    int span_cap;
+} phase_timer_t;
+
+phase_timer_t phase_timer = {0};
+
+// Microseconds since the first call
+double timer_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!phase_timer.started)
+    {
+        phase_timer.started = true;
+        phase_timer.origin = now;
+    }
 
-} Timer;
+    return (now.tv_sec - phase_timer.origin.tv_sec) * 1000000.0 + (now.tv_nsec - phase_timer.origin.tv_nsec) / 1000.0;
+}
 
-void start(Timer *timer, int i, int rep)
+void timer_begin(const char *name, int cls)
 {
-    if (rep == 0)
+    if (phase_timer.depth == MAX_TIMER_DEPTH)
+    {
+        fprintf(stderr, "Timer: scope %s nested deeper than %d\n", name, MAX_TIMER_DEPTH);
+        exit(EXIT_FAILURE);
+    }
+
+    int parent = phase_timer.depth > 0 ? phase_timer.open[phase_timer.depth - 1] : -1;
+    int s = 0;
+    while (s < phase_timer.scope_num && (phase_timer.scopes[s].parent != parent || strcmp(phase_timer.scopes[s].name, name) != 0))
+        s++;
+
+    if (s == phase_timer.scope_num)
     {
-        timer->time[i] = 0.0;
+        if (s == MAX_TIMER_SCOPES)
+        {
+            fprintf(stderr, "Timer: more than %d scopes\n", MAX_TIMER_SCOPES);
+            exit(EXIT_FAILURE);
+        }
+
+        timer_scope_t *scope = &phase_timer.scopes[phase_timer.scope_num++];
+        snprintf(scope->name, sizeof(scope->name), "%s", name);
+        scope->parent = parent;
+        scope->depth = phase_timer.depth;
+        scope->cls = cls;
+        scope->calls = 0;
+        scope->bytes = 0;
+        scope->ms = 0.0;
     }
-    gettimeofday(&timer->startTime[i], NULL);
+
+    phase_timer.open[phase_timer.depth] = s;
+    phase_timer.open_bytes[phase_timer.depth] = 0;
+    phase_timer.open_start[phase_timer.depth++] = timer_now();
 }
 
-void stop(Timer *timer, int i)
+// Counts bytes moved by the innermost open scope
+void timer_bytes(uint64_t bytes)
 {
-    gettimeofday(&timer->stopTime[i], NULL);
-    timer->time[i] += (timer->stopTime[i].tv_sec - timer->startTime[i].tv_sec) * 1000000.0 +
-                      (timer->stopTime[i].tv_usec - timer->startTime[i].tv_usec);
+    if (phase_timer.depth > 0)
+        phase_timer.open_bytes[phase_timer.depth - 1] += bytes;
 }
 
-void print(Timer *timer, int i, int REP) { printf("Time (ms): %f\t", timer->time[i] / (1000 * REP)); }
\ No newline at end of file
+// Closes the innermost open scope and returns its time in ms
+double timer_end(void)
+{
+    double end = timer_now();
+    int d = --phase_timer.depth;
+    timer_scope_t *scope = &phase_timer.scopes[phase_timer.open[d]];
+    double ms = (end - phase_timer.open_start[d]) / 1000;
+
+    scope->calls++;
+    scope->ms += ms;
+    scope->bytes += phase_timer.open_bytes[d];
+
+    if (phase_timer.log)
+    {
+        if (phase_timer.span_num == phase_timer.span_cap)
+        {
+            phase_timer.span_cap = phase_timer.span_cap == 0 ? 1024 : phase_timer.span_cap * 2;
+            phase_timer.spans = (timer_span_t *)realloc(phase_timer.spans, phase_timer.span_cap * sizeof(timer_span_t));
+        }
+
+        timer_span_t *span = &phase_timer.spans[phase_timer.span_num++];
+        span->scope = phase_timer.open[d];
+        span->start = phase_timer.open_start[d];
+        span->end = end;
+        span->bytes = phase_timer.open_bytes[d];
+    }
+
+    return ms;
+}
+
+// Time of all the scopes of a class in ms, for the classes whose scopes never nest
+double timer_class_total(int cls)
+{
+    double ms = 0.0;
+    for (int s = 0; s < phase_timer.scope_num; s++)
+    {
+        if (phase_timer.scopes[s].cls == cls)
+            ms += phase_timer.scopes[s].ms;
+    }
+
+    return ms;
+}
+
+// Time of the outermost scopes in ms
+double timer_total(void)
+{
+    double ms = 0.0;
+    for (int s = 0; s < phase_timer.scope_num; s++)
+    {
+        if (phase_timer.scopes[s].parent < 0)
+            ms += phase_timer.scopes[s].ms;
+    }
+
+    return ms;
+}
+
+void timer_print_scope(int s)
+{
+    const timer_scope_t *scope = &phase_timer.scopes[s];
+    int indent = 2 * scope->depth;
+
+    printf("%*s%-*s %-8s %12.3f %8lu", indent, "", 40 - indent, scope->name, timer_class_names[scope->cls], scope->ms, (unsigned long)scope->calls);
+    if (scope->bytes > 0)
+        printf(" %14lu %10.1f", (unsigned long)scope->bytes, scope->ms > 0 ? scope->bytes / (scope->ms * 1000) : 0.0);
+    printf("\n");
+
+    for (int c = s + 1; c < phase_timer.scope_num; c++)
+    {
+        if (phase_timer.scopes[c].parent == s)
+            timer_print_scope(c);
+    }
+}
+
+// Prints every scope under its parent in the order they were first opened, bandwidth in MB/s
+void timer_print(void)
+{
+    printf("######## PHASES #######\n");
+    printf("%-40s %-8s %12s %8s %14s %10s\n", "phase", "class", "ms", "calls", "bytes", "MB/s");
+    for (int s = 0; s < phase_timer.scope_num; s++)
+    {
+        if (phase_timer.scopes[s].parent < 0)
+            timer_print_scope(s);
+    }
+    printf("#######################\n\n");
+}
@@ -0,0 +1,211 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dpu.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "timer.h"
+#include "common.h"
+#include "user.h"
+#include "predicate.h"
+#include "zone_map.h"
+#include "schema.h"
+#include "dictionary.h"
+#include "trace.h"
+#include "executor.h"
+
+dpu_result_t dpu_result[NR_DPUS];
+
+int main(int argc, char *argv[])
+{
+    // Get file name
+    if (argc < 6)
+    {
+        fprintf(stderr, "Usage: %s <table.csv> --order-by colN [--desc] --limit K [--where <predicate>] [--trace <trace.json>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    const char *FILE_NAME = argv[1];
+
+    // Set variables
+    int col_num = 0;
+    uint64_t row_num = 0;
+    uint64_t total_row_num = 0;
+    T *test_array = NULL;
+    const char *trace_file = NULL;
+
+    timer_begin("csv size", TIMER_HOST);
+    set_csv_size(FILE_NAME, &col_num, &row_num);
+    timer_end();
+
+    // Every row is kept by default
+    predicate_t pred = {0};
+    topk_args_t topk = {0};
+    topk.col = -1;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--order-by") == 0 && i + 1 < argc)
+        {
+            topk.col = parse_column(argv[++i], col_num);
+            if (topk.col < 0)
+            {
+                fprintf(stderr, "Unknown order column %s\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "--desc") == 0)
+        {
+            topk.desc = 1;
+        }
+        else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc)
+        {
+            topk.k = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--where") == 0 && i + 1 < argc)
+        {
+            if (parse_predicate(argv[++i], col_num, &pred) != 0)
+                exit(EXIT_FAILURE);
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            trace_file = argv[++i];
+            trace_enable();
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (topk.col < 0 || topk.k < 1 || topk.k > MAX_TOPK)
+    {
+        fprintf(stderr, "--order-by and --limit 1..%d are required\n", MAX_TOPK);
+        exit(EXIT_FAILURE);
+    }
+
+    check_row_size("Select", col_num, select_wram_size(col_num));
+
+    // String columns are dictionary encoded, codes in string order
+    dict_t dict = {0};
+    bool str_cols[col_num];
+    timer_begin("load csv", TIMER_HOST);
+    load_csv(FILE_NAME, col_num, row_num, &test_array, &dict, str_cols);
+    timer_end();
+
+    timer_begin("dictionary", TIMER_HOST);
+    int *remap = dict_sort(&dict);
+    dict_remap(remap, test_array, row_num, col_num, str_cols);
+    free(remap);
+    timer_end();
+
+    // Columns are sent to the select kernel in the narrowest width holding their values
+    schema_t schema;
+    infer_schema(test_array, row_num, col_num, &schema);
+
+    int using_dpus = row_num / NR_DPUS == 0 ? 1 : NR_DPUS;
+    uint64_t row_size = row_num / using_dpus;
+    uint64_t last_rows = row_num - (using_dpus - 1) * row_size;
+    check_mram_size("Select", using_dpus - 1, last_rows, select_mram_size(last_rows, &schema));
+
+    /* ********************* */
+    /*     select, top-K     */
+    /* ********************* */
+
+    // Split the table evenly, the last DPU takes the remainder
+    dpu_block_t input_args[using_dpus];
+    T *input_rows[using_dpus];
+    for (int i = 0; i < using_dpus; i++)
+    {
+        input_args[i].table_num = 0;
+        input_args[i].key_col = topk.col;
+        input_args[i].col_num = col_num;
+        input_args[i].row_num = i < using_dpus - 1 ? row_size : last_rows;
+        input_rows[i] = test_array + i * row_size * col_num;
+    }
+
+    // Every DPU returns its k first selected rows, there is no sort or merge round
+    select_blocks(input_args, input_rows, dpu_result, using_dpus, &schema, &pred, &topk, -1, NULL);
+    free(test_array);
+
+    for (int i = 0; i < using_dpus; i++)
+    {
+        total_row_num += input_args[i].row_num;
+    }
+
+    /* ************************** */
+    /*     merge the top rows     */
+    /* ************************** */
+
+    T *result = (T *)malloc(topk.k * col_num * sizeof(T));
+    int result_num = merge_topk(&topk, dpu_result, using_dpus, col_num, result);
+
+    for (int i = 0; i < using_dpus; i++)
+    {
+        free(dpu_result[i].arr);
+    }
+
+#ifdef DEBUG
+    printf("==================\n");
+    printf("#     top-K      #\n");
+    printf("==================\n");
+
+    printf("%d of %lu selected rows\n", result_num, (unsigned long)total_row_num);
+    printf("####################\n\n");
+#endif
+
+    // save result as csv file
+    timer_begin("write result", TIMER_HOST);
+    FILE *file = fopen("./data/result.csv", "w");
+    if (!file)
+    {
+        perror("Failed to open file");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 1; i <= col_num; i++)
+    {
+        fprintf(file, "col%d", i);
+        if (i < col_num)
+        {
+            fprintf(file, ",");
+        }
+    }
+    fprintf(file, "\n");
+
+    for (int i = 0; i < result_num; i++)
+    {
+        for (int j = 0; j < col_num; j++)
+        {
+            write_value(file, &dict, str_cols[j], result[i * col_num + j]);
+            if (j < col_num - 1)
+            {
+                fprintf(file, ",");
+            }
+        }
+        fprintf(file, "\n");
+    }
+
+    fclose(file);
+    timer_end();
+    free(result);
+    dict_free(&dict);
+
+    printf("\n");
+    printf("######### PIM #########\n");
+    printf("###  SELECT, TOP-K  ###\n");
+    printf("         EXEC TIME     \n");
+    printf("CPU-DPU  %f\n", timer_class_total(TIMER_CPU_DPU));
+    printf("DPU      %f\n", timer_class_total(TIMER_DPU));
+    printf("DPU-CPU  %f\n", timer_class_total(TIMER_DPU_CPU));
+    printf("-----------------------\n");
+    printf("TOTAL %f\n", timer_class_total(TIMER_CPU_DPU) + timer_class_total(TIMER_DPU) + timer_class_total(TIMER_DPU_CPU));
+    printf("#######################\n\n");
+
+    stats_print();
+    timer_print();
+
+    if (trace_file != NULL)
+        trace_write(trace_file);
+
+    return 0;
+}
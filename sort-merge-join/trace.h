@@ -0,0 +1,159 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Host-side timeline of a run in the Chrome trace-event format
+ *
+ * Once trace_enable is called the phase timer keeps every closed scope: each DPU allocation,
+ * program load, transfer (with its bytes), launch, host compute step, stage and merge round
+ * becomes a complete event ("ph":"X") on the host track, nested like the scopes. After a launch
+ * the phase cycles of the slowest tasklet of every DPU are laid out inside the launch span on
+ * the track of the DPU, in cycles / DPU_CLOCK_MHZ microseconds: the kernel span holds its load,
+ * compute, barrier and write spans back to back (their totals, not their real order).
+ * trace_write saves the events as JSON for Perfetto or chrome://tracing.
+ */
+
+#ifndef DPU_CLOCK_MHZ
+#define DPU_CLOCK_MHZ 350
+#endif
+
+#define TRACE_HOST_PID 0
+#define TRACE_DPU_PID 1
+
+// DPU span, the host spans are the scopes of the phase timer
+typedef struct
+{
+    const char *name;
+    int tid;
+    double ts;
+    double dur;
+    uint64_t cycles;
+} trace_event_t;
+
+typedef struct
+{
+    bool enabled;
+    trace_event_t *events;
+    int event_num;
+    int event_cap;
+    int max_dpu;
+} trace_t;
+
+trace_t trace = {0};
+
+void trace_enable(void)
+{
+    trace.enabled = true;
+    trace.max_dpu = -1;
+    phase_timer.log = true;
+}
+
+void trace_record(const char *name, int tid, double ts, double dur, uint64_t cycles)
+{
+    if (trace.event_num == trace.event_cap)
+    {
+        trace.event_cap = trace.event_cap == 0 ? 1024 : trace.event_cap * 2;
+        trace.events = (trace_event_t *)realloc(trace.events, trace.event_cap * sizeof(trace_event_t));
+    }
+
+    trace_event_t *event = &trace.events[trace.event_num++];
+    event->name = name;
+    event->tid = tid;
+    event->ts = ts;
+    event->dur = dur;
+    event->cycles = cycles;
+}
+
+// Lays the phase cycles of one tasklet of DPU dpu_id inside the span of the last launch
+// The spans are clipped to the launch, the simulator runs at its own pace
+void trace_dpu_phases(const char *kernel, uint32_t dpu_id, const uint64_t *cycles)
+{
+    if (!trace.enabled)
+        return;
+
+    int launch = phase_timer.span_num - 1;
+    while (launch >= 0 && phase_timer.scopes[phase_timer.spans[launch].scope].cls != TIMER_DPU)
+        launch--;
+    if (launch < 0)
+        return;
+
+    const char *phase_names[PHASE_NUM] = {"load", "compute", "barrier", "write"};
+    double end = phase_timer.spans[launch].end;
+    double ts = phase_timer.spans[launch].start;
+    uint64_t total = 0;
+    for (int p = 0; p < PHASE_NUM; p++)
+    {
+        total += cycles[p];
+    }
+
+    double dur = (double)total / DPU_CLOCK_MHZ;
+    trace_record(kernel, dpu_id, ts, ts + dur > end ? end - ts : dur, total);
+    for (int p = 0; p < PHASE_NUM; p++)
+    {
+        dur = (double)cycles[p] / DPU_CLOCK_MHZ;
+        if (cycles[p] > 0 && ts < end)
+            trace_record(phase_names[p], dpu_id, ts, ts + dur > end ? end - ts : dur, cycles[p]);
+        ts += dur;
+    }
+
+    if ((int)dpu_id > trace.max_dpu)
+        trace.max_dpu = dpu_id;
+}
+
+// Writes the start of a complete event, the caller adds its args and closes it
+// Both ends are rounded to whole nanoseconds, so back to back spans still touch and never overlap
+void trace_write_event(FILE *file, const char *name, const char *cat, int pid, int tid, double ts, double dur)
+{
+    int64_t start_ns = (int64_t)(ts * 1000 + 0.5);
+    int64_t end_ns = (int64_t)((ts + dur) * 1000 + 0.5);
+    fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+            name, cat, pid, tid, start_ns / 1000.0, (end_ns - start_ns) / 1000.0);
+}
+
+// Writes the events as a Chrome trace-event JSON file
+void trace_write(const char *filename)
+{
+    if (!trace.enabled)
+        return;
+
+    FILE *file = fopen(filename, "w");
+    if (!file)
+    {
+        perror("Failed to open trace file");
+        return;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"host\"}},\n", TRACE_HOST_PID);
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"DPUs\"}}", TRACE_DPU_PID);
+    for (int d = 0; d <= trace.max_dpu; d++)
+    {
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"DPU %d\"}}", TRACE_DPU_PID, d, d);
+    }
+
+    for (int e = 0; e < phase_timer.span_num; e++)
+    {
+        const timer_span_t *span = &phase_timer.spans[e];
+        const timer_scope_t *scope = &phase_timer.scopes[span->scope];
+        trace_write_event(file, scope->name, timer_class_names[scope->cls], TRACE_HOST_PID, 0, span->start, span->end - span->start);
+        if (span->bytes > 0)
+            fprintf(file, ",\"args\":{\"bytes\":%lu}", (unsigned long)span->bytes);
+        fprintf(file, "}");
+    }
+
+    for (int e = 0; e < trace.event_num; e++)
+    {
+        const trace_event_t *event = &trace.events[e];
+        trace_write_event(file, event->name, "dpu", TRACE_DPU_PID, event->tid, event->ts, event->dur);
+        fprintf(file, ",\"args\":{\"cycles\":%lu}}", (unsigned long)event->cycles);
+    }
+    fprintf(file, "\n]}\n");
+
+    fclose(file);
+    free(trace.events);
+    trace.events = NULL;
+    trace.event_num = trace.event_cap = 0;
+}
@@ -1,7 +1,12 @@
 // #define DEBUG
 
+// Both can be set at build time, make CFLAG="--std=c99 -DNR_DPUS=32" DNR_TASKLETS=-DNR_TASKLETS=8
+#ifndef NR_DPUS
 #define NR_DPUS 64
+#endif
+#ifndef NR_TASKLETS
 #define NR_TASKLETS 16
+#endif
 
 #define SELECT_COL1 0
 #define SELECT_VAL1 5000
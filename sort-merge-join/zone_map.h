@@ -0,0 +1,111 @@
+#include <stdbool.h>
+
+/*
+ * Host-side zone map helpers
+ *
+ * A zone map keeps the minimum and maximum of every column for each block of ZONE_ROWS rows.
+ * Zone z is stored as col_num minimums followed by col_num maximums, the select kernel
+ * reads the same layout from MRAM.
+ */
+
+// Number of zones covering row_num rows
+int get_zone_num(int row_num)
+{
+    return (row_num + ZONE_ROWS - 1) / ZONE_ROWS;
+}
+
+// Builds the zone map of row_num rows
+void build_zone_map(const T *rows, int row_num, int col_num, T *zone_map)
+{
+    for (int z = 0; z < get_zone_num(row_num); z++)
+    {
+        T *min = zone_map + z * 2 * col_num;
+        T *max = min + col_num;
+        int end = (z + 1) * ZONE_ROWS < row_num ? (z + 1) * ZONE_ROWS : row_num;
+
+        memcpy(min, rows + z * ZONE_ROWS * col_num, col_num * sizeof(T));
+        memcpy(max, rows + z * ZONE_ROWS * col_num, col_num * sizeof(T));
+        for (int r = z * ZONE_ROWS + 1; r < end; r++)
+        {
+            for (int c = 0; c < col_num; c++)
+            {
+                T val = rows[r * col_num + c];
+                if (val < min[c])
+                    min[c] = val;
+                if (val > max[c])
+                    max[c] = val;
+            }
+        }
+    }
+}
+
+// Folds the zones of a zone map into a single zone
+void merge_zone_map(const T *zone_map, int zone_num, int col_num, T *zone)
+{
+    memcpy(zone, zone_map, 2 * col_num * sizeof(T));
+    for (int z = 1; z < zone_num; z++)
+    {
+        const T *min = zone_map + z * 2 * col_num;
+        const T *max = min + col_num;
+        for (int c = 0; c < col_num; c++)
+        {
+            if (min[c] < zone[c])
+                zone[c] = min[c];
+            if (max[c] > zone[col_num + c])
+                zone[col_num + c] = max[c];
+        }
+    }
+}
+
+// Returns false if no row whose values lie in [min, max] can satisfy the term
+bool zone_match_term(const predicate_t *pred, const pred_term_t *term, const T *min, const T *max)
+{
+    T lo = min[term->col];
+    T hi = max[term->col];
+
+    switch (term->op)
+    {
+    case OP_EQ:
+        return term->lo >= lo && term->lo <= hi;
+    case OP_LT:
+        return lo < term->lo;
+    case OP_LE:
+        return lo <= term->lo;
+    case OP_GT:
+        return hi > term->lo;
+    case OP_GE:
+        return hi >= term->lo;
+    case OP_BETWEEN:
+        return term->lo <= hi && term->hi >= lo;
+    case OP_IN:
+        for (int v = term->val_start; v < term->val_start + term->val_num; v++)
+        {
+            if (pred->vals[v] >= lo && pred->vals[v] <= hi)
+                return true;
+        }
+        return false;
+    }
+
+    return true;
+}
+
+// Returns false if no row of the zone can satisfy the predicate
+bool zone_match_predicate(const predicate_t *pred, const T *zone, int col_num)
+{
+    int t = 0;
+
+    for (int c = 0; c < pred->clause_num; c++)
+    {
+        bool clause_match = false;
+        for (; t < pred->term_num && pred->terms[t].clause == c; t++)
+        {
+            if (!clause_match && zone_match_term(pred, &pred->terms[t], zone, zone + col_num))
+                clause_match = true;
+        }
+
+        if (!clause_match)
+            return false;
+    }
+
+    return true;
+}
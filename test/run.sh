@@ -1,31 +1,3 @@
-make
-
-echo "10000 rows"
-./cpu_app ./data/data_1.csv './data/data_1(1).csv'
-./app ./data/data_1.csv './data/data_1(1).csv'
-
-echo "100000 rows"
-./cpu_app ./data/data_10.csv './data/data_10(1).csv'
-./app ./data/data_10.csv './data/data_10(1).csv'
-
-echo "200000 rows"
-./cpu_app ./data/data_20.csv './data/data_20(1).csv'
-./app ./data/data_20.csv './data/data_20(1).csv'
-
-echo "300000 rows"
-./cpu_app ./data/data_30.csv './data/data_30(1).csv'
-./app ./data/data_30.csv './data/data_30(1).csv'
-
-echo "500000 rows"
-./cpu_app ./data/data_50.csv './data/data_50(1).csv'
-./app ./data/data_50.csv './data/data_50(1).csv'
-
-echo "700000 rows"
-./cpu_app ./data/data_70.csv './data/data_70(1).csv'
-./app ./data/data_70.csv './data/data_70(1).csv'
-
-echo "1000000 rows"
-./cpu_app ./data/data_100.csv './data/data_100(1).csv'
-./app ./data/data_100.csv './data/data_100(1).csv'
-
-make clean
\ No newline at end of file
+# The seven table sizes of the original runs through the benchmark driver of sort-merge-join,
+# with warm-up, repetitions and medians. Extra arguments go to run.py, e.g. --repeat 10 --baseline base.json
+python3 "$(dirname "$0")/../sort-merge-join/run.py" --rows 10000,100000,200000,300000,500000,700000,1000000 --dist unique --cpu "$@"